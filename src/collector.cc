@@ -22,9 +22,9 @@ public:
 		m_fileParser(fileParser),
 		m_engine(engine),
 		m_exitCode(-1),
-		m_filter(filter)
+		m_filter(filter),
+		m_filterCache(filter)
 	{
-		m_fileParser.registerLineListener(*this);
 	}
 
 	void registerListener(ICollector::IListener &listener)
@@ -39,6 +39,12 @@ public:
 
 	int run(const std::string &filename)
 	{
+		/*
+		 * After the other line listeners (e.g., the reporter), so that they
+		 * know the address when onBreakpoint is called
+		 */
+		m_fileParser.registerLineListener(*this);
+
 		if (!m_engine.start(*this, filename)) {
 			error("Can't start/attach to %s", filename.c_str());
 			return -1;
@@ -155,8 +161,12 @@ private:
 		case ev_breakpoint:
 			for (ListenerList_t::const_iterator it = m_listeners.begin();
 					it != m_listeners.end();
-					++it)
-				(*it)->onAddressHit(ev.addr, 1);
+					++it) {
+				if (ev.data >= 0)
+					(*it)->onBreakpointHit(ev.data, ev.addr, 1);
+				else
+					(*it)->onAddressHit(ev.addr, 1);
+			}
 
 			break;
 
@@ -174,7 +184,29 @@ private:
 			return;
 		}
 
-		m_engine.registerBreakpoint(addr);
+		registerBreakpoint(addr);
+	}
+
+	void onFileLine(const std::string &file, unsigned int fileId,
+			unsigned int lineNr, uint64_t addr)
+	{
+		if (!m_filterCache.runFilters(fileId, file))
+			return;
+
+		registerBreakpoint(addr);
+	}
+
+	void registerBreakpoint(uint64_t addr)
+	{
+		int id = m_engine.registerBreakpoint(addr);
+
+		if (id < 0)
+			return;
+
+		for (ListenerList_t::const_iterator it = m_listeners.begin();
+				it != m_listeners.end();
+				++it)
+			(*it)->onBreakpoint(id, addr);
 	}
 
 	typedef std::vector<ICollector::IListener *> ListenerList_t;
@@ -187,6 +219,7 @@ private:
 	int m_exitCode;
 
 	IFilter &m_filter;
+	FilterCache m_filterCache;
 };
 
 ICollector &ICollector::create(IFileParser &elf, IEngine &engine, IFilter &filter)
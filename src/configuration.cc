@@ -114,11 +114,16 @@ public:
 				{"pid", required_argument, 0, 'p'},
 				{"limits", required_argument, 0, 'l'},
 				{"output-interval", required_argument, 0, 'O'},
+				{"attach-duration", required_argument, 0, 'A'},
 				{"path-strip-level", required_argument, 0, 'S'},
 				{"skip-solibs", no_argument, 0, 'L'},
 				{"exit-first-process", no_argument, 0, 'F'},
 				{"gcov", no_argument, 0, 'g'},
 				{"clang", no_argument, 0, 'c'},
+				{"in-process", no_argument, 0, 'N'},
+				{"uprobes", no_argument, 0, 'Q'},
+				{"fork-server", required_argument, 0, 'W'},
+				{"line-cache", required_argument, 0, 'K'},
 				{"configure", required_argument, 0, 'M'},
 				{"exclude-pattern", required_argument, 0, 'x'},
 				{"include-pattern", required_argument, 0, 'i'},
@@ -139,6 +144,9 @@ public:
 				{"bash-parser", required_argument, 0, 'B'},
 				{"bash-method", required_argument, 0, '4'},
 				{"verify", no_argument, 0, 'V'},
+				{"basic-blocks", no_argument, 0, 'b'},
+				{"granularity", required_argument, 0, 'n'},
+				{"follow-exec", no_argument, 0, 'E'},
 				{"version", no_argument, 0, 'v'},
 				{"uncommon-options", no_argument, 0, 'U'},
 				/*{"write-file", required_argument, 0, 'w'}, Take back when the kernel stuff works */
@@ -228,6 +236,16 @@ public:
 						"kcov: binutils-dev), so the --verify option will not do anything.\n");
 #endif
 				break;
+			case 'b':
+				setKey("basic-blocks", 1);
+#if KCOV_HAS_LIBBFD == 0
+				warning("kcov: WARNING: kcov has been built without libbfd-dev (or\n"
+						"kcov: binutils-dev), so the --basic-blocks option will not do anything.\n");
+#endif
+				break;
+			case 'E':
+				setKey("follow-exec", 1);
+				break;
 			case 'v':
 				printf("kcov %s\n", kcov_version);
 				exit(0);
@@ -244,6 +262,21 @@ public:
 			case 'c':
 				setKey("clang-sanitizer", 1);
 				break;
+			case 'N':
+				setKey("in-process", 1);
+				break;
+			case 'Q':
+				setKey("uprobes", 1);
+				break;
+			case 'W':
+				if (!file_exists(std::string(optarg)))
+					return usage();
+
+				setKey("fork-server", get_real_path(std::string(optarg)));
+				break;
+			case 'K':
+				setKey("line-cache", std::string(optarg));
+				break;
 			case 'p':
 			{
 				if (!isInteger(std::string(optarg)))
@@ -265,6 +298,12 @@ public:
 
 				setKey("output-interval", stoul(std::string(optarg)));
 				break;
+			case 'A':
+				if (!isInteger(std::string(optarg)))
+					return usage();
+
+				setKey("attach-duration", stoul(std::string(optarg)));
+				break;
 			case 'S':
 			{
 				if (!isInteger(std::string(optarg)))
@@ -360,6 +399,14 @@ public:
 				else
 					panic("Invalid bash method: Use PS4 or DEBUG\n");
 			} break;
+			case 'n':
+			{
+				std::string s(optarg);
+
+				if (s != "address" && s != "line" && s != "function")
+					panic("Invalid granularity: Use address, line or function\n");
+				setKey("granularity", s);
+			} break;
 			case 'C':
 				setKey("running-mode", IConfiguration::MODE_COLLECT_ONLY);
 				break;
@@ -512,9 +559,14 @@ public:
 		setKey("parse-solibs", 1);
 		setKey("gcov", 0);
 		setKey("clang-sanitizer", 0);
+		setKey("in-process", 0);
+		setKey("uprobes", 0);
+		setKey("fork-server", "");
+		setKey("line-cache", "");
 		setKey("low-limit", 25);
 		setKey("high-limit", 75);
 		setKey("output-interval", 5000);
+		setKey("attach-duration", 0);
 		setKey("daemonize-on-first-process-exit", 0);
 		setKey("coveralls-id", "");
 		setKey("strip-path", "");
@@ -532,10 +584,18 @@ public:
 		setKey("bash-use-basic-parser", 0);
 		setKey("bash-use-ps4", 1);
 		setKey("verify", 0);
+		setKey("basic-blocks", 0);
+		setKey("granularity", "address");
+		setKey("follow-exec", 0);
 		setKey("command-name", "");
 		setKey("merged-name", "[merged]");
 		setKey("css-file", "");
 		setKey("lldb-use-raw-breakpoint-writes", 0);
+		setKey("auto-detach", 1);
+		setKey("pin-cpu", 0);
+		setKey("tracer-threads", 0);
+		setKey("uprobe-max-probes", 0);
+		setKey("in-process-max-breakpoints", 0);
 	}
 
 
@@ -575,7 +635,12 @@ public:
 	{
 		if (key == "low-limit" ||
 				key == "high-limit" ||
-				key == "bash-use-basic-parser") {
+				key == "bash-use-basic-parser" ||
+				key == "auto-detach" ||
+				key == "pin-cpu" ||
+				key == "tracer-threads" ||
+				key == "uprobe-max-probes" ||
+				key == "in-process-max-breakpoints") {
 			if (!isInteger(value))
 				panic("Value for %s must be integer\n", key.c_str());
 		}
@@ -588,6 +653,16 @@ public:
 			setKey(key, stoul(std::string(value)));
 		else if (key == "lldb-use-raw-breakpoint-writes")
 			setKey(key, stoul(std::string(value)));
+		else if (key == "auto-detach")
+			setKey(key, stoul(std::string(value)));
+		else if (key == "pin-cpu")
+			setKey(key, stoul(std::string(value)));
+		else if (key == "tracer-threads")
+			setKey(key, stoul(std::string(value)));
+		else if (key == "uprobe-max-probes")
+			setKey(key, stoul(std::string(value)));
+		else if (key == "in-process-max-breakpoints")
+			setKey(key, stoul(std::string(value)));
 		else if (key == "command-name")
 			setKey(key, std::string(value));
 		else if (key == "css-file")
@@ -601,12 +676,27 @@ public:
 	const char *getConfigurableValues()
 	{
 		return
+		"                           auto-detach=0              Keep tracing processes without\n"
+		"                                                      breakpoints left\n"
 		"                           bash-use-basic-parser=1    Enable simple bash parser\n"
 		"                           command-name=STR           Name of executed command\n"
 		"                           css-file=FILE              Filename of bcov.css file\n"
 		"                           high-limit=NUM             Percentage for high coverage\n"
+		"                           in-process-max-breakpoints=NUM\n"
+		"                                                      Max --in-process breakpoints,\n"
+		"                                                      kcov stops with an error when\n"
+		"                                                      a program needs more (default:\n"
+		"                                                      1572864)\n"
 		"                           low-limit=NUM              Percentage for low coverage\n"
-		"                           merged-name=STR            Name of [merged] tag in HTML\n";
+		"                           merged-name=STR            Name of [merged] tag in HTML\n"
+		"                           pin-cpu=1                  Run kcov and the traced program\n"
+		"                                                      on a single CPU (always done on\n"
+		"                                                      non-x86)\n"
+		"                           tracer-threads=NUM         Max threads tracing forked\n"
+		"                                                      processes (default: #CPUs)\n"
+		"                           uprobe-max-probes=NUM      Max uprobes, kcov stops with\n"
+		"                                                      an error when a program needs\n"
+		"                                                      more (default: 32768)\n";
 	}
 
 	std::string uncommonOptions()
@@ -621,11 +711,30 @@ public:
 				"\n"
 				" --gcov                  use gcov parser instead of DWARF debugging info\n"
 				" --clang                 use Clang Sanitizer-coverage parser\n"
+				" --in-process            handle breakpoints inside the program (x86 only)\n"
+				"                         instead of stopping it for every hit\n"
+				" --uprobes               let the kernel handle breakpoints as uprobes (needs\n"
+				"                         root and tracefs). Up to 32768 probed lines, see\n"
+				"                         uprobe-max-probes in --uncommon-options\n"
+				" --fork-server=file      run the program once per input file listed in file\n"
+				"                         (one per line, given on stdin), each run forked from\n"
+				"                         the instrumented program before main\n"
+				" --server=socket         keep parsed debug info and sources in memory and run\n"
+				"                         kcov for clients with KCOV_SERVER=socket set (the\n"
+				"                         only option, must be given alone)\n"
+				" --line-cache=dir        keep the line tables parsed from the debug info in\n"
+				"                         dir, one per build-id, and use them in later runs.\n"
+				"                         With path filters, only the included compilation\n"
+				"                         units are parsed and kept, so runs with other\n"
+				"                         filters parse again and keep tables of their own\n"
 				" --skip-solibs           don't parse shared libraries (default: parse solibs)\n"
 				" --exit-first-process    exit when the first process exits, i.e., honor the\n"
 				"                         behavior of daemons (default: wait until last)\n"
 				" --output-interval=ms    Interval to produce output in milliseconds (0 to\n"
 				"                         only output when kcov terminates, default %d)\n"
+				" --attach-duration=s     detach after s seconds, restoring the original code,\n"
+				"                         and leave the program running. With --pid, SIGUSR1\n"
+				"                         to kcov also detaches (default: 0, never)\n"
 				"\n"
 				" --debug=X               set kcov debugging level (max 31, default 0)\n"
 				"\n"
@@ -633,6 +742,13 @@ public:
 				"%s"
 				"\n"
 				" --verify                verify breakpoint setup (to catch compiler bugs)\n"
+				" --basic-blocks          report all lines of a basic block when its first\n"
+				"                         instruction is hit, which saves breakpoint traps\n"
+				" --granularity=what      breakpoint granularity: address (default, every\n"
+				"                         line table address), line (one per source line) or\n"
+				"                         function (function entry points only)\n"
+				" --follow-exec           also cover programs exec:ed by the traced processes\n"
+				"                         (with debug info), each in its own output directory\n"
 				"\n"
 				" --python-parser=cmd     Python parser to use (for python script coverage),\n"
 				"                         default: %s\n"
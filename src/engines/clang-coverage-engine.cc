@@ -218,12 +218,12 @@ private:
 		for (std::vector<uint64_t>::iterator it = bb.begin();
 				it != bb.end();
 				++it)
-			reportEvent(ev_breakpoint, 0, *it);
+			reportEvent(ev_breakpoint, -1, *it);
 
 		// Fallback in case kcov is broken
 		if (bb.empty()) {
 			kcov_debug(ENGINE_MSG, "Address 0x%llx not in a basic block\n", (long long)address);
-			reportEvent(ev_breakpoint, 0, address);
+			reportEvent(ev_breakpoint, -1, address);
 		}
 	}
 
@@ -29,7 +29,8 @@ public:
 
 	int registerBreakpoint(unsigned long addr)
 	{
-		return 0;
+		// Hits come from the gcda files
+		return -1;
 	}
 
 	bool start(IEventListener &listener, const std::string &executable)
@@ -150,12 +151,12 @@ private:
 			if (counter == 0)
 				continue;
 
-			reportBasicBlockHit(bbsByNumber[cur.m_dstBlock], counter);
-			reportBasicBlockHit(bbsByNumber[cur.m_srcBlock], counter);
+			reportBasicBlockHit(bbsByNumber[cur.m_dstBlock]);
+			reportBasicBlockHit(bbsByNumber[cur.m_srcBlock]);
 		}
 	}
 
-	void reportBasicBlockHit(const GcnoParser::BasicBlockList_t &bbs, int64_t counter)
+	void reportBasicBlockHit(const GcnoParser::BasicBlockList_t &bbs)
 	{
 		for (GcnoParser::BasicBlockList_t::const_iterator it = bbs.begin();
 				it != bbs.end();
@@ -163,7 +164,7 @@ private:
 			const GcnoParser::BasicBlockMapping &bb = *it;
 
 			uint64_t addr = gcovGetAddress(bb.m_file, bb.m_function, bb.m_basicBlock, bb.m_index);
-			Event ev(ev_breakpoint, counter, addr);
+			Event ev(ev_breakpoint, -1, addr);
 
 			m_listener->onEvent(ev);
 		}
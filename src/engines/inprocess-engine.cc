@@ -0,0 +1,419 @@
+#include <engine.hh>
+#include <utils.hh>
+#include <configuration.hh>
+#include <capabilities.hh>
+#include <file-parser.hh>
+#include <output-handler.hh>
+#include <solib-handler.hh>
+#include <inprocess_data.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+#include <vector>
+#include <algorithm>
+
+using namespace kcov;
+
+// Keep the probe sequences short: At most 3/4 of the slots are used
+#define DEFAULT_MAX_BREAKPOINTS (3 << 19)
+
+static int g_wakeFd = -1;
+
+// Exited children wake up continueExecution as well
+static void child_signal_handler(int sig)
+{
+	int saved = errno;
+	char c = 'c';
+
+	if (write(g_wakeFd, &c, 1) < 0) {
+		// Full, so it's readable anyway
+	}
+	errno = saved;
+}
+
+/*
+ * Breakpoints handled by the program itself: The preloaded solib library
+ * installs the int3:s and marks hits in a shared bitmap, which is read
+ * here when woken up by a hit. So the program is never stopped, but only
+ * x86 is supported.
+ */
+class InProcessEngine : public IEngine
+{
+public:
+	InProcessEngine() :
+		m_listener(NULL),
+		m_data(NULL),
+		m_size(0),
+		m_wakeFd(-1),
+		m_firstChild(-1),
+		m_firstExitReported(false),
+		m_lastExitStatus(0),
+		m_lastHits(0),
+		m_nEntries(0),
+		m_maxEntries(DEFAULT_MAX_BREAKPOINTS),
+		m_full(false)
+	{
+		int maxEntries = IConfiguration::getInstance().keyAsInt("in-process-max-breakpoints");
+
+		if (maxEntries > 0)
+			m_maxEntries = maxEntries;
+	}
+
+	~InProcessEngine()
+	{
+		if (m_data)
+			munmap(m_data, m_size);
+		if (m_path != "")
+			unlink(m_path.c_str());
+		if (m_wakeFd >= 0) {
+			signal(SIGCHLD, SIG_DFL);
+			close(m_wakeFd);
+			unlink(m_wakePath.c_str());
+		}
+	}
+
+	int registerBreakpoint(unsigned long addr)
+	{
+		if (!m_data || addr == 0)
+			return -1;
+
+		uint64_t *entries = inprocess_data_entries(m_data);
+		uint32_t mask = m_data->n_slots - 1;
+		uint32_t slot = inprocess_data_hash(m_data, addr);
+
+		while (entries[slot] != 0) {
+			if (entries[slot] == addr)
+				return m_slotIds[slot];
+
+			slot = (slot + 1) & mask;
+		}
+
+		// Reported (and kcov stopped) in continueExecution
+		if (m_nEntries >= m_maxEntries) {
+			m_full = true;
+
+			return -1;
+		}
+
+		// Published in continueExecution. The ID is the index in the order
+		entries[slot] = addr;
+		inprocess_data_order(m_data)[m_nEntries] = slot;
+		m_slotIds[slot] = m_nEntries;
+		m_nEntries++;
+
+		kcov_debug(BP_MSG, "IP BP registered at 0x%lx (slot %u)\n", addr, slot);
+
+		return m_slotIds[slot];
+	}
+
+	bool start(IEventListener &listener, const std::string &executable)
+	{
+		IConfiguration &conf = IConfiguration::getInstance();
+		char *const *argv = (char *const *)conf.getArgv();
+
+#if !defined(__i386__) && !defined(__x86_64__)
+		error("--in-process is only supported on x86\n");
+
+		return false;
+#endif
+		if (conf.keyAsInt("attach-pid")) {
+			error("--in-process can't be used with --pid\n");
+
+			return false;
+		}
+
+		if (!conf.keyAsInt("parse-solibs") ||
+				!ICapabilities::getInstance().hasCapability("handle-solibs")) {
+			error("--in-process needs the solib library (not with --skip-solibs)\n");
+
+			return false;
+		}
+
+		m_listener = &listener;
+
+		if (!setupData(executable))
+			return false;
+
+		// Orphaned processes are reaped (and thereby waited for) here
+		prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0);
+
+		struct sigaction sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sigemptyset(&sa.sa_mask);
+		sa.sa_handler = child_signal_handler;
+		sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+		sigaction(SIGCHLD, &sa, NULL);
+
+		m_firstChild = fork();
+		if (m_firstChild == 0) {
+			execv(argv[0], argv);
+			perror("execv");
+			_exit(127);
+		} else if (m_firstChild < 0) {
+			perror("fork");
+
+			return false;
+		}
+
+		return true;
+	}
+
+	void kill(int sig)
+	{
+		if (m_firstChild > 0)
+			::kill(m_firstChild, sig);
+	}
+
+	bool continueExecution()
+	{
+		if (m_full) {
+			::kill(m_firstChild, SIGKILL);
+			unlink(m_path.c_str());
+			unlink(m_wakePath.c_str());
+			panic("--in-process needs more than %u breakpoints, raise the limit with\n"
+					"--configure=in-process-max-breakpoints=N\n", m_maxEntries);
+		}
+
+		// Breakpoints from the parser (main program or solibs) can now be installed
+		__atomic_store_n(&m_data->n_entries, m_nEntries, __ATOMIC_RELEASE);
+
+		// ... and reports from the programs can be acknowledged once parsed
+		uint32_t parsed = solibReportsParsed();
+		uint32_t requests = __atomic_load_n(&m_data->requests, __ATOMIC_ACQUIRE);
+
+		__atomic_store_n(&m_data->acks, std::min(parsed, requests), __ATOMIC_RELEASE);
+
+		reportHits();
+
+		while (1) {
+			int status;
+			pid_t pid = waitpid(-1, &status, WNOHANG | __WALL);
+
+			if (pid == 0)
+				break;
+
+			if (pid < 0) {
+				if (errno == EINTR)
+					continue;
+
+				// No children left, the last one decides the exit code
+				Event ev(ev_exit, m_lastExitStatus);
+
+				reportHits();
+				m_listener->onEvent(ev);
+
+				return false;
+			}
+
+			Event ev(ev_exit_first_process, WEXITSTATUS(status));
+
+			if (WIFSIGNALED(status))
+				ev = Event(ev_signal_exit, WTERMSIG(status));
+			m_lastExitStatus = ev.data;
+
+			if (pid != m_firstChild || m_firstExitReported)
+				continue;
+
+			m_firstExitReported = true;
+			reportHits();
+			m_listener->onEvent(ev);
+		}
+
+		waitForWakeup();
+
+		return true;
+	}
+
+private:
+	/*
+	 * Sleep until a hit, an exited child or a solib report. The programs
+	 * write to the FIFO on the first hit after waiting is set, so hits
+	 * after the check below aren't missed.
+	 */
+	void waitForWakeup()
+	{
+		uint32_t requests = __atomic_load_n(&m_data->requests, __ATOMIC_ACQUIRE);
+		int timeout = -1;
+
+		// Reports are parsed from another thread, and then on a tick
+		if (requests != __atomic_load_n(&m_data->acks, __ATOMIC_ACQUIRE))
+			timeout = 1;
+
+		__atomic_store_n(&m_data->waiting, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&m_data->hits, __ATOMIC_SEQ_CST) != m_lastHits)
+			timeout = 0;
+
+		struct pollfd pfd;
+
+		pfd.fd = m_wakeFd;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, timeout);
+
+		char buf[256];
+		while (read(m_wakeFd, buf, sizeof(buf)) > 0)
+			;
+	}
+
+	bool setupData(const std::string &executable)
+	{
+		const std::string &realPath = get_real_path(executable);
+		uint32_t nSlots = 64;
+
+		// A power of two (at least a bitmap word), with at most 3/4 used
+		while (nSlots / 4 * 3 < m_maxEntries && nSlots < (1U << 31))
+			nSlots <<= 1;
+
+		m_path = IOutputHandler::getInstance().getOutDirectory() + "kcov-inprocess.data";
+		m_wakePath = IOutputHandler::getInstance().getOutDirectory() + "kcov-inprocess.pipe";
+		m_size = inprocess_data_size(nSlots);
+
+		if (realPath.size() >= sizeof(m_data->executable)) {
+			error("%s: Path too long for --in-process\n", realPath.c_str());
+
+			return false;
+		}
+
+		// A sparse file, to be shared with programs started by other kcov instances
+		unlink(m_path.c_str());
+		int fd = open(m_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			error("Can't create %s\n", m_path.c_str());
+
+			return false;
+		}
+
+		if (ftruncate(fd, m_size) < 0) {
+			error("Can't resize %s\n", m_path.c_str());
+			close(fd);
+
+			return false;
+		}
+
+		void *p = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED) {
+			error("Can't map %s\n", m_path.c_str());
+
+			return false;
+		}
+
+		m_data = (struct inprocess_data *)p;
+		m_data->magic = INPROCESS_DATA_MAGIC;
+		m_data->version = INPROCESS_DATA_VERSION;
+		m_data->n_slots = nSlots;
+		strcpy(m_data->executable, realPath.c_str());
+		m_seen.resize(nSlots / 64);
+		m_slotIds.resize(nSlots, -1);
+
+		unlink(m_wakePath.c_str());
+		if (mkfifo(m_wakePath.c_str(), 0600) < 0) {
+			error("Can't create in-process FIFO %s\n", m_wakePath.c_str());
+
+			return false;
+		}
+
+		// Read and write, so that the programs can always open it without blocking
+		m_wakeFd = open(m_wakePath.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (m_wakeFd < 0) {
+			error("Can't open in-process FIFO %s\n", m_wakePath.c_str());
+
+			return false;
+		}
+		g_wakeFd = m_wakeFd;
+
+		std::string env = "KCOV_INPROCESS_PATH=" + m_path;
+		putenv(xstrdup(env.c_str()));
+		putenv(xstrdup(("KCOV_INPROCESS_WAKE=" + m_wakePath).c_str()));
+
+		return true;
+	}
+
+	void reportHits()
+	{
+		uint64_t hits = __atomic_load_n(&m_data->hits, __ATOMIC_ACQUIRE);
+
+		if (hits == m_lastHits)
+			return;
+		m_lastHits = hits;
+
+		uint64_t *bitmap = inprocess_data_hits(m_data);
+		uint64_t *entries = inprocess_data_entries(m_data);
+
+		for (unsigned int i = 0; i < m_seen.size(); i++) {
+			uint64_t cur = __atomic_load_n(&bitmap[i], __ATOMIC_RELAXED) & ~m_seen[i];
+
+			if (!cur)
+				continue;
+			m_seen[i] |= cur;
+
+			while (cur) {
+				unsigned int bit = __builtin_ctzll(cur);
+				unsigned int slot = i * 64 + bit;
+
+				cur &= cur - 1;
+
+				Event ev(ev_breakpoint, m_slotIds[slot], entries[slot]);
+
+				m_listener->onEvent(ev);
+			}
+		}
+	}
+
+	typedef std::vector<uint64_t> SeenBitmap_t;
+
+	IEventListener *m_listener;
+	std::string m_path;
+	std::string m_wakePath;
+	struct inprocess_data *m_data;
+	size_t m_size;
+	int m_wakeFd;
+	pid_t m_firstChild;
+	bool m_firstExitReported;
+	int m_lastExitStatus;
+	uint64_t m_lastHits;
+	uint32_t m_nEntries;
+	uint32_t m_maxEntries;
+	bool m_full;
+	SeenBitmap_t m_seen;
+	std::vector<int> m_slotIds; // Slot -> breakpoint ID
+};
+
+
+class InProcessEngineCreator : public IEngineFactory::IEngineCreator
+{
+public:
+	virtual ~InProcessEngineCreator()
+	{
+	}
+
+	virtual IEngine *create(IFileParser &parser)
+	{
+		return new InProcessEngine();
+	}
+
+	unsigned int matchFile(const std::string &filename, uint8_t *data, size_t dataSize)
+	{
+		if (!IConfiguration::getInstance().keyAsInt("in-process"))
+			return match_none;
+
+		// ELF programs only, scripts use their own engines
+		if (dataSize < 4 || memcmp(data, "\177ELF", 4) != 0)
+			return match_none;
+
+		return match_perfect;
+	}
+};
+
+static InProcessEngineCreator g_inProcessEngineCreator;
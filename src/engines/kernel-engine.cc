@@ -36,7 +36,7 @@ public:
 	{
 		// Don't register the same BP twice
 		if (m_addresses.find(addr) != m_addresses.end())
-			return 0;
+			return -1;
 
 		m_addresses[addr] = true;
 
@@ -49,7 +49,8 @@ public:
 		fprintf(m_control, "%s", s.c_str());
 		fflush(m_control);
 
-		return 0;
+		// The module only reports addresses
+		return -1;
 	}
 
 	void setupAllBreakpoints()
@@ -136,7 +137,7 @@ private:
 
 		kcov_debug(ENGINE_MSG, "KNRL BP at 0x%llx\n", (unsigned long long)value);
 
-		m_listener->onEvent(Event(ev_breakpoint, 0, value));
+		m_listener->onEvent(Event(ev_breakpoint, -1, value));
 	}
 
 	FILE *m_control;
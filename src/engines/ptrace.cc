@@ -4,6 +4,7 @@
 #include <output-handler.hh>
 #include <solib-handler.hh>
 #include <file-parser.hh>
+#include <disassembler.hh>
 #include <phdr_data.h>
 
 #include <unistd.h>
@@ -13,18 +14,28 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
 #include <libelf.h>
+#include <elf.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <sched.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <list>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
 #include <vector>
+#include <algorithm>
 
 using namespace kcov;
 
@@ -33,7 +44,17 @@ using namespace kcov;
 
 enum
 {
+	i386_EBX = 0,
+	i386_ECX = 1,
+	i386_EDX = 2,
+	i386_ESI = 3,
+	i386_EAX = 6,
 	i386_EIP = 12,
+	x86_64_R10 = 7,
+	x86_64_RAX = 10,
+	x86_64_RDX = 12,
+	x86_64_RSI = 13,
+	x86_64_RDI = 14,
 	x86_64_RIP = 16,
 	ppc_NIP = 32,
 	arm_PC = 15,
@@ -66,6 +87,72 @@ static unsigned long arch_getPcFromRegs(unsigned long *regs)
 	return out;
 }
 
+// The instruction pointer as is, i.e. not adjusted for a breakpoint trap
+static unsigned long arch_getIpFromRegs(unsigned long *regs)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	return arch_getPcFromRegs(regs) + 1;
+#else
+	return arch_getPcFromRegs(regs);
+#endif
+}
+
+/*
+ * Setup the registers to run the system call instruction before the
+ * instruction pointer again, as a ppoll() on no files and without a timeout.
+ * That blocks until a signal arrives. Returns the size of the instruction,
+ * which is written to out.
+ */
+static size_t arch_setupBlockingSyscall(unsigned long *regs, uint8_t *out)
+{
+#if defined(__i386__)
+	out[0] = 0xcd; // int $0x80
+	out[1] = 0x80;
+
+	regs[i386_EAX] = SYS_ppoll;
+	regs[i386_EBX] = 0; // No files...
+	regs[i386_ECX] = 0;
+	regs[i386_EDX] = 0; // ... no timeout
+	regs[i386_ESI] = 0; // ... and the current signal mask
+	regs[i386_EIP] -= 2;
+
+	return 2;
+#elif defined(__x86_64__)
+	out[0] = 0x0f; // syscall
+	out[1] = 0x05;
+
+	regs[x86_64_RAX] = SYS_ppoll;
+	regs[x86_64_RDI] = 0;
+	regs[x86_64_RSI] = 0;
+	regs[x86_64_RDX] = 0;
+	regs[x86_64_R10] = 0;
+	regs[x86_64_RIP] -= 2;
+
+	return 2;
+#else
+# if defined(__powerpc__)
+	uint32_t insn = 0x44000002; // sc
+	unsigned int nr = 0, firstArg = 3, pc = ppc_NIP;
+# elif defined(__arm__)
+	uint32_t insn = 0xef000000; // svc 0
+	unsigned int nr = 7, firstArg = 0, pc = arm_PC;
+# elif defined(__aarch64__)
+	uint32_t insn = 0xd4000001; // svc #0
+	unsigned int nr = 8, firstArg = 0, pc = aarch64_PC;
+# else
+#  error Unsupported architecture
+# endif
+	memcpy(out, &insn, sizeof(insn));
+
+	regs[nr] = SYS_ppoll;
+	for (unsigned int i = firstArg; i < firstArg + 4; i++)
+		regs[i] = 0;
+	regs[pc] -= sizeof(insn);
+
+	return sizeof(insn);
+#endif
+}
+
 static void arch_adjustPcAfterBreakpoint(unsigned long *regs)
 {
 #if defined(__i386__)
@@ -124,6 +211,78 @@ static unsigned long arch_clearBreakpoint(unsigned long addr, unsigned long old_
 
 
 
+/*
+ * On x86, a thread running on another CPU executes either the old or the
+ * new instruction when a single byte is changed under its feet. A stale
+ * breakpoint trap is handled as a hit on an already cleared breakpoint.
+ * Other architectures write whole instruction words, so keep everything
+ * on one CPU there.
+ */
+#if defined(__i386__) || defined(__x86_64__)
+# define ARCH_HAS_SAFE_TEXT_WRITES 1
+#else
+# define ARCH_HAS_SAFE_TEXT_WRITES 0
+#endif
+
+// Only programs with line information are worth a kcov instance of their own
+static bool has_debug_info(const std::string &path)
+{
+	bool elfIs32Bit = true;
+	bool out = false;
+	size_t shstrndx;
+	Elf_Scn *scn = NULL;
+	Elf *elf;
+	char *raw;
+	size_t sz;
+	int fd;
+
+	if (elf_version(EV_CURRENT) == EV_NONE)
+		return false;
+
+	fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	elf = elf_begin(fd, ELF_C_READ, NULL);
+	if (elf && elf_getshdrstrndx(elf, &shstrndx) == 0) {
+		raw = elf_getident(elf, &sz);
+		if (raw && sz > EI_CLASS)
+			elfIs32Bit = raw[EI_CLASS] == ELFCLASS32;
+
+		while (!out && (scn = elf_nextscn(elf, scn)) != NULL) {
+			Elf32_Shdr *shdr32 = elfIs32Bit ? elf32_getshdr(scn) : NULL;
+			Elf64_Shdr *shdr64 = elfIs32Bit ? NULL : elf64_getshdr(scn);
+			const char *name;
+
+			if (!shdr32 && !shdr64)
+				continue;
+
+			name = elf_strptr(elf, shstrndx, shdr32 ? shdr32->sh_name : shdr64->sh_name);
+			out = name && strcmp(name, ".debug_line") == 0;
+		}
+	}
+
+	if (elf)
+		elf_end(elf);
+	close(fd);
+
+	return out;
+}
+
+// Not get_real_path(), which caches: /proc/PID/exe changes with exec
+static std::string real_path(const std::string &path)
+{
+	char *rp = ::realpath(path.c_str(), NULL);
+	std::string out;
+
+	if (!rp)
+		return path;
+	out = rp;
+	free(rp);
+
+	return out;
+}
+
 static int get_current_cpu(void)
 {
 	return sched_getcpu();
@@ -132,7 +291,7 @@ static int get_current_cpu(void)
 static void tie_process_to_cpu(pid_t pid, int cpu)
 {
 	// Switching CPU while running will cause icache
-	// conflicts. So let's just forbid that.
+	// conflicts. So let's just forbid that (when pinning).
 
 	cpu_set_t *set = CPU_ALLOC(1);
 	panic_if (!set,
@@ -212,6 +371,17 @@ static int linux_proc_get_tgid (pid_t lwpid)
 	return linux_proc_get_int (lwpid, "Tgid");
 }
 
+static volatile sig_atomic_t detach_requested;
+
+static void detach_signal_handler(int sig)
+{
+	detach_requested = 1;
+}
+
+static void wakeup_signal_handler(int sig)
+{
+}
+
 static int kill_lwp (unsigned long lwpid, int signo)
 {
 	/* Use tkill, if possible, in case we are using nptl threads.  If tkill
@@ -237,24 +407,62 @@ static int kill_lwp (unsigned long lwpid, int signo)
 	return kill (lwpid, signo);
 }
 
+/*
+ * Ptrace binds a traced process to the thread which attached to it, so all
+ * tracing is done from tracer threads: The first one starts (or attaches to)
+ * the program, and processes forked from there are handed over to new
+ * tracer threads while there are CPUs left to run them on. The events are
+ * passed on to the collector (in the main thread) through a queue.
+ */
 class Ptrace : public IEngine
 {
 public:
-	Ptrace() :
-		m_firstBreakpoint(true),
-		m_activeChild(0),
-		m_child(0),
-		m_firstChild(0),
+	Ptrace(IFileParser &parser) :
+		m_fileParser(parser),
 		m_parentCpu(0),
 		m_listener(NULL),
-		m_signal(0)
+		m_firstBreakpoint(true),
+		m_firstChild(0),
+		m_firstChildTraced(false),
+		m_hasArmedBreakpoints(false),
+		m_tracers(0),
+		m_stoppedTracer(NULL),
+		m_startState(START_PENDING),
+		m_detaching(false),
+		m_forkServerMemFd(-1)
 	{
+		m_basicBlocks = IConfiguration::getInstance().keyAsInt("basic-blocks");
+		m_autoDetach = IConfiguration::getInstance().keyAsInt("auto-detach");
+		m_pinCpu = IConfiguration::getInstance().keyAsInt("pin-cpu") || !ARCH_HAS_SAFE_TEXT_WRITES;
+		m_attachPid = IConfiguration::getInstance().keyAsInt("attach-pid");
+		m_followExec = IConfiguration::getInstance().keyAsInt("follow-exec");
+		m_attachDuration = IConfiguration::getInstance().keyAsInt("attach-duration");
+		m_forkServer = IConfiguration::getInstance().keyAsString("fork-server") != "";
+
+		m_maxTracers = IConfiguration::getInstance().keyAsInt("tracer-threads");
+		if (m_maxTracers <= 0)
+			m_maxTracers = sysconf(_SC_NPROCESSORS_ONLN);
+		// Everything runs on one CPU anyway
+		if (m_pinCpu || m_maxTracers <= 0)
+			m_maxTracers = 1;
+
+		if (m_followExec)
+			setupKcovArguments();
 	}
 
 	~Ptrace()
 	{
-		kill(SIGTERM);
-		ptrace(PTRACE_DETACH, m_activeChild, 0, 0);
+		if (m_firstChildTraced)
+			kill(SIGTERM);
+
+		// The tracer threads are done when the last event has been seen
+		for (ThreadList_t::iterator it = m_threads.begin();
+				it != m_threads.end();
+				++it)
+			pthread_join(*it, NULL);
+
+		if (m_forkServerMemFd >= 0)
+			close(m_forkServerMemFd);
 	}
 
 
@@ -263,24 +471,31 @@ public:
 	{
 		m_listener = &listener;
 
-		m_parentCpu = get_current_cpu();
-		tie_process_to_cpu(getpid(), m_parentCpu);
-
-		m_instructionMap.clear();
+		if (m_pinCpu) {
+			m_parentCpu = get_current_cpu();
+			tie_process_to_cpu(getpid(), m_parentCpu);
+		}
 
 		/* Basic check first */
 		if (access(executable.c_str(), X_OK) != 0)
 			return false;
 
-		unsigned int pid = IConfiguration::getInstance().keyAsInt("attach-pid");
-		bool res = false;
+		m_executable = executable;
+		m_tracers = 1;
+
+		if (canDetachAll())
+			setupDetachSignals();
+
+		startTracer(new Tracer(*this, 0, 0, SavedRegisters()));
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		while (m_startState == START_PENDING)
+			m_eventCond.wait(lock);
 
-		if (pid != 0)
-			res = attachPid(pid);
-		else
-			res = forkChild(executable.c_str());
+		m_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(m_attachDuration);
 
-		return res;
+		return m_startState == START_OK;
 	}
 
 	int registerBreakpoint(unsigned long addr)
@@ -288,485 +503,2030 @@ public:
 		if (addr == 0)
 			return -1;
 
-		unsigned long data;
+		BreakpointIdMap_t::const_iterator existing = m_breakpointIds.find(addr);
+		if (existing != m_breakpointIds.end())
+			return existing->second;
 
-		// There already?
-		if (m_instructionMap.find(addr) != m_instructionMap.end())
-			return 0;
+		int id = m_breakpointIds.size();
+		unsigned long leader = addr;
+		unsigned long entry = addr;
 
-		data = peekWord(addr);
+		m_breakpointIds[addr] = id;
 
-		m_instructionMap[addr] = data;
-		m_pendingBreakpoints.push_back(addr);
+		if (m_basicBlocks) {
+			std::vector<uint64_t> bb = IDisassembler::getInstance().getBasicBlock(addr);
 
-		kcov_debug(BP_MSG, "BP registered at 0x%lx\n", addr);
+			/*
+			 * Everything in a basic block executes if the first instruction
+			 * does, so a hit on the leader reports all line addresses in the
+			 * block. Jump tables and landing pads can enter the block in the
+			 * middle, so only those entry points get breakpoints of their
+			 * own. They report the lines after them, and are cleared with
+			 * the leader.
+			 */
+			if (!bb.empty()) {
+				leader = bb.front();
+				entry = getBlockEntry(bb, addr);
+				m_blockAddresses[entry].push_back(BlockLine_t(addr, id));
+			}
+		}
 
-		return 0;
-	}
+		std::lock_guard<std::mutex> lock(m_mutex);
 
-	bool clearBreakpoint(unsigned long addr)
-	{
-		if (m_instructionMap.find(addr) == m_instructionMap.end()) {
-			kcov_debug(BP_MSG, "Can't find breakpoint at 0x%lx\n", addr);
+		if (leader != addr)
+			addInstruction(leader, -1);
 
-			// Stupid workaround for avoiding the solib thread race
-			msleep(1);
+		if (entry != leader) {
+			std::vector<unsigned long> &followers = m_blockFollowers[leader];
 
-			return false;
+			if (std::find(followers.begin(), followers.end(), entry) == followers.end())
+				followers.push_back(entry);
+			addInstruction(entry, -1);
 		}
 
-		// Clear the actual breakpoint instruction
-		unsigned long val = m_instructionMap[addr];
-		val = arch_clearBreakpoint(addr, val, peekWord(addr));
+		// Reported by the leader or entry point before it
+		if (entry != addr)
+			return id;
 
-		pokeWord(addr, val);
-
-		return true;
-	}
+		// There already (a basic block leader)?
+		instructionMap_t::iterator it = m_instructionMap.find(addr);
+		if (it != m_instructionMap.end()) {
+			it->second.m_id = id;
 
-	void singleStep()
-	{
-		unsigned long regs[1024];
+			return id;
+		}
 
-		ptrace((__ptrace_request)PTRACE_GETREGS, m_activeChild, 0, &regs);
+		addInstruction(addr, id);
 
-		// Step back one instruction
-		arch_adjustPcAfterBreakpoint(regs);
-		ptrace((__ptrace_request)PTRACE_SETREGS, m_activeChild, 0, &regs);
+		return id;
 	}
 
-	const Event waitEvent()
+	// The last address in a basic block, up to addr, where it can be entered
+	unsigned long getBlockEntry(const std::vector<uint64_t> &bb, unsigned long addr)
 	{
-		static uint64_t lastSignalAddress;
-		Event out;
-		int status;
-		int who;
-
-		// Assume error
-		out.type = ev_error;
-		out.data = -1;
-
-		who = waitpid(-1, &status, __WALL);
-		if (who == -1) {
-			kcov_debug(ENGINE_MSG, "Returning error\n");
-			return out;
+		IDisassembler &disassembler = IDisassembler::getInstance();
+		unsigned long out = bb.front();
+
+		for (std::vector<uint64_t>::const_iterator it = bb.begin() + 1;
+				it != bb.end() && *it <= addr;
+				++it) {
+			if (disassembler.isEntryPoint(*it))
+				out = *it;
 		}
 
-		m_children[who] = 1;
-
-		m_activeChild = who;
-		out.addr = getPc(m_activeChild);
-
-		kcov_debug(ENGINE_MSG, "PT stopped PID %d 0x%08x\n", m_activeChild, status);
-
-		// A signal?
-		if (WIFSTOPPED(status)) {
-			int sig = WSTOPSIG(status);
-			int sigill = SIGUNUSED;
+		return out;
+	}
 
-			// Arm is using an undefined instruction, so we'll get a SIGILL here
-#if defined(__arm__) || defined(__aarch64__)
-			sigill = SIGILL;
-#endif
+	// Called with m_mutex held
+	void addInstruction(unsigned long addr, int id)
+	{
+		if (m_instructionMap.find(addr) != m_instructionMap.end())
+			return;
 
-			out.type = ev_signal;
-			out.data = sig;
-			if ((sig == SIGTRAP) &&
-					((status >> 16) == PTRACE_EVENT_CLONE || (status >> 16) == PTRACE_EVENT_FORK || (status >> 16) == PTRACE_EVENT_VFORK)) {
-				kcov_debug(ENGINE_MSG, "PT clone at 0x%llx for %d\n",
-						(unsigned long long)out.addr, m_activeChild);
-				out.data = 0;
-			} else if (sig == SIGTRAP || sig == SIGSTOP || sig == sigill) {
-				// A trap?
-						out.type = ev_breakpoint;
-						out.data = -1;
+		unsigned long data = 0;
 
-						kcov_debug(ENGINE_MSG, "PT BP at 0x%llx:%d for %d\n",
-								(unsigned long long)out.addr, out.data, m_activeChild);
+		/*
+		 * Take the original instruction from the file if possible, so that
+		 * no tracee access is needed (it might not even be running yet).
+		 * Otherwise it's read when the breakpoint is installed.
+		 */
+		bool fromFile = m_fileParser.getOriginalData(getAligned(addr), &data, sizeof(data));
 
-						bool insnFound = m_instructionMap.find(out.addr) != m_instructionMap.end();
+		m_instructionMap[addr] = Instruction(data, fromFile, id);
+		m_pendingBreakpoints.push_back(addr);
 
-						// Single-step if we have this BP
-						if (insnFound)
-							singleStep();
-						else if (sig != SIGSTOP)
-							skipInstruction();
+		kcov_debug(BP_MSG, "BP %d registered at 0x%lx\n", id, addr);
+	}
 
-						// Wait for solib data if this is the first time
-						if (m_firstBreakpoint && insnFound) {
-							blockUntilSolibDataRead();
-							m_firstBreakpoint = false;
-						}
+	/**
+	 * Continue execution with an event
+	 */
+	bool continueExecution()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		// Breakpoints registered since the last event go to the stopped process
+		if (m_stoppedTracer) {
+			m_stoppedTracer->resume(m_pendingBreakpoints);
+			m_pendingBreakpoints.clear();
+			m_stoppedTracer = NULL;
+			m_resumeCond.notify_all();
+		}
 
-						return out;
+		while (1) {
+			if (canDetachAll() && !m_detaching && shouldDetachAll()) {
+				kcov_debug(ENGINE_MSG, "PT detaching from all processes\n");
+				m_detaching = true;
+				wakeTracers();
 			}
 
-			kcov_debug(ENGINE_MSG, "PT signal %d at 0x%llx for %d\n",
-					WSTOPSIG(status), (unsigned long long)out.addr, m_activeChild);
-			lastSignalAddress = out.addr;
-		} else if (WIFSIGNALED(status)) {
-			// Crashed/killed
-			int sig = WTERMSIG(status);
+			if (!m_events.empty())
+				break;
 
-			out.type = ev_signal;
-			out.data = sig;
-			out.addr = lastSignalAddress;
+			if (!canDetachAll()) {
+				m_eventCond.wait(lock);
+				continue;
+			}
 
-			kcov_debug(ENGINE_MSG, "PT terminating signal %d at 0x%llx for %d\n",
-					sig, (unsigned long long)out.addr, m_activeChild);
-			m_children.erase(who);
+			// Tracers might not have been waiting yet, so wake them up again
+			if (m_eventCond.wait_for(lock, std::chrono::milliseconds(100)) == std::cv_status::timeout &&
+					m_detaching)
+				wakeTracers();
+		}
 
-			if (!childrenLeft())
-				out.type = ev_signal_exit;
+		QueuedEvent_t cur = m_events.front();
+		m_events.pop_front();
+		m_stoppedTracer = cur.second;
 
-		} else if (WIFEXITED(status)) {
-			int exitStatus = WEXITSTATUS(status);
+		lock.unlock();
 
-			kcov_debug(ENGINE_MSG, "PT exit %d at 0x%llx for %d%s\n",
-					exitStatus, (unsigned long long)out.addr, m_activeChild, m_activeChild == m_firstChild ? " (first child)" : "");
+		const Event &ev = cur.first;
 
-			m_children.erase(who);
+		if (m_listener)
+			reportEvent(ev);
 
-			if (who == m_firstChild)
-				out.type = ev_exit_first_process;
-			else
-				out.type = ev_exit;
+		if (ev.type == ev_error) {
+			// Left running, so there's no exit code to report
+			if (m_detaching && m_listener)
+				m_listener->onEvent(Event(ev_exit, 0));
 
-			out.data = exitStatus;
+			return false;
 		}
 
-		return out;
+		return true;
 	}
 
-	bool childrenLeft()
+	void kill(int signal)
 	{
-		return m_children.size() > 0 &&
-				 m_children.find(m_firstChild) != m_children.end();
+		// Don't kill kcov itself (PID 0)
+		if (m_firstChild != 0)
+			::kill(m_firstChild, signal);
 	}
 
+private:
+	typedef std::pair<unsigned long, unsigned long> MemoryRange_t; // [start, end)
+	typedef std::vector<MemoryRange_t> MemoryRangeList_t;
 
-	/**
-	 * Continue execution with an event
-	 */
-	bool continueExecution()
+	class Instruction
 	{
-		int res;
+	public:
+		Instruction(unsigned long data = 0, bool fromFile = false, int id = -1) :
+			m_data(data), m_fromFile(fromFile), m_id(id)
+		{
+		}
 
-		setupAllBreakpoints();
+		unsigned long m_data; // The original instruction word
+		bool m_fromFile; // Taken from the ELF file rather than the tracee
+		int m_id; // The breakpoint ID, -1 for basic block leaders only
+	};
 
-		kcov_debug(ENGINE_MSG, "PT continuing %d with signal %lu\n", m_activeChild, m_signal);
-		res = ptrace(PTRACE_CONT, m_activeChild, 0, m_signal);
-		if (res < 0) {
-			kcov_debug(ENGINE_MSG, "PT error for %d: %d\n", m_activeChild, res);
-			m_children.erase(m_activeChild);
+	// The registers of a process being handed over between tracers
+	class SavedRegisters
+	{
+	public:
+		SavedRegisters() :
+			m_setSize(0)
+		{
 		}
 
+		std::vector<unsigned long> m_registers;
+		size_t m_setSize; // PTRACE_GETREGSET size, 0 for PTRACE_GETREGS
+	};
 
-		Event ev = waitEvent();
-		m_signal = ev.type == ev_signal ? ev.data : 0;
+	typedef std::unordered_map<unsigned long, Instruction> instructionMap_t;
+	typedef std::vector<unsigned long> PendingBreakpointList_t;
+	typedef std::unordered_map<pid_t, int> ChildMap_t;
+	typedef std::pair<unsigned long, int> BlockLine_t; // Address, breakpoint ID
+	typedef std::unordered_map<unsigned long, std::vector<BlockLine_t>> BlockAddressMap_t;
+	typedef std::unordered_map<unsigned long, std::vector<unsigned long>> BlockFollowerMap_t;
+	typedef std::unordered_map<unsigned long, int> BreakpointIdMap_t;
+	typedef std::unordered_map<pid_t, pid_t> AddressSpaceMap_t; // Thread -> process
+	typedef std::unordered_map<pid_t, long> ArmedBreakpointMap_t;
+
+	/*
+	 * Traces a process tree from one thread. The instruction map is shared
+	 * between the tracers, everything about the traced processes is not.
+	 */
+	class Tracer
+	{
+	public:
+		/**
+		 * @param engine the engine to report to
+		 * @param pid a (blocked, untraced) process to take over, 0 to start the program
+		 * @param armedBreakpoints the number of breakpoints left in @a pid
+		 * @param registers the registers of @a pid to restore
+		 */
+		Tracer(Ptrace &engine, pid_t pid, long armedBreakpoints, const SavedRegisters &registers) :
+			m_engine(engine),
+			m_pid(pid),
+			m_handOverRegisters(registers),
+			m_activeChild(0),
+			m_signal(0),
+			m_lastSignalAddress(0),
+			m_memFd(-1),
+			m_memFdPid(0),
+			m_resumed(false),
+			m_registersValid(false),
+			m_registersDirty(false),
+			m_registersSetSize(0)
+		{
+			if (pid != 0)
+				m_armedBreakpoints[pid] = armedBreakpoints;
+		}
 
-		if (m_listener)
-			m_listener->onEvent(ev);
+		~Tracer()
+		{
+			if (m_memFd >= 0)
+				close(m_memFd);
+		}
 
-		if (ev.type == ev_breakpoint)
-			clearBreakpoint(ev.addr);
+		static void *threadStatic(void *pThis)
+		{
+			Tracer *p = (Tracer *)pThis;
 
-		if (ev.type == ev_error)
-			return false;
+			p->run();
+			delete p;
 
-		return true;
-	}
+			return NULL;
+		}
 
-	void kill(int signal)
-	{
-		// Don't kill kcov itself (PID 0)
-		if (m_activeChild != 0)
-			::kill(m_activeChild, signal);
-	}
+		// Called by the engine (with the lock held) to let a stopped process run
+		void resume(const PendingBreakpointList_t &breakpoints)
+		{
+			m_pendingBreakpoints.insert(m_pendingBreakpoints.end(),
+					breakpoints.begin(), breakpoints.end());
+			m_resumed = true;
+		}
 
-private:
+		// Called with the engine lock held
+		void waitForResume(std::unique_lock<std::mutex> &lock)
+		{
+			m_resumed = false;
+			while (!m_resumed)
+				m_engine.m_resumeCond.wait(lock);
+		}
 
-	void setupAllBreakpoints()
-	{
-		for (PendingBreakpointList_t::const_iterator addrIt = m_pendingBreakpoints.begin();
-				addrIt != m_pendingBreakpoints.end();
-				++addrIt) {
-			unsigned long addr = *addrIt;
-			unsigned long cur_data = peekWord(addr);
+	private:
+		void run()
+		{
+			if (m_pid == 0) {
+				bool res;
+
+				if (m_engine.m_attachPid != 0)
+					res = attachPid(m_engine.m_attachPid);
+				else
+					res = forkChild(m_engine.m_executable.c_str());
+
+				// Wait for the breakpoints before letting it run
+				if (!m_engine.started(*this, res ? m_activeChild : 0)) {
+					m_engine.releaseTracer();
+					return;
+				}
+			} else if (!takeOver(m_pid)) {
+				m_engine.releaseTracer();
+				return;
+			}
 
-			// Set the breakpoint
-			pokeWord(addr,	arch_setupBreakpoint(addr, cur_data));
-		}
+			while (1) {
+				std::unique_lock<std::mutex> lock(m_engine.m_mutex, std::defer_lock);
+				bool needsResume;
 
-		m_pendingBreakpoints.clear();
-	}
+				continueChild();
 
+				Event ev = waitEvent(needsResume, lock);
+				if (ev.type == ev_error)
+					break;
 
-	bool forkChild(const char *executable)
-	{
-		char *const *argv = (char *const *)IConfiguration::getInstance().getArgv();
-		pid_t child, who;
-		int status;
+				m_signal = ev.type == ev_signal ? ev.data : 0;
+
+				if (ev.type == ev_breakpoint) {
+					// Threads can trap on the same breakpoint, but only one clears it
+					if (clearBreakpoint(ev.addr, true))
+						m_armedBreakpoints[getAddressSpace(m_activeChild)]--;
+					m_engine.clearInForkServer(ev.addr);
+					clearBlock(ev.addr);
+				}
+
+				m_engine.queueEvent(ev, needsResume ? this : NULL, lock);
+			}
+
+			m_engine.releaseTracer();
+		}
 
-		/* Executable exists, try to launch it */
-		if ((child = fork()) == 0) {
-			int persona;
+		void continueChild()
+		{
 			int res;
 
-			/* Avoid address randomization */
-			persona = personality(0xffffffff);
-			if (persona < 0) {
-				perror("Can't get personality");
-				return false;
+			setupAllBreakpoints();
+			flushRegisters();
+
+			if (canDetach(m_activeChild)) {
+				kcov_debug(ENGINE_MSG, "PT detaching %d with signal %lu, no breakpoints left\n",
+						m_activeChild, m_signal);
+				ptrace(PTRACE_DETACH, m_activeChild, 0, m_signal);
+
+				m_children.erase(m_activeChild);
+				m_addressSpaces.erase(m_activeChild);
+
+				std::lock_guard<std::mutex> lock(m_engine.m_mutex);
+				m_engine.childGone(m_activeChild);
+			} else {
+				kcov_debug(ENGINE_MSG, "PT continuing %d with signal %lu\n", m_activeChild, m_signal);
+				res = ptrace(PTRACE_CONT, m_activeChild, 0, m_signal);
+				if (res < 0) {
+					kcov_debug(ENGINE_MSG, "PT error for %d: %d\n", m_activeChild, res);
+					m_children.erase(m_activeChild);
+				}
 			}
-			persona |= 0x0040000; /* ADDR_NO_RANDOMIZE */
-			if (personality(persona) < 0) {
-				perror("Can't set personality");
+		}
+
+		/*
+		 * Returns true if the breakpoint was still there. @a trapped is set
+		 * for the breakpoint the active child just stopped on.
+		 */
+		bool clearBreakpoint(unsigned long addr, bool trapped)
+		{
+			Instruction insn;
+
+			if (!m_engine.lookupInstruction(addr, insn)) {
+				kcov_debug(BP_MSG, "Can't find breakpoint at 0x%lx\n", addr);
+
+				// Stupid workaround for avoiding the solib thread race
+				msleep(1);
+
 				return false;
 			}
 
-			/* And launch the process */
-			res = ptrace(PTRACE_TRACEME, 0, 0, 0);
-			if (res < 0) {
-				perror("Can't set me as ptraced");
-				return false;
+#if defined(__i386__) || defined(__x86_64__)
+			// Only the trap byte differs from the file, so just write that back
+			if (insn.m_fromFile) {
+				uint8_t orig = (insn.m_data >> (8 * (addr - getAligned(addr)))) & 0xff;
+				uint8_t cur = 0xcc;
+
+				/*
+				 * The trap shows that the breakpoint is there, unless another
+				 * thread trapped on it as well and it's already cleared.
+				 */
+				if ((trapped && isOnlyThread(m_activeChild)) ||
+						readMemory(addr, &cur, sizeof(cur))) {
+					if (cur != 0xcc)
+						return false;
+
+					if (writeMemory(addr, &orig, sizeof(orig)))
+						return true;
+				}
 			}
-			tie_process_to_cpu(getpid(), m_parentCpu);
-			execv(executable, argv);
+#endif
 
-			/* Exec failed */
-			return false;
-		}
+			unsigned long data = peekWord(addr);
 
-		/* Fork error? */
-		if (child < 0) {
-			perror("fork");
-			return false;
-		}
-		m_child = m_activeChild = m_firstChild = child;
-		// Might not be completely necessary (the child should inherit this
-		// from the parent), but better safe than sorry
-		tie_process_to_cpu(m_child, m_parentCpu);
+			if (arch_setupBreakpoint(addr, data) != data)
+				return false;
 
-		kcov_debug(ENGINE_MSG, "PT forked %d\n", child);
+			// Clear the actual breakpoint instruction
+			pokeWord(addr, arch_clearBreakpoint(addr, insn.m_data, data));
 
-		/* Wait for the initial stop */
-		who = waitpid(child, &status, 0);
-		if (who < 0) {
-			perror("waitpid");
-			return false;
+			return true;
 		}
-		if (!WIFSTOPPED(status)) {
-			fprintf(stderr, "Child hasn't stopped: %x\n", status);
-			return false;
+
+		// The rest of the block runs after its leader, so its entry points aren't needed
+		void clearBlock(unsigned long leader)
+		{
+			std::vector<unsigned long> followers;
+
+			if (!m_engine.getBlockFollowers(leader, followers))
+				return;
+
+			for (std::vector<unsigned long>::const_iterator it = followers.begin();
+					it != followers.end();
+					++it) {
+				// Not if already hit through a computed jump
+				if (clearBreakpoint(*it, false))
+					m_armedBreakpoints[getAddressSpace(m_activeChild)]--;
+				m_engine.clearInForkServer(*it);
+			}
 		}
 
-		ptrace(PTRACE_SETOPTIONS, m_activeChild, 0, PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK);
+		void singleStep()
+		{
+			// Step back one instruction
+			arch_adjustPcAfterBreakpoint(getRegisters());
+			m_registersDirty = true;
+		}
 
-		return true;
-	}
+		/*
+		 * Wait for the next stop of the processes traced by this thread.
+		 * @a needsResume is set if the event might add new breakpoints (a
+		 * dlopen), so that the process should stay stopped until the
+		 * engine has seen it.
+		 *
+		 * Exits are reaped with @a lock (the engine lock) held, and it's kept
+		 * until the event has been queued: The parent of the process can't
+		 * see the exit before that, so the queue keeps the order in which
+		 * processes exit, also between tracers.
+		 */
+		const Event waitEvent(bool &needsResume, std::unique_lock<std::mutex> &lock)
+		{
+			Event out;
+			siginfo_t info;
+			int status;
+			int who;
 
-	bool attachPid(pid_t pid)
-	{
-		int rv;
+			// Assume error
+			out.type = ev_error;
+			out.data = -1;
+			needsResume = false;
 
-		m_child = m_activeChild = m_firstChild = pid;
+			/*
+			 * Only the processes traced by this thread, and only peek for now.
+			 * Ptrace stops are reported without WSTOPPED, and with it a
+			 * detached (stopped) child would block the waitpid below.
+			 */
+			do {
+				if (m_engine.detaching()) {
+					detachAll();
+					return out;
+				}
 
-		errno = 0;
-		rv = linuxAttach(m_activeChild);
-		//rv = ptrace(PTRACE_ATTACH, m_activeChild, 0, 0);
-		if (rv < 0) {
-			const char *err = strerror(errno);
+				memset(&info, 0, sizeof(info));
+				m_engine.allowWakeup(true);
+				who = waitid(P_ALL, 0, &info, WEXITED | WNOWAIT | __WALL | __WNOTHREAD);
+				m_engine.allowWakeup(false);
+			} while ((who == -1 && errno == EINTR) || (who == 0 && reapHelper(info.si_pid)));
 
-			fprintf(stderr, "Can't attach to %d. Error %s\n", pid, err);
-			return false;
-		}
+			if (who == 0) {
+				if (info.si_code == CLD_EXITED || info.si_code == CLD_KILLED || info.si_code == CLD_DUMPED)
+					lock.lock();
 
-		/* Wait for the initial stop */
-		int status;
-		int who = waitpid(m_activeChild, &status, 0);
-		if (who < 0) {
-			perror("waitpid");
-			return false;
-		}
-		if (!WIFSTOPPED(status)) {
-			fprintf(stderr, "Child hasn't stopped: %x\n", status);
-			return false;
-		}
-		tie_process_to_cpu(m_activeChild, m_parentCpu);
+				who = waitpid(info.si_pid, &status, __WALL);
+			}
 
-		return true;
-	}
+			if (who == -1) {
+				kcov_debug(ENGINE_MSG, "Returning error\n");
+				return out;
+			}
 
-	/* Taken from GDB (loop through all threads and attach to each one)  */
-	int linuxAttach (pid_t pid)
-	{
-		int err;
+			m_children[who] = 1;
 
-		/* Attach to PID.  We will check for other threads soon. */
-		err = attachLwp (pid);
-		if (err != 0)
-			error ("Cannot attach to process %d\n", pid);
+			// A new stop, so the cached registers are stale
+			m_registersValid = false;
 
-		if (linux_proc_get_tgid (pid) != pid)
-		{
-			return 0;
-		}
+			m_activeChild = who;
+			out.addr = getPc();
 
-		DIR *dir;
-		char pathname[128];
+			kcov_debug(ENGINE_MSG, "PT stopped PID %d 0x%08x\n", m_activeChild, status);
 
-		sprintf (pathname, "/proc/%d/task", pid);
+			// A signal?
+			if (WIFSTOPPED(status)) {
+				int sig = WSTOPSIG(status);
+				int sigill = SIGUNUSED;
 
-		dir = opendir (pathname);
+				// Arm is using an undefined instruction, so we'll get a SIGILL here
+#if defined(__arm__) || defined(__aarch64__)
+				sigill = SIGILL;
+#endif
 
-		if (!dir) {
-			error("Could not open /proc/%d/task.\n", pid);
+				out.type = ev_signal;
+				out.data = sig;
+				if ((sig == SIGTRAP) &&
+						((status >> 16) == PTRACE_EVENT_CLONE || (status >> 16) == PTRACE_EVENT_FORK || (status >> 16) == PTRACE_EVENT_VFORK)) {
+					kcov_debug(ENGINE_MSG, "PT clone at 0x%llx for %d\n",
+							(unsigned long long)out.addr, m_activeChild);
+					out.data = 0;
+
+					newChild(who, status >> 16);
+				} else if (sig == SIGTRAP && (status >> 16) == PTRACE_EVENT_EXEC) {
+					kcov_debug(ENGINE_MSG, "PT exec for %d\n", m_activeChild);
+					out.data = 0;
+
+					newImage(who);
+				} else if (sig == SIGTRAP || sig == SIGSTOP || sig == sigill) {
+					// A trap?
+					Instruction insn;
+					bool insnFound = m_engine.lookupInstruction(out.addr, insn);
+
+					out.type = ev_breakpoint;
+					out.data = insnFound ? insn.m_id : -1;
+
+					kcov_debug(ENGINE_MSG, "PT BP at 0x%llx:%d for %d\n",
+							(unsigned long long)out.addr, out.data, m_activeChild);
+
+					// Single-step if we have this BP
+					if (insnFound)
+						singleStep();
+					else if (sig != SIGSTOP)
+						skipInstruction();
+
+					// Wait for solib data if this is the first time
+					if (insnFound && m_engine.firstBreakpoint())
+						blockUntilSolibDataRead();
+
+					// Not ours, so probably the solib handler trap after a dlopen
+					needsResume = !insnFound && sig == SIGTRAP;
+
+					return out;
+				}
 
-			return 0;
-		}
+				kcov_debug(ENGINE_MSG, "PT signal %d at 0x%llx for %d\n",
+						WSTOPSIG(status), (unsigned long long)out.addr, m_activeChild);
+				m_lastSignalAddress = out.addr;
+			} else if (WIFSIGNALED(status)) {
+				// Crashed/killed
+				int sig = WTERMSIG(status);
 
-		/* At this point we attached to the tgid.  Scan the task for
-		 * existing threads. */
-		int new_threads_found;
-		int iterations = 0;
+				out.type = ev_signal;
+				out.data = sig;
+				out.addr = m_lastSignalAddress;
 
-		std::unordered_map<unsigned long, bool> threads;
-		threads[pid] = true;
+				kcov_debug(ENGINE_MSG, "PT terminating signal %d at 0x%llx for %d\n",
+						sig, (unsigned long long)out.addr, m_activeChild);
+				m_children.erase(who);
+				forgetChild(who);
 
-		while (iterations < 2)
-		{
-			struct dirent *dp;
+				if (!m_engine.childGone(who))
+					out.type = ev_signal_exit;
 
-			new_threads_found = 0;
-			/* Add all the other threads.  While we go through the
-			 * threads, new threads may be spawned.  Cycle through
-			 * the list of threads until we have done two iterations without
-			 * finding new threads.  */
-			while ((dp = readdir (dir)) != NULL)
-			{
-				int lwp;
+			} else if (WIFEXITED(status)) {
+				int exitStatus = WEXITSTATUS(status);
 
-				/* Fetch one lwp.  */
-				lwp = strtoul (dp->d_name, NULL, 10);
+				kcov_debug(ENGINE_MSG, "PT exit %d at 0x%llx for %d%s\n",
+						exitStatus, (unsigned long long)out.addr, m_activeChild, m_activeChild == m_engine.m_firstChild ? " (first child)" : "");
 
-				/* Is this a new thread?  */
-				if (lwp != 0 && threads.find(lwp) == threads.end())
-				{
-					int err;
-					threads[lwp] = true;
+				m_children.erase(who);
+				forgetChild(who);
+				m_engine.childGone(who);
 
-					err = attachLwp (lwp);
-					if (err != 0)
-						warning ("Cannot attach to lwp %d\n", lwp);
+				if (who == m_engine.m_firstChild)
+					out.type = ev_exit_first_process;
+				else
+					out.type = ev_exit;
 
-					new_threads_found++;
-				}
+				out.data = exitStatus;
 			}
 
-			if (!new_threads_found)
-				iterations++;
-			else
-				iterations = 0;
-
-			rewinddir (dir);
+			return out;
 		}
-		closedir (dir);
 
-		return 0;
-	}
+		void setupAllBreakpoints()
+		{
+			std::lock_guard<std::mutex> lock(m_engine.m_mutex);
 
-	/* Attach to an inferior process. */
-	int attachLwp (int lwpid)
-	{
-		int rv;
+			// Not given to a particular process, so take them here
+			m_pendingBreakpoints.insert(m_pendingBreakpoints.end(),
+					m_engine.m_pendingBreakpoints.begin(), m_engine.m_pendingBreakpoints.end());
+			m_engine.m_pendingBreakpoints.clear();
 
-		rv = ptrace (PTRACE_ATTACH, lwpid, 0, 0);
+			if (m_pendingBreakpoints.empty())
+				return;
 
-		if (rv < 0)
-			return errno;
-		ptrace(PTRACE_SETOPTIONS, lwpid, 0, PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK);
+			long armed = m_pendingBreakpoints.size();
 
-		if (!linux_proc_pid_is_stopped (lwpid)) {
-			/*
-			 * First make sure there is a pending SIGSTOP.  Since we are
-			 * already attached, the process can not transition from stopped
-			 * to running without a PTRACE_CONT; so we know this signal will
-			 * go into the queue.  The SIGSTOP generated by PTRACE_ATTACH is
-			 * probably already in the queue (unless this kernel is old
-			 * enough to use TASK_STOPPED for ptrace stops); but since
-			 * SIGSTOP is not an RT signal, it can only be queued once.  */
-			kill_lwp (lwpid, SIGSTOP);
+			if (!setupAllBreakpointsBulk())
+				armed = setupAllBreakpointsWordwise();
+
+			m_armedBreakpoints[getAddressSpace(m_activeChild)] += armed;
+			m_engine.m_hasArmedBreakpoints = true;
+			m_pendingBreakpoints.clear();
 		}
 
-		return 0;
-	}
+		/*
+		 * Breakpoints are cleared after the first hit, so a process without
+		 * armed breakpoints can run on untraced. Processes not seen through a
+		 * fork/clone event are kept, since their breakpoints are unknown.
+		 */
+		bool canDetach(pid_t pid)
+		{
+			if (!m_engine.m_autoDetach)
+				return false;
 
+			// Before that, the (PIE) breakpoints might not even be known yet
+			{
+				std::lock_guard<std::mutex> lock(m_engine.m_mutex);
 
-	// Skip over this instruction
-	void skipInstruction()
-	{
-		// Nop on x86, op on PowerPC/ARM
-#if defined(__powerpc__) || defined(__arm__) || defined(__aarch64__)
-		unsigned long regs[1024];
+				if (!m_engine.m_hasArmedBreakpoints || !m_engine.m_pendingBreakpoints.empty())
+					return false;
+			}
 
-		ptrace((__ptrace_request)PTRACE_GETREGS, m_activeChild, 0, &regs);
+			AddressSpaceMap_t::const_iterator it = m_addressSpaces.find(pid);
 
-# if defined(__powerpc__)
-		regs[ppc_NIP] += 4;
-# elif defined(__aarch64__)
-		regs[aarch64_PC] += 4;
-# else
-		regs[arm_PC] += 4;
-# endif
-		ptrace((__ptrace_request)PTRACE_SETREGS, m_activeChild, 0, &regs);
-#endif
-	}
+			if (it == m_addressSpaces.end() || m_armedBreakpoints[it->second] > 0)
+				return false;
 
-	unsigned long getPcFromRegs(unsigned long *regs)
-	{
-		return arch_getPcFromRegs(regs);
-	}
+			// A dlopen:ed library might be about to add breakpoints
+			return !solibDataPending();
+		}
 
-	unsigned long getPc(int pid)
-	{
-		unsigned long regs[1024];
+		// Threads exit before the process leader is reported
+		void forgetChild(pid_t pid)
+		{
+			if (getAddressSpace(pid) == pid)
+				m_armedBreakpoints.erase(pid);
+			m_addressSpaces.erase(pid);
+		}
 
-		memset(&regs, 0, sizeof(regs));
-		ptrace((__ptrace_request)PTRACE_GETREGS, pid, 0, &regs);
+		// No other traced thread or vfork child shares the memory of @a pid
+		bool isOnlyThread(pid_t pid)
+		{
+			pid_t space = getAddressSpace(pid);
+			unsigned int n = 0;
+
+			for (AddressSpaceMap_t::const_iterator it = m_addressSpaces.begin();
+					it != m_addressSpaces.end();
+					++it) {
+				if (it->second == space && ++n > 1)
+					return false;
+			}
 
-		return getPcFromRegs(regs);
-	}
+			return true;
+		}
 
-	unsigned long peekWord(unsigned long addr)
-	{
-		unsigned long aligned = getAligned(addr);
+		pid_t getAddressSpace(pid_t pid)
+		{
+			AddressSpaceMap_t::const_iterator it = m_addressSpaces.find(pid);
 
-		return ptrace((__ptrace_request)PTRACE_PEEKTEXT, m_activeChild, aligned, 0);
-	}
+			if (it == m_addressSpaces.end())
+				return pid;
 
-	void pokeWord(unsigned long addr, unsigned long val)
-	{
-		ptrace((__ptrace_request)PTRACE_POKETEXT, m_activeChild, getAligned(addr), val);
-	}
+			return it->second;
+		}
 
-	typedef std::unordered_map<unsigned long, unsigned long > instructionMap_t;
-	typedef std::vector<unsigned long> PendingBreakpointList_t;
-	typedef std::unordered_map<pid_t, int> ChildMap_t;
+		void newChild(pid_t parent, int event)
+		{
+			unsigned long msg = 0;
 
-	instructionMap_t m_instructionMap;
-	PendingBreakpointList_t m_pendingBreakpoints;
-	bool m_firstBreakpoint;
+			if (ptrace((__ptrace_request)PTRACE_GETEVENTMSG, parent, 0, &msg) < 0)
+				return;
 
-	pid_t m_activeChild;
-	pid_t m_child;
-	pid_t m_firstChild;
-	ChildMap_t m_children;
+			pid_t child = (pid_t)msg;
+			pid_t parentSpace = getAddressSpace(parent);
 
-	int m_parentCpu;
+			// The child might have stopped (and been counted on) before this event
+			long childCount = 0;
+			ArmedBreakpointMap_t::iterator it = m_armedBreakpoints.find(child);
+			if (it != m_armedBreakpoints.end()) {
+				childCount = it->second;
+				m_armedBreakpoints.erase(it);
+			}
+
+			if (event == PTRACE_EVENT_FORK) {
+				// A copy of the parent memory, breakpoints included
+				m_addressSpaces[child] = child;
+				m_armedBreakpoints[child] = m_armedBreakpoints[parentSpace] + childCount;
+
+				handOver(child);
+			} else {
+				// Threads and vfork children share the parent memory
+				m_addressSpaces[child] = parentSpace;
+				m_armedBreakpoints[parentSpace] += childCount;
+			}
+		}
+
+		/*
+		 * Let another tracer thread take a forked process. A process can't
+		 * be moved between tracers, so it's detached and attached to again
+		 * from the new thread. Detaching into a stopped state would be a
+		 * group-stop, visible to the parent (SIGCHLD, waitpid(WUNTRACED)).
+		 * Instead, the system call which returned from fork() is run again
+		 * as a ppoll() which blocks until the attach, and the new tracer
+		 * puts the registers back. The process doesn't run in between.
+		 */
+		void handOver(pid_t child)
+		{
+			int status;
+
+			// Already running here
+			if (m_children.find(child) != m_children.end())
+				return;
+
+			if (!m_engine.reserveTracer())
+				return;
+
+			// The initial stop of the new process
+			pid_t who;
+			do {
+				who = waitpid(child, &status, __WALL);
+			} while (who < 0 && errno == EINTR);
+
+			if (who != child || !WIFSTOPPED(status)) {
+				forgetChild(child);
+				m_engine.releaseTracer();
+				return;
+			}
+
+			SavedRegisters registers;
+			bool blocked = block(child, registers);
+
+			if (!blocked || ptrace(PTRACE_DETACH, child, 0, 0) < 0) {
+				// Keep it then
+				if (blocked)
+					restoreRegisters(child, registers);
+				m_children[child] = 1;
+				ptrace(PTRACE_CONT, child, 0, 0);
+				m_engine.releaseTracer();
+				return;
+			}
+
+			kcov_debug(ENGINE_MSG, "PT handing over %d to a new tracer\n", child);
+
+			long armed = m_armedBreakpoints[child];
+
+			forgetChild(child);
+			m_engine.startTracer(new Tracer(m_engine, child, armed, registers));
+		}
+
+		// Setup a (stopped, traced) process to block when it runs, saving its registers
+		bool block(pid_t pid, SavedRegisters &registers)
+		{
+			pid_t active = m_activeChild;
+			uint8_t insn[4];
+			uint8_t cur[sizeof(insn)];
+			bool out = false;
+
+			flushRegisters();
+			m_activeChild = pid;
+
+			unsigned long *regs = getRegisters();
+			registers.m_registers.assign(regs, regs + sizeof(m_registers) / sizeof(m_registers[0]));
+			registers.m_setSize = m_registersSetSize;
+
+			size_t size = arch_setupBlockingSyscall(regs, insn);
+
+			// Not after a system call instruction (e.g., a 32-bit process)
+			if (readMemory(arch_getIpFromRegs(registers.m_registers.data()) - size, cur, size) &&
+					memcmp(cur, insn, size) == 0) {
+				m_registersDirty = true;
+				out = true;
+			}
+
+			flushRegisters();
+			m_activeChild = active;
+
+			return out;
+		}
+
+		// Put the registers saved by block() back into a (stopped, traced) process
+		void restoreRegisters(pid_t pid, const SavedRegisters &registers)
+		{
+			pid_t active = m_activeChild;
+
+			flushRegisters();
+			m_activeChild = pid;
+
+			std::copy(registers.m_registers.begin(), registers.m_registers.end(), m_registers);
+			m_registersSetSize = registers.m_setSize;
+			m_registersValid = true;
+			m_registersDirty = true;
+
+			flushRegisters();
+			m_activeChild = active;
+		}
+
+		/*
+		 * A process has exec:ed another program. With debug info, that one
+		 * is covered by another kcov instance: It's detached into a stopped
+		 * state, and the new kcov parses the program (in parallel to this
+		 * one) and attaches to it with its own breakpoints.
+		 */
+		void newImage(pid_t pid)
+		{
+			// The old breakpoints are gone with the old image
+			m_armedBreakpoints[getAddressSpace(pid)] = 0;
+
+			std::string path = real_path(fmt("/proc/%d/exe", pid));
+
+			if (!m_engine.shouldFollowExec(path))
+				return;
+
+			// Prepare everything before forking, we're multithreaded
+			std::vector<std::string> args(m_engine.m_kcovArguments);
+			std::vector<char *> argv;
+
+			args.insert(args.end() - 1, fmt("--pid=%d", pid));
+			for (std::vector<std::string>::iterator it = args.begin();
+					it != args.end();
+					++it)
+				argv.push_back((char *)it->c_str());
+			argv.push_back(NULL);
+
+			// Signals can't be injected at event stops, so queue the SIGSTOP
+			kill_lwp(pid, SIGSTOP);
+			if (ptrace(PTRACE_DETACH, pid, 0, 0) < 0)
+				return;
+
+			m_children.erase(pid);
+			forgetChild(pid);
+			{
+				std::lock_guard<std::mutex> lock(m_engine.m_mutex);
+				m_engine.childGone(pid);
+			}
+
+			pid_t helper = fork();
+
+			if (helper == 0) {
+				m_engine.allowWakeup(true);
+				execv("/proc/self/exe", argv.data());
+				_exit(1);
+			}
+
+			if (helper < 0) {
+				warning("Can't start kcov for %s\n", path.c_str());
+				::kill(pid, SIGCONT);
+				return;
+			}
+
+			kcov_debug(ENGINE_MSG, "PT kcov %d follows %d into %s\n", helper, pid, path.c_str());
+			m_helpers.insert(helper);
+		}
+
+		// Helper kcov instances are waited for, but aren't reported
+		bool reapHelper(pid_t pid)
+		{
+			int status;
+
+			if (m_helpers.find(pid) == m_helpers.end())
+				return false;
+
+			waitpid(pid, &status, 0);
+			m_helpers.erase(pid);
+
+			return true;
+		}
+
+		// Attach to a process handed over by another tracer
+		bool takeOver(pid_t pid)
+		{
+			int status;
+
+			m_activeChild = pid;
+			m_addressSpaces[pid] = pid;
+
+			int err = attachLwp(pid);
+
+			if (err == ESRCH) {
+				std::lock_guard<std::mutex> lock(m_engine.m_mutex);
+				m_engine.childGone(pid);
+
+				return false;
+			}
+
+			if (err != 0) {
+				// Blocked for good without a tracer to restore the registers
+				warning("Can't attach to handed over process %d, killing it\n", pid);
+				::kill(pid, SIGKILL);
+
+				std::lock_guard<std::mutex> lock(m_engine.m_mutex);
+				m_engine.childGone(pid);
+
+				return false;
+			}
+
+			/* Wait for the initial stop */
+			do {
+				status = 0;
+			} while (waitpid(pid, &status, __WALL) < 0 && errno == EINTR);
+
+			if (!WIFSTOPPED(status)) {
+				std::lock_guard<std::mutex> lock(m_engine.m_mutex);
+				m_engine.childGone(pid);
+
+				return false;
+			}
+
+			ptrace(PTRACE_SETOPTIONS, pid, 0, m_engine.ptraceOptions());
+			m_children[pid] = 1;
+
+			/*
+			 * The SIGSTOP of the attach has interrupted the ppoll(), and is
+			 * suppressed when continuing. Return from fork() as before.
+			 */
+			restoreRegisters(pid, m_handOverRegisters);
+
+			return true;
+		}
+
+		/*
+		 * Leave all processes running without kcov: Stop every thread, put
+		 * the original instructions back over the remaining breakpoints and
+		 * detach. Breakpoints hit while stopping are still reported.
+		 */
+		void detachAll()
+		{
+			std::unordered_set<pid_t> stopped;
+			int sigill = SIGUNUSED;
+
+#if defined(__arm__) || defined(__aarch64__)
+			sigill = SIGILL;
+#endif
+
+			// Threads are only added here when they have stopped
+			for (AddressSpaceMap_t::const_iterator it = m_addressSpaces.begin();
+					it != m_addressSpaces.end();
+					++it)
+				m_children[it->first] = 1;
+
+			for (ChildMap_t::iterator it = m_children.begin();
+					it != m_children.end();) {
+				if (kill_lwp(it->first, SIGSTOP) < 0)
+					it = m_children.erase(it);
+				else
+					++it;
+			}
+
+			while (stopped.size() < m_children.size()) {
+				int status;
+				pid_t who = waitpid(-1, &status, __WALL | __WNOTHREAD);
+
+				if (who < 0) {
+					if (errno == EINTR)
+						continue;
+					break;
+				}
+
+				// Not waited for anymore
+				if (m_helpers.erase(who))
+					continue;
+
+				if (!WIFSTOPPED(status)) {
+					std::lock_guard<std::mutex> lock(m_engine.m_mutex);
+
+					m_children.erase(who);
+					stopped.erase(who);
+					forgetChild(who);
+					m_engine.childGone(who);
+					continue;
+				}
+
+				int sig = WSTOPSIG(status);
+				int event = status >> 16;
+
+				kcov_debug(ENGINE_MSG, "PT stopping %d: 0x%08x\n", who, status);
+				m_activeChild = who;
+				m_registersValid = false;
+
+				if (sig == SIGTRAP &&
+						(event == PTRACE_EVENT_CLONE || event == PTRACE_EVENT_FORK || event == PTRACE_EVENT_VFORK)) {
+					unsigned long msg = 0;
+
+					// Starts with a SIGSTOP, so stopped like the others
+					if (ptrace((__ptrace_request)PTRACE_GETEVENTMSG, who, 0, &msg) == 0) {
+						m_children[(pid_t)msg] = 1;
+						m_addressSpaces[(pid_t)msg] = event == PTRACE_EVENT_FORK ? (pid_t)msg : getAddressSpace(who);
+					}
+					sig = 0;
+				} else if (sig == SIGSTOP && event == 0) {
+					// Our stop, or the initial one of a new thread
+					m_children[who] = 1;
+					stopped.insert(who);
+					continue;
+				} else if ((sig == SIGTRAP || sig == sigill) && event == 0) {
+					unsigned long addr = getPc();
+					Instruction insn;
+
+					if (m_engine.lookupInstruction(addr, insn)) {
+						std::unique_lock<std::mutex> lock(m_engine.m_mutex, std::defer_lock);
+
+						clearBreakpoint(addr, false);
+						singleStep();
+						m_engine.queueEvent(Event(ev_breakpoint, insn.m_id, addr), NULL, lock);
+					} else {
+						skipInstruction();
+					}
+					flushRegisters();
+					sig = 0;
+				} else if (event != 0) {
+					sig = 0;
+				}
+
+				ptrace(PTRACE_CONT, who, 0, sig);
+			}
+
+			// One thread per address space does
+			std::unordered_map<pid_t, pid_t> spaces;
+
+			for (ChildMap_t::const_iterator it = m_children.begin();
+					it != m_children.end();
+					++it)
+				spaces[getAddressSpace(it->first)] = it->first;
+
+			for (std::unordered_map<pid_t, pid_t>::const_iterator it = spaces.begin();
+					it != spaces.end();
+					++it) {
+				m_activeChild = it->second;
+				restoreAllBreakpoints();
+			}
+
+			for (ChildMap_t::const_iterator it = m_children.begin();
+					it != m_children.end();
+					++it) {
+				kcov_debug(ENGINE_MSG, "PT detaching %d\n", it->first);
+				ptrace(PTRACE_DETACH, it->first, 0, 0);
+
+				std::lock_guard<std::mutex> lock(m_engine.m_mutex);
+				m_engine.childGone(it->first);
+			}
+
+			m_children.clear();
+			m_addressSpaces.clear();
+			m_armedBreakpoints.clear();
+		}
+
+		// Write back the original instructions of the breakpoints still in memory
+		bool restoreAllBreakpoints()
+		{
+			instructionMap_t instructions;
+			PendingBreakpointList_t addresses;
+			MemoryRangeList_t ranges;
+
+			{
+				std::lock_guard<std::mutex> lock(m_engine.m_mutex);
+
+				instructions = m_engine.m_instructionMap;
+			}
+
+			addresses.reserve(instructions.size());
+			for (instructionMap_t::const_iterator it = instructions.begin();
+					it != instructions.end();
+					++it)
+				addresses.push_back(it->first);
+			std::sort(addresses.begin(), addresses.end());
+
+			size_t total = getPageRanges(addresses, ranges);
+			std::vector<uint8_t> memory(total);
+
+			if (readMemoryRanges(ranges, memory.data())) {
+				MemoryRangeList_t::const_iterator range = ranges.begin();
+				size_t rangeOffset = 0;
+
+				for (PendingBreakpointList_t::const_iterator addrIt = addresses.begin();
+						addrIt != addresses.end();
+						++addrIt) {
+					unsigned long addr = *addrIt;
+					unsigned long word = getAligned(addr);
+
+					while (word >= range->second) {
+						rangeOffset += range->second - range->first;
+						++range;
+					}
+
+					size_t offset = rangeOffset + (word - range->first);
+					unsigned long data;
+
+					memcpy(&data, &memory[offset], sizeof(data));
+					if (arch_setupBreakpoint(addr, data) != data)
+						continue;
+
+					data = arch_clearBreakpoint(addr, instructions[addr].m_data, data);
+					memcpy(&memory[offset], &data, sizeof(data));
+				}
+
+				if (writeMemoryRanges(ranges, memory.data())) {
+					kcov_debug(BP_MSG, "Restored %d in %zu ranges (%zu bytes)\n",
+							m_activeChild, ranges.size(), total);
+					return true;
+				}
+			}
+
+			bool out = true;
+
+			for (PendingBreakpointList_t::const_iterator addrIt = addresses.begin();
+					addrIt != addresses.end();
+					++addrIt) {
+				unsigned long addr = *addrIt;
+
+				errno = 0;
+				unsigned long data = peekWord(addr);
+				if (errno != 0) {
+					out = false;
+					continue;
+				}
+
+				if (arch_setupBreakpoint(addr, data) == data &&
+						!pokeWord(addr, arch_clearBreakpoint(addr, instructions[addr].m_data, data)))
+					out = false;
+			}
+
+			return out;
+		}
+
+		// Returns the number of breakpoints set
+		long setupAllBreakpointsWordwise()
+		{
+			long out = 0;
+
+			for (PendingBreakpointList_t::const_iterator addrIt = m_pendingBreakpoints.begin();
+					addrIt != m_pendingBreakpoints.end();
+					++addrIt) {
+				unsigned long addr = *addrIt;
+				unsigned long cur_data = peekWord(addr);
+				Instruction &insn = m_engine.m_instructionMap[addr];
+
+				if (!insn.m_fromFile)
+					insn.m_data = cur_data;
+
+				// Set the breakpoint (unmapped ones can't trigger)
+				if (pokeWord(addr, arch_setupBreakpoint(addr, cur_data)))
+					out++;
+			}
+
+			return out;
+		}
+
+		/*
+		 * Install all pending breakpoints with a few large transfers instead of
+		 * a PEEKTEXT/POKETEXT pair per breakpoint: The pages holding them are
+		 * read in one vectored call, patched locally and written back one
+		 * contiguous range at a time through /proc/PID/mem (process_vm_writev
+		 * honors the page protection, so it can't be used for the text).
+		 *
+		 * Returns false if the bulk interfaces are unavailable, in which case
+		 * nothing has been modified.
+		 */
+		bool setupAllBreakpointsBulk()
+		{
+			MemoryRangeList_t ranges;
+
+			std::sort(m_pendingBreakpoints.begin(), m_pendingBreakpoints.end());
+
+			size_t total = getPageRanges(m_pendingBreakpoints, ranges);
+			std::vector<uint8_t> original(total);
+
+			if (!readMemoryRanges(ranges, original.data()))
+				return false;
+
+			int fd = ::open(fmt("/proc/%d/mem", m_activeChild).c_str(), O_RDWR | O_CLOEXEC);
+			if (fd < 0)
+				return false;
+
+			std::vector<uint8_t> patched(original);
+			MemoryRangeList_t::const_iterator range = ranges.begin();
+			size_t rangeOffset = 0;
+
+			for (PendingBreakpointList_t::const_iterator addrIt = m_pendingBreakpoints.begin();
+					addrIt != m_pendingBreakpoints.end();
+					++addrIt) {
+				unsigned long addr = *addrIt;
+				unsigned long word = getAligned(addr);
+
+				// Both lists are sorted, so just advance to the containing range
+				while (word >= range->second) {
+					rangeOffset += range->second - range->first;
+					++range;
+				}
+
+				size_t offset = rangeOffset + (word - range->first);
+				unsigned long orig_data;
+				unsigned long cur_data;
+
+				memcpy(&orig_data, &original[offset], sizeof(orig_data));
+				memcpy(&cur_data, &patched[offset], sizeof(cur_data));
+
+				Instruction &insn = m_engine.m_instructionMap[addr];
+
+				// Not from the file, or the file doesn't match memory (text relocations)
+				if (!insn.m_fromFile || insn.m_data != orig_data)
+					insn = Instruction(orig_data, false, insn.m_id);
+
+				cur_data = arch_setupBreakpoint(addr, cur_data);
+				memcpy(&patched[offset], &cur_data, sizeof(cur_data));
+			}
+
+			bool out = true;
+			size_t offset = 0;
+
+			for (MemoryRangeList_t::const_iterator it = ranges.begin();
+					it != ranges.end();
+					++it) {
+				size_t size = it->second - it->first;
+
+				if (pwrite(fd, &patched[offset], size, it->first) != (ssize_t)size) {
+					kcov_debug(BP_MSG, "Can't write %zu bytes at 0x%lx through /proc/%d/mem\n",
+							size, it->first, m_activeChild);
+					out = false;
+					break;
+				}
+				offset += size;
+			}
+			close(fd);
+
+			// Partially written? Restore what might have been written
+			if (!out)
+				writeMemoryRanges(ranges, original.data());
+
+			kcov_debug(BP_MSG, "Installed %zu breakpoints in %zu ranges (%zu bytes)\n",
+					m_pendingBreakpoints.size(), ranges.size(), total);
+
+			return out;
+		}
+
+		// The (merged) page ranges covering the words of the sorted @a addresses. Returns the total size
+		size_t getPageRanges(const PendingBreakpointList_t &addresses, MemoryRangeList_t &ranges)
+		{
+			unsigned long pageSize = getpagesize();
+			size_t total = 0;
+
+			for (PendingBreakpointList_t::const_iterator addrIt = addresses.begin();
+					addrIt != addresses.end();
+					++addrIt) {
+				unsigned long word = getAligned(*addrIt);
+				unsigned long start = word & ~(pageSize - 1);
+				unsigned long end = (word + sizeof(unsigned long) + pageSize - 1) & ~(pageSize - 1);
+
+				if (!ranges.empty() && start <= ranges.back().second)
+					ranges.back().second = std::max(ranges.back().second, end);
+				else
+					ranges.push_back(MemoryRange_t(start, end));
+			}
+
+			for (MemoryRangeList_t::const_iterator it = ranges.begin();
+					it != ranges.end();
+					++it)
+				total += it->second - it->first;
+
+			return total;
+		}
+
+		bool readMemoryRanges(const MemoryRangeList_t &ranges, uint8_t *dst)
+		{
+			std::vector<struct iovec> local;
+			std::vector<struct iovec> remote;
+			size_t total = 0;
+
+			for (MemoryRangeList_t::const_iterator it = ranges.begin();
+					it != ranges.end();
+					++it) {
+				struct iovec l = {dst + total, it->second - it->first};
+				struct iovec r = {(void *)it->first, it->second - it->first};
+
+				local.push_back(l);
+				remote.push_back(r);
+				total += it->second - it->first;
+			}
+
+			// One call per IOV_MAX ranges
+			bool out = true;
+			for (size_t i = 0; i < local.size(); i += IOV_MAX) {
+				size_t n = std::min<size_t>(IOV_MAX, local.size() - i);
+				size_t expected = 0;
+
+				for (size_t j = i; j < i + n; j++)
+					expected += local[j].iov_len;
+
+				if (process_vm_readv(m_activeChild, &local[i], n, &remote[i], n, 0) != (ssize_t)expected) {
+					out = false;
+					break;
+				}
+			}
+
+			if (out)
+				return true;
+
+			// Not available (old kernel, or restricted), try /proc/PID/mem
+			int fd = ::open(fmt("/proc/%d/mem", m_activeChild).c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0)
+				return false;
+
+			out = true;
+			for (size_t i = 0; i < local.size(); i++) {
+				if (pread(fd, local[i].iov_base, local[i].iov_len, (off_t)remote[i].iov_base) != (ssize_t)local[i].iov_len) {
+					out = false;
+					break;
+				}
+			}
+			close(fd);
+
+			return out;
+		}
+
+		bool writeMemoryRanges(const MemoryRangeList_t &ranges, const uint8_t *src)
+		{
+			int fd = ::open(fmt("/proc/%d/mem", m_activeChild).c_str(), O_RDWR | O_CLOEXEC);
+			size_t offset = 0;
+			bool out = true;
+
+			if (fd < 0)
+				return false;
+
+			for (MemoryRangeList_t::const_iterator it = ranges.begin();
+					it != ranges.end();
+					++it) {
+				size_t size = it->second - it->first;
+
+				if (pwrite(fd, src + offset, size, it->first) != (ssize_t)size) {
+					out = false;
+					break;
+				}
+				offset += size;
+			}
+			close(fd);
+
+			return out;
+		}
+
+		bool forkChild(const char *executable)
+		{
+			char *const *argv = (char *const *)IConfiguration::getInstance().getArgv();
+			pid_t child, who;
+			int status;
+
+			/* Executable exists, try to launch it */
+			if ((child = fork()) == 0) {
+				int persona;
+				int res;
+
+				/* Avoid address randomization */
+				persona = personality(0xffffffff);
+				if (persona < 0) {
+					perror("Can't get personality");
+					_exit(1);
+				}
+				persona |= 0x0040000; /* ADDR_NO_RANDOMIZE */
+				if (personality(persona) < 0) {
+					perror("Can't set personality");
+					_exit(1);
+				}
+
+				/* And launch the process */
+				res = ptrace(PTRACE_TRACEME, 0, 0, 0);
+				if (res < 0) {
+					perror("Can't set me as ptraced");
+					_exit(1);
+				}
+				if (m_engine.m_pinCpu)
+					tie_process_to_cpu(getpid(), m_engine.m_parentCpu);
+				// Blocked in the tracer, but not for the program
+				m_engine.allowWakeup(true);
+				execv(executable, argv);
+
+				/* Exec failed */
+				_exit(1);
+			}
+
+			/* Fork error? */
+			if (child < 0) {
+				perror("fork");
+				return false;
+			}
+			m_activeChild = child;
+			m_addressSpaces[child] = child;
+			// Might not be completely necessary (the child should inherit this
+			// from the parent), but better safe than sorry
+			if (m_engine.m_pinCpu)
+				tie_process_to_cpu(child, m_engine.m_parentCpu);
+
+			kcov_debug(ENGINE_MSG, "PT forked %d\n", child);
+
+			/* Wait for the initial stop */
+			who = waitpid(child, &status, 0);
+			if (who < 0) {
+				perror("waitpid");
+				return false;
+			}
+			if (!WIFSTOPPED(status)) {
+				fprintf(stderr, "Child hasn't stopped: %x\n", status);
+				return false;
+			}
+
+			ptrace(PTRACE_SETOPTIONS, m_activeChild, 0, m_engine.ptraceOptions());
+
+			return true;
+		}
+
+		bool attachPid(pid_t pid)
+		{
+			int rv;
+
+			m_activeChild = pid;
+			m_addressSpaces[pid] = pid;
+
+			errno = 0;
+			rv = linuxAttach(m_activeChild);
+			//rv = ptrace(PTRACE_ATTACH, m_activeChild, 0, 0);
+			if (rv < 0) {
+				const char *err = strerror(errno);
+
+				fprintf(stderr, "Can't attach to %d. Error %s\n", pid, err);
+				return false;
+			}
+
+			/* Wait for the initial stop */
+			int status;
+			int who = waitpid(m_activeChild, &status, 0);
+			if (who < 0) {
+				perror("waitpid");
+				return false;
+			}
+			if (!WIFSTOPPED(status)) {
+				fprintf(stderr, "Child hasn't stopped: %x\n", status);
+				return false;
+			}
+			if (m_engine.m_pinCpu)
+				tie_process_to_cpu(m_activeChild, m_engine.m_parentCpu);
+
+			return true;
+		}
+
+		/* Taken from GDB (loop through all threads and attach to each one)  */
+		int linuxAttach (pid_t pid)
+		{
+			int err;
+
+			/* Attach to PID.  We will check for other threads soon. */
+			err = attachLwp (pid);
+			if (err != 0)
+				error ("Cannot attach to process %d\n", pid);
+
+			if (linux_proc_get_tgid (pid) != pid)
+			{
+				return 0;
+			}
+
+			DIR *dir;
+			char pathname[128];
+
+			sprintf (pathname, "/proc/%d/task", pid);
+
+			dir = opendir (pathname);
+
+			if (!dir) {
+				error("Could not open /proc/%d/task.\n", pid);
+
+				return 0;
+			}
+
+			/* At this point we attached to the tgid.  Scan the task for
+			 * existing threads. */
+			int new_threads_found;
+			int iterations = 0;
+
+			std::unordered_map<unsigned long, bool> threads;
+			threads[pid] = true;
+
+			while (iterations < 2)
+			{
+				struct dirent *dp;
+
+				new_threads_found = 0;
+				/* Add all the other threads.  While we go through the
+				 * threads, new threads may be spawned.  Cycle through
+				 * the list of threads until we have done two iterations without
+				 * finding new threads.  */
+				while ((dp = readdir (dir)) != NULL)
+				{
+					int lwp;
+
+					/* Fetch one lwp.  */
+					lwp = strtoul (dp->d_name, NULL, 10);
+
+					/* Is this a new thread?  */
+					if (lwp != 0 && threads.find(lwp) == threads.end())
+					{
+						int err;
+						threads[lwp] = true;
+
+						err = attachLwp (lwp);
+						if (err != 0)
+							warning ("Cannot attach to lwp %d\n", lwp);
+						else
+							m_addressSpaces[lwp] = pid;
+
+						new_threads_found++;
+					}
+				}
+
+				if (!new_threads_found)
+					iterations++;
+				else
+					iterations = 0;
+
+				rewinddir (dir);
+			}
+			closedir (dir);
+
+			return 0;
+		}
+
+		/* Attach to an inferior process. */
+		int attachLwp (int lwpid)
+		{
+			int rv;
+
+			rv = ptrace (PTRACE_ATTACH, lwpid, 0, 0);
+
+			if (rv < 0)
+				return errno;
+			ptrace(PTRACE_SETOPTIONS, lwpid, 0, m_engine.ptraceOptions());
+
+			if (!linux_proc_pid_is_stopped (lwpid)) {
+				/*
+				 * First make sure there is a pending SIGSTOP.  Since we are
+				 * already attached, the process can not transition from stopped
+				 * to running without a PTRACE_CONT; so we know this signal will
+				 * go into the queue.  The SIGSTOP generated by PTRACE_ATTACH is
+				 * probably already in the queue (unless this kernel is old
+				 * enough to use TASK_STOPPED for ptrace stops); but since
+				 * SIGSTOP is not an RT signal, it can only be queued once.  */
+				kill_lwp (lwpid, SIGSTOP);
+			}
+
+			return 0;
+		}
+
+
+		// Skip over this instruction
+		void skipInstruction()
+		{
+			// Nop on x86, op on PowerPC/ARM
+	#if defined(__powerpc__) || defined(__arm__) || defined(__aarch64__)
+			unsigned long *regs = getRegisters();
+
+	# if defined(__powerpc__)
+			regs[ppc_NIP] += 4;
+	# elif defined(__aarch64__)
+			regs[aarch64_PC] += 4;
+	# else
+			regs[arm_PC] += 4;
+	# endif
+			m_registersDirty = true;
+	#endif
+		}
+
+		unsigned long getPcFromRegs(unsigned long *regs)
+		{
+			return arch_getPcFromRegs(regs);
+		}
+
+		unsigned long getPc()
+		{
+			return getPcFromRegs(getRegisters());
+		}
+
+		// The registers of the active child, read once per stop
+		unsigned long *getRegisters()
+		{
+			if (m_registersValid)
+				return m_registers;
+
+			m_registersValid = true;
+			m_registersSetSize = 0;
+
+	#if defined(__i386__) || defined(__x86_64__)
+			struct iovec iov = {m_registers, sizeof(struct user_regs_struct)};
+
+			// Only the general registers. 32-bit tracees have another layout there
+			if (ptrace((__ptrace_request)PTRACE_GETREGSET, m_activeChild, NT_PRSTATUS, &iov) == 0 &&
+					iov.iov_len == sizeof(struct user_regs_struct)) {
+				m_registersSetSize = iov.iov_len;
+
+				return m_registers;
+			}
+	#endif
+
+			memset(m_registers, 0, sizeof(m_registers));
+			ptrace((__ptrace_request)PTRACE_GETREGS, m_activeChild, 0, m_registers);
+
+			return m_registers;
+		}
+
+		// Write back modified registers before the child runs again
+		void flushRegisters()
+		{
+			if (m_registersDirty) {
+				if (m_registersSetSize != 0) {
+					struct iovec iov = {m_registers, m_registersSetSize};
+
+					ptrace((__ptrace_request)PTRACE_SETREGSET, m_activeChild, NT_PRSTATUS, &iov);
+				} else {
+					ptrace((__ptrace_request)PTRACE_SETREGS, m_activeChild, 0, m_registers);
+				}
+			}
+
+			m_registersDirty = false;
+			m_registersValid = false;
+		}
+
+		unsigned long peekWord(unsigned long addr)
+		{
+			unsigned long aligned = getAligned(addr);
+
+			return ptrace((__ptrace_request)PTRACE_PEEKTEXT, m_activeChild, aligned, 0);
+		}
+
+		bool pokeWord(unsigned long addr, unsigned long val)
+		{
+			return ptrace((__ptrace_request)PTRACE_POKETEXT, m_activeChild, getAligned(addr), val) == 0;
+		}
+
+		// Write through /proc/PID/mem, which (unlike POKETEXT) needs no read first
+		bool writeMemory(unsigned long addr, const void *src, size_t size)
+		{
+			for (unsigned int attempt = 0; attempt < 2; attempt++) {
+				if (!openMemory(attempt > 0))
+					return false;
+
+				if (pwrite(m_memFd, src, size, addr) == (ssize_t)size)
+					return true;
+			}
+
+			return false;
+		}
+
+		bool readMemory(unsigned long addr, void *dst, size_t size)
+		{
+			for (unsigned int attempt = 0; attempt < 2; attempt++) {
+				if (!openMemory(attempt > 0))
+					return false;
+
+				if (pread(m_memFd, dst, size, addr) == (ssize_t)size)
+					return true;
+			}
+
+			return false;
+		}
+
+		bool openMemory(bool reopen)
+		{
+			// Different process, or a stale file after an exec
+			if (m_memFd < 0 || m_memFdPid != m_activeChild || reopen) {
+				if (m_memFd >= 0)
+					close(m_memFd);
+
+				m_memFdPid = m_activeChild;
+				m_memFd = ::open(fmt("/proc/%d/mem", m_activeChild).c_str(), O_RDWR | O_CLOEXEC);
+			}
+
+			return m_memFd >= 0;
+		}
+
+		Ptrace &m_engine;
+		pid_t m_pid;
+		SavedRegisters m_handOverRegisters;
+
+		PendingBreakpointList_t m_pendingBreakpoints;
+		AddressSpaceMap_t m_addressSpaces;
+		ArmedBreakpointMap_t m_armedBreakpoints;
+
+		pid_t m_activeChild;
+		ChildMap_t m_children;
+		std::unordered_set<pid_t> m_helpers; // kcov instances following exec:ed programs
+
+		unsigned long m_signal;
+		uint64_t m_lastSignalAddress;
+
+		int m_memFd;
+		pid_t m_memFdPid;
+		bool m_resumed; // Protected by the engine lock
+
+		unsigned long m_registers[1024];
+		bool m_registersValid;
+		bool m_registersDirty;
+		size_t m_registersSetSize; // PTRACE_GETREGSET size, 0 for PTRACE_GETREGS
+	};
+
+	void startTracer(Tracer *tracer)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		pthread_t thread;
+
+		panic_if(pthread_create(&thread, NULL, Tracer::threadStatic, (void *)tracer) != 0,
+				"Can't create tracer thread");
+		m_threads.push_back(thread);
+	}
+
+	// Room for another tracer thread?
+	bool reserveTracer()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (m_tracers >= m_maxTracers)
+			return false;
+		m_tracers++;
+
+		return true;
+	}
+
+	void releaseTracer()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		// The last one tells the collector that there's nothing more to trace
+		if (--m_tracers == 0) {
+			m_events.push_back(QueuedEvent_t(Event(ev_error, -1), NULL));
+			m_eventCond.notify_one();
+		}
+	}
+
+	/*
+	 * The first process has been started (pid != 0) or has failed to. Wait
+	 * until the breakpoints have been set up before letting it run.
+	 */
+	bool started(Tracer &tracer, pid_t pid)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		m_firstChild = pid;
+		m_firstChildTraced = pid != 0;
+
+		// Written to while running, so not through ptrace
+		if (m_forkServer && pid != 0)
+			m_forkServerMemFd = ::open(fmt("/proc/%d/mem", pid).c_str(), O_RDWR | O_CLOEXEC);
+		m_startState = pid != 0 ? START_OK : START_FAILED;
+		m_eventCond.notify_all();
 
+		if (pid == 0)
+			return false;
+
+		m_stoppedTracer = &tracer;
+		tracer.waitForResume(lock);
+
+		return true;
+	}
+
+	// Stopped processes wait for continueExecution to let them run
+	void queueEvent(const Event &ev, Tracer *stopped, std::unique_lock<std::mutex> &lock)
+	{
+		if (!lock.owns_lock())
+			lock.lock();
+
+		m_events.push_back(QueuedEvent_t(ev, stopped));
+		m_eventCond.notify_one();
+
+		if (stopped)
+			stopped->waitForResume(lock);
+	}
+
+	bool lookupInstruction(unsigned long addr, Instruction &out)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		instructionMap_t::const_iterator it = m_instructionMap.find(addr);
+
+		if (it == m_instructionMap.end())
+			return false;
+		out = it->second;
+
+		return true;
+	}
+
+	// Entry points in the basic block of a leader, except the leader itself
+	bool getBlockFollowers(unsigned long leader, std::vector<unsigned long> &out)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		BlockFollowerMap_t::const_iterator it = m_blockFollowers.find(leader);
+
+		if (it == m_blockFollowers.end())
+			return false;
+		out = it->second;
+
+		return true;
+	}
+
+	/*
+	 * With --fork-server, the inputs run in forks of the first process, so
+	 * a breakpoint hit in one is cleared in the server as well. The later
+	 * forks then don't trap on it.
+	 */
+	void clearInForkServer(unsigned long addr)
+	{
+#if defined(__i386__) || defined(__x86_64__)
+		Instruction insn;
+
+		if (m_forkServerMemFd < 0 || !lookupInstruction(addr, insn) || !insn.m_fromFile)
+			return;
+
+		uint8_t orig = (insn.m_data >> (8 * (addr - getAligned(addr)))) & 0xff;
+
+		if (pwrite(m_forkServerMemFd, &orig, sizeof(orig), addr) != sizeof(orig))
+			kcov_debug(BP_MSG, "Can't clear 0x%lx in the fork server\n", addr);
+#endif
+	}
+
+	bool firstBreakpoint()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		bool out = m_firstBreakpoint;
+
+		m_firstBreakpoint = false;
+
+		return out;
+	}
+
+	/*
+	 * A process exited or was detached (called with the lock held). Returns
+	 * true if the first process is still traced.
+	 */
+	bool childGone(pid_t pid)
+	{
+		if (pid == m_firstChild)
+			m_firstChildTraced = false;
+
+		return m_firstChildTraced;
+	}
+
+	// With a way to stop tracing, before the processes exit
+	bool canDetachAll() const
+	{
+		return m_attachPid != 0 || m_attachDuration > 0;
+	}
+
+	// Called with the lock held
+	bool shouldDetachAll() const
+	{
+		if (detach_requested)
+			return true;
+
+		return m_attachDuration > 0 && m_startState == START_OK &&
+				std::chrono::steady_clock::now() >= m_deadline;
+	}
+
+	bool detaching()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		return m_detaching;
+	}
+
+	/*
+	 * SIGUSR1 to kcov detaches. SIGUSR2 wakes up the tracers, without
+	 * SA_RESTART so that a tracer waiting for its processes returns with EINTR.
+	 * It's blocked everywhere but in that wait, so no other system call
+	 * is interrupted. The tracer threads inherit the mask from this one.
+	 */
+	void setupDetachSignals()
+	{
+		struct sigaction sa;
+		sigset_t set;
+
+		memset(&sa, 0, sizeof(sa));
+		sigemptyset(&sa.sa_mask);
+
+		sigemptyset(&set);
+		sigaddset(&set, SIGUSR2);
+		pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+		sa.sa_handler = wakeup_signal_handler;
+		sigaction(SIGUSR2, &sa, NULL);
+
+		sa.sa_handler = detach_signal_handler;
+		sa.sa_flags = SA_RESTART;
+		sigaction(SIGUSR1, &sa, NULL);
+	}
+
+	// Let a tracer be woken up (with EINTR) while waiting for its processes
+	void allowWakeup(bool allow)
+	{
+		sigset_t set;
+
+		if (!canDetachAll())
+			return;
+
+		sigemptyset(&set);
+		sigaddset(&set, SIGUSR2);
+		pthread_sigmask(allow ? SIG_UNBLOCK : SIG_BLOCK, &set, NULL);
+	}
+
+	// Called with the lock held
+	void wakeTracers()
+	{
+		for (ThreadList_t::const_iterator it = m_threads.begin();
+				it != m_threads.end();
+				++it)
+			pthread_kill(*it, SIGUSR2);
+	}
+
+	unsigned long ptraceOptions() const
+	{
+		unsigned long out = PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK;
+
+		if (m_followExec)
+			out |= PTRACE_O_TRACEEXEC;
+
+		return out;
+	}
+
+	/*
+	 * The kcov options and output directory, to run another kcov on
+	 * exec:ed programs. Everything up to the program name.
+	 */
+	void setupKcovArguments()
+	{
+		size_t sz;
+		char *p = (char *)read_file(&sz, "/proc/self/cmdline");
+		std::vector<std::string> args;
+
+		if (!p)
+			return;
+
+		for (size_t i = 0; i < sz; i += strlen(&p[i]) + 1)
+			args.push_back(std::string(&p[i]));
+		free(p);
+
+		size_t n = args.size() - std::min<size_t>(args.size(), IConfiguration::getInstance().getArgc());
+
+		// At least kcov and the output directory
+		if (n < 2)
+			return;
+
+		m_kcovArguments.assign(args.begin(), args.begin() + n);
+		m_kcovPath = real_path("/proc/self/exe");
+	}
+
+	// Worth running kcov on an exec:ed program?
+	bool shouldFollowExec(const std::string &path)
+	{
+		if (m_kcovArguments.empty())
+			return false;
+
+		// Not ourselves, and not another run of the main program
+		if (path == m_kcovPath ||
+				path.substr(path.rfind('/') + 1) == IConfiguration::getInstance().keyAsString("binary-name"))
+			return false;
+
+		return has_debug_info(path);
+	}
+
+	void reportEvent(const Event &ev)
+	{
+		std::vector<unsigned long> followers;
+
+		if (ev.type != ev_breakpoint || !reportBlockLines(ev.addr)) {
+			m_listener->onEvent(ev);
+			return;
+		}
+
+		// A leader runs through the entry points in its block as well
+		if (!getBlockFollowers(ev.addr, followers))
+			return;
+
+		for (std::vector<unsigned long>::const_iterator it = followers.begin();
+				it != followers.end();
+				++it)
+			reportBlockLines(*it);
+	}
+
+	// Report the line addresses covered by a basic block leader or entry point
+	bool reportBlockLines(unsigned long addr)
+	{
+		BlockAddressMap_t::iterator it = m_blockAddresses.find(addr);
+
+		if (it == m_blockAddresses.end())
+			return false;
+
+		for (std::vector<BlockLine_t>::const_iterator lineIt = it->second.begin();
+				lineIt != it->second.end();
+				++lineIt)
+			m_listener->onEvent(Event(ev_breakpoint, lineIt->second, lineIt->first));
+
+		m_blockAddresses.erase(it);
+
+		return true;
+	}
+
+	enum StartState
+	{
+		START_PENDING,
+		START_OK,
+		START_FAILED,
+	};
+
+	typedef std::pair<Event, Tracer *> QueuedEvent_t; // The tracer waits if non-NULL
+	typedef std::deque<QueuedEvent_t> EventQueue_t;
+	typedef std::vector<pthread_t> ThreadList_t;
+
+	IFileParser &m_fileParser;
+	std::string m_executable;
+	pid_t m_attachPid;
+	bool m_basicBlocks;
+	BlockAddressMap_t m_blockAddresses; // Only used from the main thread
+	BreakpointIdMap_t m_breakpointIds; // Likewise
+	bool m_followExec;
+	std::vector<std::string> m_kcovArguments;
+	std::string m_kcovPath;
+	unsigned int m_attachDuration;
+	std::chrono::steady_clock::time_point m_deadline;
+	bool m_autoDetach;
+	bool m_pinCpu;
+	bool m_forkServer;
+	int m_maxTracers;
+	int m_parentCpu;
 	IEventListener *m_listener;
-	unsigned long m_signal;
+
+	// Protected by m_mutex
+	std::mutex m_mutex;
+	instructionMap_t m_instructionMap;
+	BlockFollowerMap_t m_blockFollowers;
+	PendingBreakpointList_t m_pendingBreakpoints;
+	bool m_firstBreakpoint;
+	pid_t m_firstChild;
+	bool m_firstChildTraced;
+	bool m_hasArmedBreakpoints;
+	int m_tracers;
+	ThreadList_t m_threads;
+	EventQueue_t m_events;
+	Tracer *m_stoppedTracer;
+	enum StartState m_startState;
+	std::condition_variable m_eventCond; // Events and startup, for the main thread
+	std::condition_variable m_resumeCond; // For stopped tracers
+	bool m_detaching;
+	int m_forkServerMemFd; // Set up before the first hit
 };
 
 
@@ -780,7 +2540,7 @@ public:
 
 	virtual IEngine *create(IFileParser &parser)
 	{
-		return new Ptrace();
+		return new Ptrace(parser);
 	}
 
 	unsigned int matchFile(const std::string &filename, uint8_t *data, size_t dataSize)
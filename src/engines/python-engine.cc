@@ -148,7 +148,7 @@ public:
 
 			ev.type = ev_breakpoint;
 			ev.addr = address;
-			ev.data = 1;
+			ev.data = -1;
 
 			m_listener->onEvent(ev);
 		}
@@ -40,7 +40,7 @@ public:
 	virtual int registerBreakpoint(unsigned long addr)
 	{
 		// No breakpoints
-		return 0;
+		return -1;
 	}
 
 
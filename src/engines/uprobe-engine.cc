@@ -0,0 +1,593 @@
+#include <engine.hh>
+#include <utils.hh>
+#include <configuration.hh>
+#include <file-parser.hh>
+#include <solib-handler.hh>
+#include <output-handler.hh>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+
+using namespace kcov;
+
+/*
+ * Lines are probed with uprobes (see Documentation/trace/uprobetracer.rst
+ * in the kernel), so the kernel handles the breakpoints without stopping
+ * the program. Hits are read from the trace buffer of a tracefs instance
+ * of our own. Disabling a probe waits for the kernel to synchronize, so
+ * only those which keep hitting are disabled.
+ *
+ * The first process waits on a FIFO until its probes are in place: Once
+ * before exec, and after each solib report (see solib-parser/lib.c), with
+ * one byte written by kcov per report parsed.
+ */
+static const char *tracefs_paths[] =
+{
+	"/sys/kernel/tracing",
+	"/sys/kernel/debug/tracing",
+};
+
+// Adding a probe gets slower with the number of probes, and the kernel has
+// room for fewer than 64k trace events in total
+#define DEFAULT_MAX_PROBES 32768
+
+static bool write_tracefs(const std::string &path, const std::string &data)
+{
+	// Not O_TRUNC, which would remove all uprobes
+	int fd = open(path.c_str(), O_WRONLY | O_APPEND);
+
+	if (fd < 0)
+		return false;
+
+	ssize_t r = write(fd, data.c_str(), data.size());
+	close(fd);
+
+	return r == (ssize_t)data.size();
+}
+
+class UprobeEngine : public IEngine
+{
+public:
+	UprobeEngine(IFileParser &parser) :
+		m_parser(parser),
+		m_listener(NULL),
+		m_pipeFd(-1),
+		m_nGroups(0),
+		m_firstChild(-1),
+		m_firstExitReported(false),
+		m_lastExitStatus(0),
+		m_syncFd(-1),
+		m_started(false),
+		m_syncs(0),
+		m_maxProbes(DEFAULT_MAX_PROBES),
+		m_full(false)
+	{
+		int maxProbes = IConfiguration::getInstance().keyAsInt("uprobe-max-probes");
+
+		if (maxProbes > 0)
+			m_maxProbes = maxProbes;
+	}
+
+	~UprobeEngine()
+	{
+		removeProbes();
+	}
+
+	int registerBreakpoint(unsigned long addr)
+	{
+		BreakpointIdMap_t::const_iterator existing = m_breakpointIds.find(addr);
+
+		if (existing != m_breakpointIds.end())
+			return existing->second;
+
+		// Dense, unlike the probe IDs which are per file and offset
+		int bpId = m_breakpointIds.size();
+
+		std::string file;
+		uint64_t offset;
+
+		if (!m_parser.getFileOffset(addr, file, offset))
+			return -1;
+
+		// One probe per inode and offset, wherever the file was found
+		struct stat st;
+		if (stat(file.c_str(), &st) < 0)
+			return -1;
+
+		std::string key = fmt("%llx:%llx:%llx",
+				(unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+				(unsigned long long)offset);
+		ProbeKeyMap_t::const_iterator it = m_probeByKey.find(key);
+
+		if (it != m_probeByKey.end()) {
+			m_probes[it->second].m_addresses.push_back(Breakpoint_t(addr, bpId));
+			m_breakpointIds[addr] = bpId;
+
+			return bpId;
+		}
+
+		// Reported (and kcov stopped) in continueExecution
+		if (m_probes.size() >= m_maxProbes) {
+			m_full = true;
+
+			return -1;
+		}
+
+		const std::string &path = get_real_path(file);
+
+		// Can't be expressed in uprobe_events
+		if (path.find_first_of(" \t\n:") != std::string::npos)
+			return -1;
+
+		unsigned int id = m_probes.size();
+
+		m_probes.push_back(Probe(id, path, offset, Breakpoint_t(addr, bpId)));
+		m_probeByKey[key] = id;
+		m_breakpointIds[addr] = bpId;
+		m_pending.push_back(id);
+
+		kcov_debug(BP_MSG, "UP probe registered at 0x%lx (%s:0x%llx)\n",
+				addr, path.c_str(), (unsigned long long)offset);
+
+		return bpId;
+	}
+
+	bool start(IEventListener &listener, const std::string &executable)
+	{
+		IConfiguration &conf = IConfiguration::getInstance();
+		char *const *argv = (char *const *)conf.getArgv();
+
+		if (conf.keyAsInt("attach-pid")) {
+			error("--uprobes can't be used with --pid\n");
+
+			return false;
+		}
+
+		for (unsigned int i = 0; i < sizeof(tracefs_paths) / sizeof(tracefs_paths[0]); i++) {
+			if (file_exists(fmt("%s/uprobe_events", tracefs_paths[i]))) {
+				m_tracing = tracefs_paths[i];
+				break;
+			}
+		}
+
+		if (m_tracing == "") {
+			error("--uprobes needs a kernel with uprobe events and tracefs mounted, e.g.,\n"
+					"  mount -t tracefs nodev /sys/kernel/tracing\n");
+
+			return false;
+		}
+
+		m_instance = fmt("%s/instances/kcov-%d", m_tracing.c_str(), getpid());
+		m_groupPrefix = fmt("kcov%d", getpid());
+
+		rmdir(m_instance.c_str());
+		if (mkdir(m_instance.c_str(), 0755) < 0) {
+			error("Can't create tracefs instance %s (not root?)\n", m_instance.c_str());
+			m_instance = "";
+
+			return false;
+		}
+
+		// Room for hits of code which run a lot before the probe is disabled
+		write_tracefs(m_instance + "/buffer_size_kb", "8192");
+		write_tracefs(m_instance + "/options/event-fork", "1");
+
+		m_pipeFd = open((m_instance + "/trace_pipe").c_str(), O_RDONLY | O_NONBLOCK);
+		if (m_pipeFd < 0) {
+			error("Can't open the trace pipe\n");
+
+			return false;
+		}
+
+		std::string syncPath = IOutputHandler::getInstance().getOutDirectory() + "kcov-uprobe.pipe";
+
+		unlink(syncPath.c_str());
+		if (mkfifo(syncPath.c_str(), 0600) < 0) {
+			error("Can't create uprobe FIFO %s\n", syncPath.c_str());
+
+			return false;
+		}
+
+		// Read and write, so that writes never block and readers see EOF when kcov is gone
+		m_syncFd = open(syncPath.c_str(), O_RDWR | O_CLOEXEC);
+		if (m_syncFd < 0) {
+			error("Can't open uprobe FIFO %s\n", syncPath.c_str());
+
+			return false;
+		}
+
+		m_listener = &listener;
+
+		// Orphaned processes are reaped (and thereby waited for) here
+		prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0);
+
+		m_firstChild = fork();
+		if (m_firstChild == 0) {
+			putenv(xstrdup(fmt("KCOV_UPROBE_PID=%d", getpid()).c_str()));
+			putenv(xstrdup(fmt("KCOV_UPROBE_SYNC=%s", syncPath.c_str()).c_str()));
+			close(m_syncFd);
+
+			// Until the initial probes are in place
+			int fd = open(syncPath.c_str(), O_RDONLY);
+			char c;
+
+			if (fd < 0 || read(fd, &c, 1) != 1)
+				_exit(127);
+			close(fd);
+
+			execv(argv[0], argv);
+			perror("execv");
+			_exit(127);
+		} else if (m_firstChild < 0) {
+			perror("fork");
+
+			return false;
+		}
+
+		write_tracefs(m_instance + "/set_event_pid", fmt("%d", m_firstChild));
+
+		return true;
+	}
+
+	void kill(int sig)
+	{
+		if (m_firstChild > 0)
+			::kill(m_firstChild, sig);
+	}
+
+	bool continueExecution()
+	{
+		if (m_full) {
+			::kill(m_firstChild, SIGKILL);
+			removeProbes();
+			panic("--uprobes needs more than %u probes, raise the limit with\n"
+					"--configure=uprobe-max-probes=N or use --granularity=line\n", m_maxProbes);
+		}
+
+		// Probe the lines parsed since the last time
+		flushProbes();
+
+		if (!m_started) {
+			m_started = true;
+			sync();
+		}
+
+		// One byte per solib report, written when its probes are in place
+		unsigned int parsed = solibReportsParsed();
+		while (m_syncs < parsed && !solibDataPending()) {
+			sync();
+			m_syncs++;
+		}
+
+		readHits();
+
+		while (1) {
+			int status;
+			pid_t pid = waitpid(-1, &status, WNOHANG | __WALL);
+
+			if (pid == 0)
+				break;
+
+			if (pid < 0) {
+				if (errno == EINTR)
+					continue;
+
+				// No children left, the last one decides the exit code
+				Event ev(ev_exit, m_lastExitStatus);
+
+				readHits();
+				m_listener->onEvent(ev);
+
+				return false;
+			}
+
+			Event ev(ev_exit_first_process, WEXITSTATUS(status));
+
+			if (WIFSIGNALED(status))
+				ev = Event(ev_signal_exit, WTERMSIG(status));
+			m_lastExitStatus = ev.data;
+
+			if (pid != m_firstChild || m_firstExitReported)
+				continue;
+
+			m_firstExitReported = true;
+			readHits();
+			m_listener->onEvent(ev);
+		}
+
+		struct pollfd pfd;
+
+		pfd.fd = m_pipeFd;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, solibDataPending() ? 1 : 10);
+
+		return true;
+	}
+
+private:
+	typedef std::pair<uint64_t, int> Breakpoint_t; // Address, breakpoint ID
+
+	class Probe
+	{
+	public:
+		Probe(unsigned int id, const std::string &path, uint64_t offset, const Breakpoint_t &bp) :
+			m_id(id), m_path(path), m_offset(offset), m_registered(false), m_hits(0)
+		{
+			m_addresses.push_back(bp);
+		}
+
+		unsigned int m_id;
+		std::string m_path;
+		uint64_t m_offset;
+		std::string m_group;
+		std::vector<Breakpoint_t> m_addresses;
+		bool m_registered;
+		unsigned int m_hits;
+	};
+
+	typedef std::vector<Probe> ProbeList_t;
+	typedef std::vector<unsigned int> ProbeIdList_t;
+	typedef std::unordered_map<std::string, unsigned int> ProbeKeyMap_t;
+	typedef std::unordered_map<uint64_t, int> BreakpointIdMap_t;
+
+	// Let the first process continue
+	void sync()
+	{
+		char c = 's';
+
+		if (write(m_syncFd, &c, 1) != 1)
+			warning("uprobes: Can't write to the sync FIFO\n");
+	}
+
+	// Also when panicking, kernel probes outlive kcov otherwise
+	void removeProbes()
+	{
+		if (m_syncFd >= 0)
+			close(m_syncFd);
+		m_syncFd = -1;
+
+		if (m_instance == "")
+			return;
+
+		if (m_pipeFd >= 0)
+			close(m_pipeFd);
+		m_pipeFd = -1;
+
+		// Probes can't be removed while enabled somewhere
+		write_tracefs(m_instance + "/events/enable", "0");
+		rmdir(m_instance.c_str());
+
+		for (unsigned int i = 0; i < m_nGroups; i++) {
+			std::string group = fmt("%s_%u", m_groupPrefix.c_str(), i);
+
+			// The whole group at once, or one by one on older kernels
+			if (write_tracefs(m_tracing + "/uprobe_events", fmt("-:%s/\n", group.c_str())))
+				continue;
+
+			std::vector<std::string> remove;
+			for (ProbeList_t::const_iterator it = m_probes.begin();
+					it != m_probes.end();
+					++it) {
+				if (it->m_registered && it->m_group == group)
+					remove.push_back(fmt("-:%s/p%u\n", group.c_str(), it->m_id));
+			}
+			writeLines(m_tracing + "/uprobe_events", remove);
+		}
+		m_nGroups = 0;
+		m_instance = "";
+	}
+
+	/*
+	 * Several lines per write (the kernel splits them), but one by one
+	 * after a failure, so that the rest still get written.
+	 *
+	 * @return the lines which couldn't be written
+	 */
+	std::vector<unsigned int> writeLines(const std::string &path, const std::vector<std::string> &lines)
+	{
+		std::vector<unsigned int> failed;
+		unsigned int first = 0;
+
+		while (first < lines.size()) {
+			std::string chunk;
+			unsigned int last = first;
+
+			while (last < lines.size() && chunk.size() + lines[last].size() < 4000)
+				chunk += lines[last++];
+
+			if (!write_tracefs(path, chunk)) {
+				for (unsigned int i = first; i < last; i++) {
+					if (!write_tracefs(path, lines[i]))
+						failed.push_back(i);
+				}
+			}
+
+			first = last;
+		}
+
+		return failed;
+	}
+
+	void flushProbes()
+	{
+		if (m_pending.empty())
+			return;
+
+		std::string group = fmt("%s_%u", m_groupPrefix.c_str(), m_nGroups++);
+		std::vector<std::string> lines;
+
+		for (ProbeIdList_t::const_iterator it = m_pending.begin();
+				it != m_pending.end();
+				++it) {
+			Probe &cur = m_probes[*it];
+
+			cur.m_group = group;
+			cur.m_registered = true;
+			lines.push_back(fmt("p:%s/p%u %s:0x%llx\n", group.c_str(), cur.m_id,
+					cur.m_path.c_str(), (unsigned long long)cur.m_offset));
+		}
+
+		std::vector<unsigned int> failed = writeLines(m_tracing + "/uprobe_events", lines);
+		for (std::vector<unsigned int>::const_iterator it = failed.begin();
+				it != failed.end();
+				++it) {
+			Probe &cur = m_probes[m_pending[*it]];
+
+			kcov_debug(ENGINE_MSG, "UP can't probe %s:0x%llx\n",
+					cur.m_path.c_str(), (unsigned long long)cur.m_offset);
+			cur.m_registered = false;
+		}
+
+		if (failed.size() != m_pending.size() &&
+				!write_tracefs(fmt("%s/events/%s/enable", m_instance.c_str(), group.c_str()), "1"))
+			warning("uprobes: Can't enable %s\n", group.c_str());
+
+		m_pending.clear();
+	}
+
+	void readHits()
+	{
+		char buf[64 * 1024];
+		ProbeIdList_t hits;
+
+		while (1) {
+			ssize_t r = read(m_pipeFd, buf, sizeof(buf));
+
+			if (r <= 0)
+				break;
+
+			m_partialLine.append(buf, r);
+
+			size_t start = 0;
+			size_t end;
+
+			while ((end = m_partialLine.find('\n', start)) != std::string::npos) {
+				int id = parseLine(m_partialLine.substr(start, end - start));
+
+				start = end + 1;
+				if (id < 0)
+					continue;
+
+				// Reported and disabled on the first hit, the rest were already queued
+				if (++m_probes[id].m_hits == 1)
+					hits.push_back(id);
+			}
+			m_partialLine.erase(0, start);
+		}
+
+		for (ProbeIdList_t::const_iterator it = hits.begin();
+				it != hits.end();
+				++it) {
+			const Probe &cur = m_probes[*it];
+
+			for (std::vector<Breakpoint_t>::const_iterator ait = cur.m_addresses.begin();
+					ait != cur.m_addresses.end();
+					++ait) {
+				Event ev(ev_breakpoint, ait->second, ait->first);
+
+				m_listener->onEvent(ev);
+			}
+		}
+
+		/*
+		 * The kernel removes the breakpoints of disabled probes. Deleting
+		 * the probes here as well makes the others miss hits, so that's
+		 * left for the destructor.
+		 */
+		for (ProbeIdList_t::const_iterator it = hits.begin();
+				it != hits.end();
+				++it) {
+			const Probe &cur = m_probes[*it];
+
+			write_tracefs(fmt("%s/events/%s/p%u/enable", m_instance.c_str(),
+					cur.m_group.c_str(), cur.m_id), "0");
+		}
+	}
+
+	// "    comm-pid   [cpu] flags  timestamp: p123: (0x401136)" -> 123
+	int parseLine(const std::string &line)
+	{
+		size_t end = line.rfind(": (");
+
+		if (end == std::string::npos)
+			return -1;
+
+		size_t start = line.rfind(' ', end);
+		if (start == std::string::npos || line[start + 1] != 'p')
+			return -1;
+
+		std::string name = line.substr(start + 2, end - start - 2);
+		if (!string_is_integer(name, 10))
+			return -1;
+
+		int64_t id = string_to_integer(name, 10);
+		if (id >= (int64_t)m_probes.size())
+			return -1;
+
+		return (int)id;
+	}
+
+	IFileParser &m_parser;
+	IEventListener *m_listener;
+	std::string m_tracing;
+	std::string m_instance;
+	std::string m_groupPrefix;
+	std::string m_partialLine;
+	int m_pipeFd;
+	unsigned int m_nGroups;
+
+	ProbeList_t m_probes;
+	ProbeIdList_t m_pending;
+	ProbeKeyMap_t m_probeByKey;
+	BreakpointIdMap_t m_breakpointIds;
+
+	pid_t m_firstChild;
+	bool m_firstExitReported;
+	int m_lastExitStatus;
+	int m_syncFd;
+	bool m_started;
+	unsigned int m_syncs;
+	unsigned int m_maxProbes;
+	bool m_full;
+};
+
+
+class UprobeEngineCreator : public IEngineFactory::IEngineCreator
+{
+public:
+	virtual ~UprobeEngineCreator()
+	{
+	}
+
+	virtual IEngine *create(IFileParser &parser)
+	{
+		return new UprobeEngine(parser);
+	}
+
+	unsigned int matchFile(const std::string &filename, uint8_t *data, size_t dataSize)
+	{
+		if (!IConfiguration::getInstance().keyAsInt("uprobes"))
+			return match_none;
+
+		// ELF programs only, scripts use their own engines
+		if (dataSize < 4 || memcmp(data, "\177ELF", 4) != 0)
+			return match_none;
+
+		return match_perfect;
+	}
+};
+
+static UprobeEngineCreator g_uprobeEngineCreator;
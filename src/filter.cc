@@ -4,11 +4,215 @@
 
 #include <limits.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <string>
 #include <vector>
+#include <deque>
+#include <unordered_map>
 
 using namespace kcov;
 
+enum MatchFlags
+{
+	MATCH_INCLUDE = 1,
+	MATCH_EXCLUDE = 2,
+};
+
+/*
+ * Aho-Corasick automaton to find many substrings in one pass over a string.
+ * Bytes which aren't in any pattern share a character class, which keeps
+ * the transition table small.
+ */
+class PatternMatcher
+{
+public:
+	PatternMatcher() :
+		m_nClasses(1)
+	{
+		memset(m_charClass, 0, sizeof(m_charClass));
+	}
+
+	void addPattern(const std::string &pattern, uint8_t flags)
+	{
+		m_patterns.push_back(Pattern(pattern, flags));
+	}
+
+	// Build the automaton after all patterns have been added
+	void compile()
+	{
+		for (unsigned int i = 0; i < m_patterns.size(); i++) {
+			const std::string &pattern = m_patterns[i].m_pattern;
+
+			for (unsigned int j = 0; j < pattern.size(); j++) {
+				uint8_t c = (uint8_t)pattern[j];
+
+				if (m_charClass[c] == 0)
+					m_charClass[c] = m_nClasses++;
+			}
+		}
+
+		// The root, state 0
+		m_next.assign(m_nClasses, 0);
+		m_flags.assign(1, 0);
+
+		// Trie of the patterns, 0 is "no child" (nothing goes back to the root)
+		for (unsigned int i = 0; i < m_patterns.size(); i++) {
+			const std::string &pattern = m_patterns[i].m_pattern;
+			uint32_t state = 0;
+
+			for (unsigned int j = 0; j < pattern.size(); j++) {
+				uint32_t &next = m_next[state * m_nClasses + m_charClass[(uint8_t)pattern[j]]];
+
+				if (next == 0) {
+					next = m_flags.size();
+					m_flags.push_back(0);
+					m_next.resize(m_next.size() + m_nClasses, 0);
+				}
+				// m_next might have been reallocated
+				state = m_next[state * m_nClasses + m_charClass[(uint8_t)pattern[j]]];
+			}
+			m_flags[state] |= m_patterns[i].m_flags;
+		}
+
+		// Failure links breadth first, turning the trie into a DFA
+		std::vector<uint32_t> fail(m_flags.size(), 0);
+		std::deque<uint32_t> queue;
+
+		for (uint32_t c = 0; c < m_nClasses; c++) {
+			if (m_next[c] != 0)
+				queue.push_back(m_next[c]);
+		}
+
+		while (!queue.empty()) {
+			uint32_t state = queue.front();
+
+			queue.pop_front();
+			for (uint32_t c = 0; c < m_nClasses; c++) {
+				uint32_t &next = m_next[state * m_nClasses + c];
+				uint32_t failNext = m_next[fail[state] * m_nClasses + c];
+
+				if (next == 0) {
+					next = failNext;
+					continue;
+				}
+
+				// Patterns ending here also end all suffixes
+				fail[next] = failNext;
+				m_flags[next] |= m_flags[failNext];
+				queue.push_back(next);
+			}
+		}
+
+		m_patterns.clear();
+	}
+
+	/*
+	 * Get the flags of the patterns in str, stopping early when one of
+	 * stopFlags is found
+	 */
+	uint8_t match(const std::string &str, uint8_t stopFlags) const
+	{
+		uint8_t out = m_flags[0]; // Empty patterns
+		uint32_t state = 0;
+
+		for (unsigned int i = 0; i < str.size() && !(out & stopFlags); i++) {
+			state = m_next[state * m_nClasses + m_charClass[(uint8_t)str[i]]];
+			out |= m_flags[state];
+		}
+
+		return out;
+	}
+
+private:
+	class Pattern
+	{
+	public:
+		Pattern(const std::string &pattern, uint8_t flags) :
+			m_pattern(pattern), m_flags(flags)
+		{
+		}
+
+		std::string m_pattern;
+		uint8_t m_flags;
+	};
+
+	typedef std::vector<Pattern> PatternList_t;
+
+	PatternList_t m_patterns; // Until compile()
+	uint8_t m_charClass[256];
+	uint32_t m_nClasses;
+	std::vector<uint32_t> m_next; // State * classes + class -> state
+	std::vector<uint8_t> m_flags; // By state
+};
+
+/*
+ * Trie of paths, matching the paths which are directory prefixes of (or
+ * equal to) a path.
+ */
+class PathTrie
+{
+public:
+	PathTrie()
+	{
+		m_flags.push_back(0);
+	}
+
+	void addPath(const std::string &path, uint8_t flags)
+	{
+		uint32_t node = 0;
+
+		for (unsigned int i = 0; i < path.size(); i++) {
+			uint64_t key = edgeKey(node, path[i]);
+			EdgeMap_t::const_iterator it = m_edges.find(key);
+
+			if (it != m_edges.end()) {
+				node = it->second;
+				continue;
+			}
+
+			m_edges[key] = m_flags.size();
+			node = m_flags.size();
+			m_flags.push_back(0);
+		}
+		m_flags[node] |= flags;
+	}
+
+	// Get the flags of the paths matching path
+	uint8_t match(const std::string &path) const
+	{
+		uint8_t out = 0;
+		uint32_t node = 0;
+
+		for (unsigned int i = 0; ; i++) {
+			if (m_flags[node] && (i == path.size() || path[i] == '/'))
+				out |= m_flags[node];
+
+			if (i == path.size())
+				break;
+
+			EdgeMap_t::const_iterator it = m_edges.find(edgeKey(node, path[i]));
+
+			if (it == m_edges.end())
+				break;
+			node = it->second;
+		}
+
+		return out;
+	}
+
+private:
+	uint64_t edgeKey(uint32_t node, char c) const
+	{
+		return ((uint64_t)node << 8) | (uint8_t)c;
+	}
+
+	typedef std::unordered_map<uint64_t, uint32_t> EdgeMap_t;
+
+	EdgeMap_t m_edges;
+	std::vector<uint8_t> m_flags; // By node
+};
+
 class BasicFilter : public IFilter
 {
 public:
@@ -40,6 +244,11 @@ public:
 		return path;
 	}
 
+	virtual std::string getSignature()
+	{
+		return "";
+	}
+
 protected:
 	class FileLineHandler
 	{
@@ -203,125 +412,128 @@ public:
 		return filename;
 	}
 
+	std::string getSignature()
+	{
+		if (!m_pathHandler->isSetup() && !m_patternHandler->isSetup() &&
+				(m_origRoot.empty() || m_newRoot.empty()))
+			return "";
+
+		IConfiguration &conf = IConfiguration::getInstance();
+		const char *keys[] = {"include-pattern", "exclude-pattern", "include-path", "exclude-path"};
+		std::string all;
+
+		for (unsigned int i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+			const std::vector<std::string> &values = conf.keyAsList(keys[i]);
+
+			all += std::string(keys[i]) + '\0';
+			for (std::vector<std::string>::const_iterator it = values.begin();
+					it != values.end();
+					++it)
+				all += get_real_path(*it) + '\0';
+		}
+		all += m_origRoot + '\0' + m_newRoot;
+
+		return fmt("%08x", hash_block(all.data(), all.size()));
+	}
+
 private:
 	class PatternHandler
 	{
 	public:
-		PatternHandler() :
-			m_includePatterns(IConfiguration::getInstance().keyAsList("include-pattern")),
-			m_excludePatterns(IConfiguration::getInstance().keyAsList("exclude-pattern"))
+		PatternHandler()
 		{
+			const PatternMap_t &includePatterns = IConfiguration::getInstance().keyAsList("include-pattern");
+			const PatternMap_t &excludePatterns = IConfiguration::getInstance().keyAsList("exclude-pattern");
+
+			for (PatternMap_t::const_iterator it = includePatterns.begin();
+					it != includePatterns.end();
+					++it)
+				m_matcher.addPattern(*it, MATCH_INCLUDE);
+
+			for (PatternMap_t::const_iterator it = excludePatterns.begin();
+					it != excludePatterns.end();
+					++it)
+				m_matcher.addPattern(*it, MATCH_EXCLUDE);
+
+			m_matcher.compile();
+
+			m_haveIncludes = includePatterns.size() != 0;
+			m_haveExcludes = excludePatterns.size() != 0;
 		}
 
 		bool isSetup()
 		{
-			return !(m_includePatterns.size() == 0 && m_excludePatterns.size() == 0);
+			return m_haveIncludes || m_haveExcludes;
 		}
 
-		bool includeFile(std::string file)
+		bool includeFile(const std::string &file)
 		{
-			if (m_includePatterns.size() == 0 && m_excludePatterns.size() == 0)
+			if (!m_haveIncludes && !m_haveExcludes)
 				return true;
 
-			bool out = true;
-
-			if (m_includePatterns.size() != 0)
-				out = false;
-
-			for (PatternMap_t::const_iterator it = m_includePatterns.begin();
-					it != m_includePatterns.end();
-					++it) {
-				const std::string &pattern = *it;
+			// Excluded by any pattern, included by any if there are includes
+			uint8_t flags = m_matcher.match(file, MATCH_EXCLUDE);
 
-				if (file.find(pattern) != std::string::npos)
-					out = true;
-			}
-
-			for (PatternMap_t::const_iterator it = m_excludePatterns.begin();
-					it != m_excludePatterns.end();
-					++it) {
-				const std::string &pattern = *it;
+			if (flags & MATCH_EXCLUDE)
+				return false;
 
-				if (file.find(pattern) != std::string::npos)
-					out = false;
-			}
-
-			return out;
+			return !m_haveIncludes || (flags & MATCH_INCLUDE);
 		}
 	private:
 		typedef std::vector<std::string> PatternMap_t;
 
-		const PatternMap_t &m_includePatterns;
-		const PatternMap_t &m_excludePatterns;
+		PatternMatcher m_matcher;
+		bool m_haveIncludes;
+		bool m_haveExcludes;
 	};
 
 
 	class PathHandler
 	{
 	public:
-		PathHandler() :
-			m_includePaths(IConfiguration::getInstance().keyAsList("include-path")),
-			m_excludePaths(IConfiguration::getInstance().keyAsList("exclude-path"))
+		PathHandler()
 		{
-			for (PathMap_t::iterator it = m_includePaths.begin();
-					it != m_includePaths.end();
+			const PathMap_t &includePaths = IConfiguration::getInstance().keyAsList("include-path");
+			const PathMap_t &excludePaths = IConfiguration::getInstance().keyAsList("exclude-path");
+
+			for (PathMap_t::const_iterator it = includePaths.begin();
+					it != includePaths.end();
 					++it)
-				*it = get_real_path(*it);
+				m_paths.addPath(get_real_path(*it), MATCH_INCLUDE);
 
-			for (PathMap_t::iterator it = m_excludePaths.begin();
-					it != m_excludePaths.end();
+			for (PathMap_t::const_iterator it = excludePaths.begin();
+					it != excludePaths.end();
 					++it)
-				*it = get_real_path(*it);
+				m_paths.addPath(get_real_path(*it), MATCH_EXCLUDE);
+
+			m_haveIncludes = includePaths.size() != 0;
+			m_haveExcludes = excludePaths.size() != 0;
 		}
 
 		bool isSetup()
 		{
-			return !(m_includePaths.size() == 0 && m_excludePaths.size() == 0);
+			return m_haveIncludes || m_haveExcludes;
 		}
 
 		bool includeFile(const std::string &file)
 		{
-			if (m_includePaths.size() == 0 && m_excludePaths.size() == 0)
+			if (!m_haveIncludes && !m_haveExcludes)
 				return true;
 
-			bool out = true;
-
-			if (m_includePaths.size() != 0)
-				out = false;
-
-			const std::string pathStr = get_real_path(file);
+			// In --include-path= (if any), unless it's also in --exclude-path=
+			uint8_t flags = m_paths.match(get_real_path(file));
 
-			// If found in --include-path=, accept this path
-			for (PathMap_t::const_iterator it = m_includePaths.begin();
-					it != m_includePaths.end();
-					++it) {
-				const std::string &pathPattern = *it;
-				size_t last = pathPattern.size();
+			if (flags & MATCH_EXCLUDE)
+				return false;
 
-				if (pathStr.find(pathPattern) == 0 &&
-						(pathStr.size() <= last || pathStr[last] == '/'))
-					out = true;
-			}
-
-			// ... unless it's found in --exclude-path=.
-			for (PathMap_t::const_iterator it = m_excludePaths.begin();
-					it != m_excludePaths.end();
-					++it) {
-				const std::string &pathPattern = *it;
-				size_t last = pathPattern.size();
-
-				if (pathStr.find(pathPattern) == 0 &&
-						(pathStr.size() <= last || pathStr[last] == '/'))
-					out = false;
-			}
-
-			return out;
+			return !m_haveIncludes || (flags & MATCH_INCLUDE);
 		}
 	private:
 		typedef std::vector<std::string> PathMap_t;
 
-		PathMap_t m_includePaths;
-		PathMap_t m_excludePaths;
+		PathTrie m_paths;
+		bool m_haveIncludes;
+		bool m_haveExcludes;
 	};
 
 
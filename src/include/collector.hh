@@ -24,6 +24,30 @@ namespace kcov
 			 * @param hits the number of hits for the address
 			 */
 			virtual void onAddressHit(uint64_t addr, unsigned long hits) = 0;
+
+			/**
+			 * Called when a breakpoint is set, after the line listeners
+			 * have seen the address.
+			 *
+			 * @param id the dense breakpoint ID from the engine
+			 * @param addr the address of the breakpoint
+			 */
+			virtual void onBreakpoint(unsigned int id, uint64_t addr)
+			{
+			}
+
+			/**
+			 * Called when a breakpoint with an ID is hit. Same as
+			 * onAddressHit, but the ID can be used for array lookups.
+			 *
+			 * @param id the ID passed to onBreakpoint
+			 * @param addr the address which just got executed
+			 * @param hits the number of hits for the address
+			 */
+			virtual void onBreakpointHit(unsigned int id, uint64_t addr, unsigned long hits)
+			{
+				onAddressHit(addr, hits);
+			}
 		};
 
 		class IEventTickListener
@@ -28,6 +28,32 @@ namespace kcov
 		 */
 		virtual void addSection(const void *sectionData, size_t sectionSize, uint64_t baseAddress) = 0;
 
+		/**
+		 * Add a read-only data section, which is searched for jump tables
+		 *
+		 * @param sectionData the data of the section
+		 * @param sectionSize the size of the section
+		 * @param base address the virtual start address
+		 */
+		virtual void addDataSection(const void *sectionData, size_t sectionSize, uint64_t baseAddress) = 0;
+
+		/**
+		 * Add an address which the code is entered at from elsewhere, e.g.,
+		 * an exception landing pad.
+		 *
+		 * @param address the virtual address
+		 */
+		virtual void addEntryPoint(uint64_t address) = 0;
+
+		/**
+		 * Check if an address can be entered without passing the first
+		 * instruction of its basic block, i.e., through a jump table or
+		 * as an exception landing pad.
+		 *
+		 * @return true if the address is such an entry point
+		 */
+		virtual bool isEntryPoint(uint64_t address) = 0;
+
 		/**
 		 * Check if an address is a valid breakpoint "point".
 		 *
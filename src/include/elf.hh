@@ -15,8 +15,8 @@ namespace kcov
 	class Segment
 	{
 	public:
-		Segment(const void *data, uint64_t paddr, uint64_t vaddr, uint64_t size) :
-			m_data(NULL), m_paddr(paddr), m_vaddr(vaddr), m_size(size)
+		Segment(const void *data, uint64_t paddr, uint64_t vaddr, uint64_t size, uint64_t fileOffset = 0) :
+			m_data(NULL), m_paddr(paddr), m_vaddr(vaddr), m_size(size), m_fileOffset(fileOffset)
 		{
 			if (data) {
 				m_data = xmalloc(size);
@@ -25,7 +25,8 @@ namespace kcov
 		}
 
 		Segment(const Segment &other) :
-			m_data(NULL), m_paddr(other.m_paddr), m_vaddr(other.m_vaddr), m_size(other.m_size)
+			m_data(NULL), m_paddr(other.m_paddr), m_vaddr(other.m_vaddr), m_size(other.m_size),
+			m_fileOffset(other.m_fileOffset)
 		{
 			if (other.m_data) {
 				m_data = xmalloc(other.m_size);
@@ -80,6 +81,12 @@ namespace kcov
 			return m_size;
 		}
 
+		// Where the data starts in the file
+		uint64_t getFileOffset() const
+		{
+			return m_fileOffset;
+		}
+
 	private:
 		void *m_data;
 
@@ -87,6 +94,7 @@ namespace kcov
 		uint64_t m_paddr;
 		uint64_t m_vaddr;
 		size_t m_size;
+		uint64_t m_fileOffset;
 	};
 
 
@@ -112,6 +120,20 @@ namespace kcov
 
 		virtual const std::vector<Segment> &getSegments() = 0;
 
+		/**
+		 * Return the read-only data sections, which can hold jump tables.
+		 * Only collected with --basic-blocks.
+		 */
+		virtual const std::vector<Segment> &getDataSegments() = 0;
+
+		/**
+		 * Return the exception landing pads, from the .eh_frame and
+		 * .gcc_except_table sections. Only collected with --basic-blocks.
+		 *
+		 * @return the (unrelocated) landing pad addresses
+		 */
+		virtual const std::vector<uint64_t> &getLandingPads() = 0;
+
 		virtual void *getRawData(size_t &sz) = 0;
 
 		static IElf *create(const std::string &filename);
@@ -39,7 +39,7 @@ namespace kcov
 
 			enum event_type type;
 
-			int data; // Typically the breakpoint
+			int data; // The breakpoint ID for ev_breakpoint (or -1), otherwise e.g., the signal
 			uint64_t addr;
 		};
 
@@ -57,7 +57,10 @@ namespace kcov
 		 *
 		 * @param addr the address to set the breakpoint on
 		 *
-		 * @return the ID of the breakpoint, or -1 on failure
+		 * @return the ID of the breakpoint, or -1 on failure or if the engine
+		 * doesn't number breakpoints. IDs are dense (0, 1, 2, ... in the order
+		 * the addresses are registered, the same ID for the same address), and
+		 * passed in the data of ev_breakpoint events.
 		 */
 		virtual int registerBreakpoint(unsigned long addr) = 0;
 
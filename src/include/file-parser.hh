@@ -61,6 +61,21 @@ namespace kcov
 		public:
 			virtual void onLine(const std::string &file, unsigned int lineNr,
 					uint64_t addr) = 0;
+
+			/**
+			 * Same as onLine, from parsers which give each file a dense ID
+			 * for array lookups. All lines of a file have the same ID.
+			 *
+			 * @param file the source file
+			 * @param fileId the ID of @a file
+			 * @param lineNr the line number in @a file
+			 * @param addr the address of the line
+			 */
+			virtual void onFileLine(const std::string &file, unsigned int fileId,
+					unsigned int lineNr, uint64_t addr)
+			{
+				onLine(file, lineNr, addr);
+			}
 		};
 
 		/**
@@ -130,6 +145,36 @@ namespace kcov
 		 */
 		virtual uint64_t getChecksum() = 0;
 
+		/**
+		 * Read the original file contents of loaded code, i.e., what the
+		 * instructions look like before any breakpoints are written.
+		 *
+		 * @param addr the (relocated) address to read from
+		 * @param dst the buffer to read into
+		 * @param size the number of bytes to read
+		 *
+		 * @return true if the whole range could be read from the file
+		 */
+		virtual bool getOriginalData(uint64_t addr, void *dst, size_t size)
+		{
+			return false;
+		}
+
+		/**
+		 * Get the file and the offset in it of loaded code, e.g., for
+		 * probes placed by the kernel.
+		 *
+		 * @param addr the (relocated) address to lookup
+		 * @param file the file the address is in
+		 * @param offset the offset in @a file
+		 *
+		 * @return true if the address is in a loaded file
+		 */
+		virtual bool getFileOffset(uint64_t addr, std::string &file, uint64_t &offset)
+		{
+			return false;
+		}
+
 		/**
 		 * Get the name of the parser
 		 *
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <string>
+#include <vector>
+
+#include <stdint.h>
 
 namespace kcov
 {
@@ -48,6 +51,14 @@ namespace kcov
 		 */
 		virtual std::string mangleSourcePath(const std::string &path) = 0;
 
+		/**
+		 * Identify the file filters, e.g., to key caches of filtered data.
+		 *
+		 * @return a string which changes with the filter settings, empty if
+		 * all files are included
+		 */
+		virtual std::string getSignature() = 0;
+
 		static IFilter &create();
 
 		static IFilter &createBasic();
@@ -55,4 +66,39 @@ namespace kcov
 
 		virtual ~IFilter() {}
 	};
+
+	/**
+	 * Filter results by dense file ID (see IFileParser::ILineListener::onFileLine),
+	 * so that the filters run once per file instead of once per line.
+	 */
+	class FilterCache
+	{
+	public:
+		FilterCache(IFilter &filter) :
+			m_filter(filter)
+		{
+		}
+
+		bool runFilters(unsigned int fileId, const std::string &path)
+		{
+			if (fileId >= m_included.size())
+				m_included.resize(fileId + 1, UNKNOWN);
+
+			if (m_included[fileId] == UNKNOWN)
+				m_included[fileId] = m_filter.runFilters(path) ? INCLUDED : EXCLUDED;
+
+			return m_included[fileId] == INCLUDED;
+		}
+
+	private:
+		enum State
+		{
+			UNKNOWN = 0,
+			INCLUDED = 1,
+			EXCLUDED = 2,
+		};
+
+		IFilter &m_filter;
+		std::vector<uint8_t> m_included;
+	};
 }
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define INPROCESS_DATA_MAGIC   0x6b636970 /* "kcip" */
+#define INPROCESS_DATA_VERSION 2
+
+/*
+ * Breakpoints handled inside the covered program (--in-process). The data
+ * is a file in the output directory, mapped by kcov and the programs: kcov
+ * adds breakpoints, the preloaded library installs them, handles the
+ * SIGTRAP:s and marks the hits.
+ *
+ * Layout: The header, then n_slots addresses (an open-addressing hash table
+ * where 0 is a free slot, so entries never move), n_slots uint32_t slot
+ * numbers in the order the breakpoints were added, and a bitmap of hit slots.
+ *
+ * kcov sleeps on a FIFO (KCOV_INPROCESS_WAKE): With waiting set, the next
+ * hit clears it and writes a byte there.
+ */
+struct inprocess_data
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_slots;       // A power of two
+	uint32_t n_entries;     // Published breakpoints (kcov)
+	uint32_t requests;      // Solib reports written by the programs
+	uint32_t acks;          // Reports with published breakpoints (kcov)
+	uint32_t has_relocation;
+	uint32_t waiting;       // kcov is (about to be) blocked on the FIFO
+	uint64_t relocation;    // Of the first instance of the program
+	uint64_t hits;          // Total number of hits, to avoid idle bitmap scans
+	char executable[1024];  // The covered program
+};
+
+static inline uint64_t *inprocess_data_entries(struct inprocess_data *p)
+{
+	return (uint64_t *)(p + 1);
+}
+
+static inline uint32_t *inprocess_data_order(struct inprocess_data *p)
+{
+	return (uint32_t *)(inprocess_data_entries(p) + p->n_slots);
+}
+
+static inline uint64_t *inprocess_data_hits(struct inprocess_data *p)
+{
+	return (uint64_t *)(inprocess_data_order(p) + p->n_slots);
+}
+
+static inline size_t inprocess_data_size(uint32_t n_slots)
+{
+	return sizeof(struct inprocess_data) +
+			n_slots * (sizeof(uint64_t) + sizeof(uint32_t)) +
+			n_slots / 8;
+}
+
+// Where the probe for @a addr starts
+static inline uint32_t inprocess_data_hash(struct inprocess_data *p, uint64_t addr)
+{
+	return (uint32_t)((addr * 0x9e3779b97f4a7c15ULL) >> 32) & (p->n_slots - 1);
+}
+
+#ifdef __cplusplus
+}
+#endif
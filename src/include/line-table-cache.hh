@@ -0,0 +1,84 @@
+#pragma once
+
+#include <file-parser.hh>
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+
+namespace kcov
+{
+	/**
+	 * Cache of the lines the DWARF parser reports for a file, so that the
+	 * debug info needn't be parsed again. Kept in memory by kcov --server.
+	 */
+	class ILineTableCache
+	{
+	public:
+		virtual ~ILineTableCache()
+		{
+		}
+
+		/**
+		 * Get the key for the lines of a file: The file itself (by inode,
+		 * size and mtime), its build-id and how it's parsed.
+		 *
+		 * @param filename the ELF file
+		 * @param buildId the build-id of @a filename, possibly empty
+		 * @param mode what's reported, e.g., "line" or "function", and the
+		 * filter signature if the tables only have the included files
+		 *
+		 * @return the key, empty if the file can't be found
+		 */
+		virtual std::string getKey(const std::string &filename, const std::string &buildId,
+				const std::string &mode) = 0;
+
+		/**
+		 * Report the cached lines for a key to a listener
+		 *
+		 * @return true if the lines were cached
+		 */
+		virtual bool replay(const std::string &key, IFileParser::ILineListener &listener) = 0;
+
+		/**
+		 * Get a listener which records lines for a key, and passes them on
+		 *
+		 * @param key the key to store the lines for
+		 * @param listener the listener to pass the lines on to
+		 *
+		 * @return the recording listener, or NULL if the cache isn't enabled.
+		 * Call done() on it when the file is parsed.
+		 */
+		virtual IFileParser::ILineListener *record(const std::string &key,
+				IFileParser::ILineListener &listener) = 0;
+
+		/**
+		 * Add the lines recorded by a listener from record() to the cache
+		 * and delete it.
+		 */
+		virtual void done(IFileParser::ILineListener *recorder) = 0;
+
+		/**
+		 * Enable recording of parsed files (nothing is recorded by default)
+		 */
+		virtual void enable() = 0;
+
+		/**
+		 * Serialize the tables added since the last call
+		 *
+		 * @param size the size of the returned data
+		 *
+		 * @return the data, free:d by the caller
+		 */
+		virtual void *marshal(size_t *size) = 0;
+
+		/**
+		 * Add tables from marshal(), e.g., from another process
+		 *
+		 * @return true if the data was valid
+		 */
+		virtual bool unmarshal(const void *data, size_t size) = 0;
+
+		static ILineTableCache &getInstance();
+	};
+}
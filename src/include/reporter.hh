@@ -63,6 +63,19 @@ namespace kcov
 			 */
 			virtual void onAddress(uint64_t addr, unsigned long hits) = 0;
 
+			/**
+			 * Same as onAddress, with the index of the line from
+			 * onLineReporter for array lookups.
+			 *
+			 * @param index the index of the line
+			 * @param addr the executed (hashed) address
+			 * @param hits the number of hits of the address
+			 */
+			virtual void onLineHit(unsigned int index, uint64_t addr, unsigned long hits)
+			{
+				onAddress(addr, hits);
+			}
+
 			/**
 			 * Re-report on-lines from the file-parser.
 			 *
@@ -70,10 +83,13 @@ namespace kcov
 			 * onAddress above.
 			 *
 			 * @param file the source file
+			 * @param fileId dense index of @a file
 			 * @param lineNr the line number in @a file
 			 * @param addr the (hashed) address for this file/line combination
+			 * @param index dense index of the file/line combination
 			 */
-			virtual void onLineReporter(const std::string &file, unsigned int lineNr, uint64_t addr) {}
+			virtual void onLineReporter(const std::string &file, unsigned int fileId,
+					unsigned int lineNr, uint64_t addr, unsigned int index) {}
 		};
 
 		virtual ~IReporter() {}
@@ -124,6 +140,26 @@ namespace kcov
 
 		virtual void writeCoverageDatabase() = 0;
 
+		/**
+		 * Copy the coverage data to the snapshot returned by getSnapshot().
+		 *
+		 * Called in the collector thread when no writer is running.
+		 */
+		virtual void takeSnapshot()
+		{
+		}
+
+		/**
+		 * Get a reporter which answers queries from the last snapshot, for
+		 * writers producing output in another thread.
+		 *
+		 * @return the snapshot reporter
+		 */
+		virtual IReporter &getSnapshot()
+		{
+			return *this;
+		}
+
 		static IReporter &create(IFileParser &elf, ICollector &collector, IFilter &filter);
 		static IReporter &createDummyReporter();
 	};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+
+namespace kcov
+{
+	/**
+	 * kcov --server: Runs kcov for clients (kcov with KCOV_SERVER set) in
+	 * forks of itself, and keeps what the runs have parsed (line tables,
+	 * source files) in memory for the next runs.
+	 */
+	class IServer
+	{
+	public:
+		virtual ~IServer()
+		{
+		}
+
+		/**
+		 * Serve requests until killed. Returns in the forks running the
+		 * requests, with the arguments, environment, working directory and
+		 * stdio of the client setup.
+		 *
+		 * @param argc the argc of the request
+		 * @param argv the argv of the request
+		 *
+		 * @return true in a fork, false if the server can't be started
+		 */
+		virtual bool run(int &argc, const char **&argv) = 0;
+
+		/**
+		 * Report the exit code to the client and what was parsed back to
+		 * the server (called in the fork when the request is done)
+		 *
+		 * @param exitCode the kcov exit code
+		 */
+		virtual void done(int exitCode) = 0;
+
+		static IServer &create(const std::string &socketPath);
+	};
+
+	/**
+	 * Let a kcov server run kcov
+	 *
+	 * @param socketPath the socket of the server
+	 * @param argc the kcov argc
+	 * @param argv the kcov argv
+	 * @param exitCode the kcov exit code if run by the server
+	 *
+	 * @return true if the server ran kcov, false if there's no server
+	 */
+	bool runThroughServer(const std::string &socketPath, int argc, const char *argv[], int &exitCode);
+}
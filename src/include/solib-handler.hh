@@ -19,4 +19,10 @@ namespace kcov
 
 	// Wait for the solib thread to finish parsing the solib data
 	void blockUntilSolibDataRead();
+
+	// Is there solib data which hasn't been parsed yet?
+	bool solibDataPending();
+
+	// The number of solib reports which have been parsed
+	unsigned int solibReportsParsed();
 }
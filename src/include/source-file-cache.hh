@@ -33,6 +33,17 @@ namespace kcov
 
 		virtual bool fileExists(const std::string &filePath) = 0;
 
+		/**
+		 * Check the cached files against the disk on their next lookup,
+		 * e.g., in a new run forked from a kcov --server
+		 */
+		virtual void revalidate() = 0;
+
+		/**
+		 * Get the paths of the cached (existing) files
+		 */
+		virtual std::vector<std::string> getFiles() = 0;
+
 		static ISourceFileCache &getInstance();
 	};
 }
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+
+namespace kcov
+{
+	/**
+	 * Pool of worker threads (one per CPU) for independent tasks, e.g., the
+	 * writers producing output.
+	 */
+	class IThreadPool
+	{
+	public:
+		class ITask
+		{
+		public:
+			virtual ~ITask()
+			{
+			}
+
+			/**
+			 * Do the work, in any thread
+			 */
+			virtual void run() = 0;
+		};
+
+		virtual ~IThreadPool()
+		{
+		}
+
+		/**
+		 * Run tasks in parallel and wait until all are done.
+		 *
+		 * The calling thread runs tasks as well while waiting, so tasks can
+		 * themselves call run() with more tasks.
+		 *
+		 * @param tasks the tasks to run
+		 */
+		virtual void run(const std::vector<ITask *> &tasks) = 0;
+
+		/**
+		 * Get the number of threads run() uses, including the caller
+		 */
+		virtual unsigned int getThreadCount() = 0;
+
+		static IThreadPool &getInstance();
+	};
+}
@@ -146,6 +146,12 @@ std::string trim_string(const std::string &strIn, const std::string &trimEndChar
 
 const std::string &get_real_path(const std::string &path);
 
+/**
+ * Forget cached file_exists() results and re-resolve cached real paths,
+ * e.g., in a new run forked from a kcov --server.
+ */
+void revalidate_file_caches();
+
 bool string_is_integer(const std::string &str, unsigned base = 0);
 
 int64_t string_to_integer(const std::string &str, unsigned base = 0);
@@ -23,11 +23,26 @@ namespace kcov
 		 */
 		virtual void onStop() = 0;
 
+		/**
+		 * Take over the data write() needs from the collector thread.
+		 *
+		 * Called in the collector thread before write(), when no write()
+		 * is running.
+		 */
+		virtual void onSnapshot() = 0;
+
 		/**
 		 * Write current data.
 		 *
-		 * Called in regular intervals during execution.
+		 * Called in regular intervals during execution, possibly in a
+		 * separate output thread and in parallel with the other writers.
 		 */
 		virtual void write() = 0;
+
+		/**
+		 * Called after all writers have written, for output which uses
+		 * what the others wrote (e.g., summaries).
+		 */
+		virtual void onWritten() = 0;
 	};
 }
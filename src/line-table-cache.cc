@@ -0,0 +1,456 @@
+#include <line-table-cache.hh>
+#include <configuration.hh>
+#include <utils.hh>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unordered_map>
+
+using namespace kcov;
+
+#define LINE_TABLE_MAGIC   0x6b636c74 /* "kclt" */
+#define LINE_TABLE_VERSION 1
+#define LINE_TABLE_FILE_VERSION 1
+
+class LineTableCache : public ILineTableCache
+{
+public:
+	LineTableCache() :
+		m_enabled(false)
+	{
+	}
+
+	std::string getKey(const std::string &filename, const std::string &buildId,
+			const std::string &mode)
+	{
+		struct stat st;
+
+		if (stat(filename.c_str(), &st) < 0)
+			return "";
+
+		return fmt("%s:%s:%s:%llx:%llx:%llx:%llx.%09lu",
+				mode.c_str(), buildId.c_str(), filename.c_str(),
+				(unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+				(unsigned long long)st.st_size,
+				(unsigned long long)st.st_mtim.tv_sec, (unsigned long)st.st_mtim.tv_nsec);
+	}
+
+	bool replay(const std::string &key, IFileParser::ILineListener &listener)
+	{
+		TableMap_t::const_iterator it = m_tables.find(key);
+
+		if (it == m_tables.end())
+			return replayFile(key, listener);
+
+		const LineTable *table = it->second;
+
+		for (std::vector<Entry>::const_iterator eit = table->m_entries.begin();
+				eit != table->m_entries.end();
+				++eit)
+			listener.onLine(table->m_files[eit->m_file], eit->m_line, eit->m_addr);
+
+		return true;
+	}
+
+	IFileParser::ILineListener *record(const std::string &key, IFileParser::ILineListener &listener)
+	{
+		if (key == "" || (!m_enabled && getFileName(key) == ""))
+			return NULL;
+
+		return new Recorder(key, listener);
+	}
+
+	void done(IFileParser::ILineListener *p)
+	{
+		Recorder *recorder = (Recorder *)p;
+
+		writeFile(recorder->m_key, *recorder->m_table);
+
+		if (m_enabled && m_tables.find(recorder->m_key) == m_tables.end()) {
+			m_tables[recorder->m_key] = recorder->m_table;
+			m_added.push_back(recorder->m_key);
+			recorder->m_table = NULL;
+		}
+
+		delete recorder;
+	}
+
+	void enable()
+	{
+		m_enabled = true;
+	}
+
+	void *marshal(size_t *size)
+	{
+		std::string out;
+
+		put32(out, LINE_TABLE_MAGIC);
+		put32(out, LINE_TABLE_VERSION);
+
+		for (std::vector<std::string>::const_iterator it = m_added.begin();
+				it != m_added.end();
+				++it) {
+			const LineTable *table = m_tables[*it];
+
+			putString(out, *it);
+			put32(out, table->m_files.size());
+			for (std::vector<std::string>::const_iterator fit = table->m_files.begin();
+					fit != table->m_files.end();
+					++fit)
+				putString(out, *fit);
+
+			put32(out, table->m_entries.size());
+			out.append((const char *)table->m_entries.data(), table->m_entries.size() * sizeof(Entry));
+		}
+		m_added.clear();
+
+		void *p = xmalloc(out.size());
+		memcpy(p, out.data(), out.size());
+		*size = out.size();
+
+		return p;
+	}
+
+	bool unmarshal(const void *data, size_t size)
+	{
+		Reader r((const uint8_t *)data, size);
+
+		if (r.get32() != LINE_TABLE_MAGIC || r.get32() != LINE_TABLE_VERSION)
+			return false;
+
+		while (r.left() > 0) {
+			std::string key = r.getString();
+			LineTable *table = new LineTable();
+
+			uint32_t nFiles = r.get32();
+			for (uint32_t i = 0; i < nFiles && r.ok(); i++)
+				table->m_files.push_back(r.getString());
+
+			uint32_t nEntries = r.get32();
+			const uint8_t *entries = r.get((size_t)nEntries * sizeof(Entry));
+
+			if (!r.ok()) {
+				delete table;
+
+				return false;
+			}
+			table->m_entries.resize(nEntries);
+			memcpy(table->m_entries.data(), entries, (size_t)nEntries * sizeof(Entry));
+
+			// Validate, since the file indices are used without checks
+			for (uint32_t i = 0; i < nEntries; i++) {
+				if (table->m_entries[i].m_file >= nFiles) {
+					delete table;
+
+					return false;
+				}
+			}
+
+			if (m_tables.find(key) != m_tables.end()) {
+				delete table;
+				continue;
+			}
+			m_tables[key] = table;
+		}
+
+		return true;
+	}
+
+private:
+	struct Entry
+	{
+		uint32_t m_file;
+		uint32_t m_line;
+		uint64_t m_addr;
+	};
+
+	/*
+	 * Table in the --line-cache directory, mmap:ed when read. Followed by
+	 * the entries, the offsets of the file names and the NUL-terminated
+	 * file names.
+	 */
+	struct fileHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t nFiles;
+		uint32_t nEntries;
+	};
+
+	class LineTable
+	{
+	public:
+		std::vector<std::string> m_files; // Interned, by index
+		std::vector<Entry> m_entries; // In the order they were reported
+	};
+
+	class Recorder : public IFileParser::ILineListener
+	{
+	public:
+		Recorder(const std::string &key, IFileParser::ILineListener &listener) :
+			m_key(key), m_listener(listener), m_table(new LineTable())
+		{
+		}
+
+		virtual ~Recorder()
+		{
+			delete m_table;
+		}
+
+		void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
+		{
+			std::unordered_map<std::string, uint32_t>::const_iterator it = m_fileIndex.find(file);
+			uint32_t idx;
+
+			if (it == m_fileIndex.end()) {
+				idx = m_table->m_files.size();
+				m_table->m_files.push_back(file);
+				m_fileIndex[file] = idx;
+			} else {
+				idx = it->second;
+			}
+
+			Entry entry = {idx, lineNr, addr};
+			m_table->m_entries.push_back(entry);
+
+			m_listener.onLine(file, lineNr, addr);
+		}
+
+		std::string m_key;
+		IFileParser::ILineListener &m_listener;
+		LineTable *m_table;
+		std::unordered_map<std::string, uint32_t> m_fileIndex;
+	};
+
+	// Bounds-checked reads from marshalled data
+	class Reader
+	{
+	public:
+		Reader(const uint8_t *p, size_t size) :
+			m_p(p), m_left(size), m_ok(true)
+		{
+		}
+
+		const uint8_t *get(size_t size)
+		{
+			if (size > m_left) {
+				m_ok = false;
+				m_left = 0;
+
+				return NULL;
+			}
+
+			const uint8_t *out = m_p;
+
+			m_p += size;
+			m_left -= size;
+
+			return out;
+		}
+
+		uint32_t get32()
+		{
+			uint32_t out = 0;
+			const uint8_t *p = get(sizeof(out));
+
+			if (p)
+				memcpy(&out, p, sizeof(out));
+
+			return out;
+		}
+
+		std::string getString()
+		{
+			uint32_t len = get32();
+			const uint8_t *p = get(len);
+
+			if (!p)
+				return "";
+
+			return std::string((const char *)p, len);
+		}
+
+		size_t left() const
+		{
+			return m_left;
+		}
+
+		bool ok() const
+		{
+			return m_ok;
+		}
+
+	private:
+		const uint8_t *m_p;
+		size_t m_left;
+		bool m_ok;
+	};
+
+	// One table per build-id in the --line-cache directory, if given
+	std::string getFileName(const std::string &key)
+	{
+		const std::string &dir = IConfiguration::getInstance().keyAsString("line-cache");
+
+		if (dir == "")
+			return "";
+
+		// The key is mode:buildId:...
+		size_t modeEnd = key.find(':');
+		size_t buildIdEnd = key.find(':', modeEnd + 1);
+
+		if (modeEnd == std::string::npos || buildIdEnd == std::string::npos ||
+				buildIdEnd == modeEnd + 1)
+			return "";
+
+		return fmt("%s/%s.%s", dir.c_str(),
+				key.substr(modeEnd + 1, buildIdEnd - modeEnd - 1).c_str(),
+				key.substr(0, modeEnd).c_str());
+	}
+
+	bool replayFile(const std::string &key, IFileParser::ILineListener &listener)
+	{
+		std::string name = getFileName(key);
+
+		if (name == "")
+			return false;
+
+		int fd = open(name.c_str(), O_RDONLY);
+		struct stat st;
+
+		if (fd < 0)
+			return false;
+
+		if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct fileHeader)) {
+			close(fd);
+			return false;
+		}
+
+		void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		close(fd);
+		if (data == MAP_FAILED)
+			return false;
+
+		bool out = replayFileData((const uint8_t *)data, st.st_size, listener);
+
+		if (!out)
+			kcov_debug(ELF_MSG, "Invalid line table %s\n", name.c_str());
+
+		munmap(data, st.st_size);
+
+		return out;
+	}
+
+	bool replayFileData(const uint8_t *data, size_t size, IFileParser::ILineListener &listener)
+	{
+		const struct fileHeader *hdr = (const struct fileHeader *)data;
+
+		if (hdr->magic != LINE_TABLE_MAGIC || hdr->version != LINE_TABLE_FILE_VERSION)
+			return false;
+
+		size_t entriesSize = (size_t)hdr->nEntries * sizeof(Entry);
+		size_t offsetsSize = (size_t)hdr->nFiles * sizeof(uint32_t);
+
+		if (size - sizeof(*hdr) < entriesSize + offsetsSize)
+			return false;
+
+		const Entry *entries = (const Entry *)(data + sizeof(*hdr));
+		const uint32_t *offsets = (const uint32_t *)(data + sizeof(*hdr) + entriesSize);
+		const char *names = (const char *)(offsets + hdr->nFiles);
+		size_t namesSize = size - sizeof(*hdr) - entriesSize - offsetsSize;
+
+		// Validate everything before reporting anything
+		if (namesSize > 0 && names[namesSize - 1] != '\0')
+			return false;
+
+		std::vector<std::string> files;
+
+		files.reserve(hdr->nFiles);
+		for (uint32_t i = 0; i < hdr->nFiles; i++) {
+			if (offsets[i] >= namesSize)
+				return false;
+			files.push_back(std::string(names + offsets[i]));
+		}
+
+		for (uint32_t i = 0; i < hdr->nEntries; i++) {
+			if (entries[i].m_file >= hdr->nFiles)
+				return false;
+		}
+
+		for (uint32_t i = 0; i < hdr->nEntries; i++)
+			listener.onLine(files[entries[i].m_file], entries[i].m_line, entries[i].m_addr);
+
+		return true;
+	}
+
+	void writeFile(const std::string &key, const LineTable &table)
+	{
+		std::string name = getFileName(key);
+
+		if (name == "")
+			return;
+
+		struct fileHeader hdr;
+		std::string out;
+		std::string names;
+
+		hdr.magic = LINE_TABLE_MAGIC;
+		hdr.version = LINE_TABLE_FILE_VERSION;
+		hdr.nFiles = table.m_files.size();
+		hdr.nEntries = table.m_entries.size();
+		out.append((const char *)&hdr, sizeof(hdr));
+		out.append((const char *)table.m_entries.data(), table.m_entries.size() * sizeof(Entry));
+
+		for (std::vector<std::string>::const_iterator it = table.m_files.begin();
+				it != table.m_files.end();
+				++it) {
+			put32(out, names.size());
+			names.append(it->c_str(), it->size() + 1);
+		}
+		out.append(names);
+
+		(void)mkdir(IConfiguration::getInstance().keyAsString("line-cache").c_str(), 0755);
+
+		// Other kcov instances might read or write the same table
+		std::string tmpName = fmt("%s.%d.tmp", name.c_str(), (int)getpid());
+
+		if (write_file(out.data(), out.size(), "%s", tmpName.c_str()) != 0 ||
+				rename(tmpName.c_str(), name.c_str()) != 0) {
+			kcov_debug(ELF_MSG, "Can't write line table %s\n", name.c_str());
+			unlink(tmpName.c_str());
+		}
+	}
+
+	static void put32(std::string &out, uint32_t v)
+	{
+		out.append((const char *)&v, sizeof(v));
+	}
+
+	static void putString(std::string &out, const std::string &s)
+	{
+		put32(out, s.size());
+		out.append(s);
+	}
+
+	typedef std::unordered_map<std::string, LineTable *> TableMap_t;
+
+	bool m_enabled;
+	TableMap_t m_tables;
+	std::vector<std::string> m_added; // Since the last marshal()
+};
+
+ILineTableCache &ILineTableCache::getInstance()
+{
+	static LineTableCache *g_instance;
+
+	if (!g_instance)
+		g_instance = new LineTableCache();
+
+	return *g_instance;
+}
@@ -7,6 +7,8 @@
 #include <output-handler.hh>
 #include <file-parser.hh>
 #include <solib-handler.hh>
+#include <capabilities.hh>
+#include <server.hh>
 #include <utils.hh>
 
 #include <string.h>
@@ -190,7 +192,7 @@ static int runMergeMode()
 	return 0;
 }
 
-int main(int argc, const char *argv[])
+static int runKcov(int argc, const char *argv[])
 {
 	IConfiguration &conf = IConfiguration::getInstance();
 
@@ -227,6 +229,14 @@ int main(int argc, const char *argv[])
 
 	parser->addFile(file);
 
+	// The fork server runs in the preloaded solib library
+	if (conf.keyAsString("fork-server") != "" &&
+			(conf.keyAsInt("attach-pid") || !conf.keyAsInt("parse-solibs") ||
+			 !ICapabilities::getInstance().hasCapability("handle-solibs"))) {
+		error("--fork-server needs the solib library (not with --skip-solibs or --pid)\n");
+		return 1;
+	}
+
 	// Register writers
 	if (runningMode != IConfiguration::MODE_COLLECT_ONLY) {
 		const std::string &base = output.getBaseDirectory();
@@ -258,8 +268,8 @@ int main(int argc, const char *argv[])
 
 		output.registerWriter(mergeParser);
 
-		// Multiple binaries? Register the merged mode stuff
-		if (countMetadata() > 0) {
+		// Multiple binaries (exec:ed ones are covered separately)? Register the merged mode stuff
+		if (countMetadata() > 0 || conf.keyAsInt("follow-exec")) {
 			output.registerWriter(mergeHtmlWriter);
 			output.registerWriter(mergeJsonWriter);
 			output.registerWriter(mergeCoberturaWriter);
@@ -304,3 +314,30 @@ int main(int argc, const char *argv[])
 
 	return ret;
 }
+
+int main(int argc, const char *argv[])
+{
+	bool isServer = argc == 2 && strncmp(argv[1], "--server=", strlen("--server=")) == 0;
+	const char *serverPath = getenv("KCOV_SERVER");
+	IServer *server = NULL;
+	int ret;
+
+	// Run by a kcov --server if there's one
+	if (serverPath && !isServer && runThroughServer(serverPath, argc, argv, ret))
+		return ret;
+
+	// Only returns in the forks running the requests
+	if (isServer) {
+		server = &IServer::create(argv[1] + strlen("--server="));
+
+		if (!server->run(argc, argv))
+			return 1;
+	}
+
+	ret = runKcov(argc, argv);
+
+	if (server)
+		server->done(ret);
+
+	return ret;
+}
@@ -67,7 +67,8 @@ public:
 			IFilter &filter) :
 		m_baseDirectory(baseDirectory),
 		m_outputDirectory(outputDirectory),
-		m_filter(filter)
+		m_filter(filter),
+		m_filterCache(filter)
 	{
 		reporter.registerListener(*this);
 	}
@@ -161,24 +162,50 @@ public:
 	}
 
 	// From IReporter::IListener
-	virtual void onLineReporter(const std::string &filename, unsigned int lineNr, uint64_t addr)
+	void onLineHit(unsigned int index, uint64_t addr, unsigned long hits)
 	{
-		if (!m_filter.runFilters(filename))
-		{
+		// Not from onLineReporter (yet)?
+		if (index >= m_linesByIndex.size() || !m_linesByIndex[index].m_hits) {
+			onAddress(addr, hits);
 			return;
 		}
 
-		// Nothing to do in that case
-		if (!file_exists(filename))
+		const LineEntry &entry = m_linesByIndex[index];
+
+		*entry.m_hits += hits;
+
+		for (CollectorListenerList_t::const_iterator it = m_collectorListeners.begin();
+				it != m_collectorListeners.end();
+				++it)
+			(*it)->onBreakpointHit(index, entry.m_addr, hits);
+	}
+
+	// From IReporter::IListener
+	virtual void onLineReporter(const std::string &filename, unsigned int fileId,
+			unsigned int lineNr, uint64_t addr, unsigned int index)
+	{
+		if (!m_filterCache.runFilters(fileId, filename))
+		{
 			return;
+		}
 
-		File *file;
+		File *file = fileId < m_filesByReporterId.size() ? m_filesByReporterId[fileId] : NULL;
 
-		file = m_files[filename];
 		if (!file) {
-			file = new File(filename);
+			// Nothing to do in that case
+			if (!file_exists(filename))
+				return;
 
-			m_files[filename] = file;
+			file = m_files[filename];
+			if (!file) {
+				file = new File(filename);
+
+				m_files[filename] = file;
+			}
+
+			if (fileId >= m_filesByReporterId.size())
+				m_filesByReporterId.resize(fileId + 1, NULL);
+			m_filesByReporterId[fileId] = file;
 		}
 
 
@@ -196,7 +223,17 @@ public:
 		for (LineListenerList_t::const_iterator it = m_lineListeners.begin();
 				it != m_lineListeners.end();
 				++it)
-			(*it)->onLine(filename, lineNr, addrHash);
+			(*it)->onFileLine(filename, fileId, lineNr, addrHash);
+
+		// The reporter index works as a breakpoint ID for the merge reporter
+		if (index >= m_linesByIndex.size())
+			m_linesByIndex.resize(index + 1);
+		m_linesByIndex[index] = LineEntry(addrHash, &file->m_addrHits[addrHash]);
+
+		for (CollectorListenerList_t::const_iterator it = m_collectorListeners.begin();
+				it != m_collectorListeners.end();
+				++it)
+			(*it)->onBreakpoint(index, addrHash);
 
 		/*
 		 * Visit pending addresses for this file/line. onAddress gets a non-
@@ -264,10 +301,18 @@ public:
 		}
 	}
 
+	void onSnapshot()
+	{
+	}
+
 	void write()
 	{
 	}
 
+	void onWritten()
+	{
+	}
+
 
 	// From ICollector
 	virtual void registerListener(ICollector::IListener &listener)
@@ -604,6 +649,18 @@ private:
 	};
 
 
+	class LineEntry
+	{
+	public:
+		LineEntry(uint64_t addr = 0, unsigned int *hits = NULL) :
+			m_addr(addr), m_hits(hits)
+		{
+		}
+
+		uint64_t m_addr; // Hashed
+		unsigned int *m_hits; // In File::m_addrHits, which doesn't move them
+	};
+
 	typedef std::vector<ICollector::IListener *> CollectorListenerList_t;
 	typedef std::unordered_map<std::string, File *> FileByNameMap_t;
 	typedef std::unordered_map<uint64_t, File *> FileByAddressMap_t;
@@ -611,12 +668,15 @@ private:
 	typedef std::unordered_map<uint64_t, unsigned long> AddrToHitsMap_t;
 	typedef std::unordered_map<uint64_t, unsigned long> AddressByFileLine_t;
 	typedef std::vector<IFileParser::ILineListener *> LineListenerList_t;
+	typedef std::vector<LineEntry> LineEntryList_t; // By reporter line index
 
 	// All files in the current coverage session
 	FileByNameMap_t m_files;
 	FileByAddressMap_t m_filesByAddress;
 	FileLineByAddress_t m_fileLineByAddress;
 	AddrToHitsMap_t m_pendingHits;
+	LineEntryList_t m_linesByIndex;
+	std::vector<File *> m_filesByReporterId;
 
 	LineListenerList_t m_lineListeners;
 	const std::string m_baseDirectory;
@@ -624,6 +684,7 @@ private:
 
 	CollectorListenerList_t m_collectorListeners;
 	IFilter &m_filter;
+	FilterCache m_filterCache;
 };
 
 namespace kcov
@@ -4,15 +4,19 @@
 #include <reporter.hh>
 #include <collector.hh>
 #include <file-parser.hh>
+#include <thread-pool.hh>
 #include <utils.hh>
 
 #include <list>
+#include <mutex>
+#include <condition_variable>
 
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <signal.h>
 #include <dirent.h>
+#include <pthread.h>
 
 namespace kcov
 {
@@ -21,7 +25,11 @@ namespace kcov
 			public ICollector::IEventTickListener
 	{
 	public:
-		OutputHandler(IReporter &reporter, ICollector *collector)
+		OutputHandler(IReporter &reporter, ICollector *collector) :
+			m_reporter(reporter),
+			m_threadStarted(false),
+			m_threadShouldExit(false),
+			m_busy(false)
 		{
 			IConfiguration &conf = IConfiguration::getInstance();
 
@@ -79,6 +87,8 @@ namespace kcov
 
 		void stop()
 		{
+			stopThread();
+
 			for (WriterList_t::const_iterator it = m_writers.begin();
 					it != m_writers.end();
 					++it)
@@ -88,12 +98,16 @@ namespace kcov
 			produce();
 		}
 
+		// Produce output in this thread
 		void produce()
 		{
-			for (WriterList_t::const_iterator it = m_writers.begin();
-					it != m_writers.end();
-					++it)
-				(*it)->write();
+			std::unique_lock<std::mutex> lock(m_mutex);
+
+			while (m_busy)
+				m_cond.wait(lock);
+
+			snapshot();
+			write();
 		}
 
 		// From ICollector::IEventTickListener
@@ -102,18 +116,141 @@ namespace kcov
 			if (m_outputInterval == 0)
 				return;
 
-			if (get_ms_timestamp() - m_lastTimestamp >= m_outputInterval) {
-				produce();
+			if (get_ms_timestamp() - m_lastTimestamp < m_outputInterval)
+				return;
+
+			m_lastTimestamp = get_ms_timestamp();
+
+			// Only the new hits are written, so a crash loses at most these
+			m_reporter.writeCoverageDatabase();
 
-				// Take a new timestamp since producing might take a long time
-				m_lastTimestamp = get_ms_timestamp();
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			// Still writing the last snapshot? Skip this one then
+			if (m_busy) {
+				kcov_debug(INFO_MSG, "Output still busy, skipping\n");
+				return;
 			}
+
+			if (!m_threadStarted) {
+				sigset_t set, oldSet;
+
+				// Signals are handled by the collector thread
+				sigfillset(&set);
+				pthread_sigmask(SIG_BLOCK, &set, &oldSet);
+				m_threadStarted = pthread_create(&m_thread, NULL,
+						OutputHandler::threadStatic, (void *)this) == 0;
+				pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+
+				// Write in this thread if the thread can't be created
+				if (!m_threadStarted) {
+					snapshot();
+					write();
+
+					return;
+				}
+			}
+
+			// Take over the data while the writers are idle
+			snapshot();
+
+			m_busy = true;
+			m_cond.notify_all();
 		}
 
 
 	private:
+		void snapshot()
+		{
+			for (WriterList_t::const_iterator it = m_writers.begin();
+					it != m_writers.end();
+					++it)
+				(*it)->onSnapshot();
+		}
+
+		// The writers are independent, so write in parallel
+		void write()
+		{
+			std::vector<WriterTask> tasks(m_writers.begin(), m_writers.end());
+			std::vector<IThreadPool::ITask *> taskPointers;
+
+			for (unsigned int i = 0; i < tasks.size(); i++)
+				taskPointers.push_back(&tasks[i]);
+
+			IThreadPool::getInstance().run(taskPointers);
+
+			for (WriterList_t::const_iterator it = m_writers.begin();
+					it != m_writers.end();
+					++it)
+				(*it)->onWritten();
+		}
+
+		void stopThread()
+		{
+			if (!m_threadStarted)
+				return;
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+
+				m_threadShouldExit = true;
+				m_cond.notify_all();
+			}
+
+			// Finishes the current output first
+			pthread_join(m_thread, NULL);
+			m_threadStarted = false;
+			m_threadShouldExit = false;
+		}
+
+		static void *threadStatic(void *pThis)
+		{
+			OutputHandler *p = (OutputHandler *)pThis;
+
+			p->outputThread();
+
+			return NULL;
+		}
+
+		void outputThread()
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+
+			while (1) {
+				while (!m_busy && !m_threadShouldExit)
+					m_cond.wait(lock);
+
+				if (!m_busy)
+					break;
+
+				lock.unlock();
+				write();
+				lock.lock();
+
+				m_busy = false;
+				m_cond.notify_all();
+			}
+		}
+
+		class WriterTask : public IThreadPool::ITask
+		{
+		public:
+			WriterTask(IWriter *writer) :
+				m_writer(writer)
+			{
+			}
+
+			void run()
+			{
+				m_writer->write();
+			}
+
+			IWriter *m_writer;
+		};
+
 		typedef std::vector<IWriter *> WriterList_t;
 
+		IReporter &m_reporter;
 		std::string m_outDirectory;
 		std::string m_baseDirectory;
 		std::string m_summaryDbFileName;
@@ -122,6 +259,14 @@ namespace kcov
 
 		unsigned int m_outputInterval;
 		uint64_t m_lastTimestamp;
+
+		// Output thread, writing the snapshot when m_busy is set
+		pthread_t m_thread;
+		bool m_threadStarted;
+		bool m_threadShouldExit;
+		bool m_busy;
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
 	};
 
 	static OutputHandler *instance;
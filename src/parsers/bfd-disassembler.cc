@@ -2,6 +2,7 @@
 #include <utils.hh>
 
 #include <unordered_map>
+#include <unordered_set>
 #include <set>
 #include <map>
 #include <algorithm>
@@ -18,6 +19,7 @@
 using namespace kcov;
 
 const uint64_t BT_INVALID = 0xfffffffffffffffeull;
+const uint64_t BT_UNKNOWN = 0xfffffffffffffffdull; // Ends the block, target not known
 
 const std::set<std::string> x86BranchInstructions =
 {
@@ -50,16 +52,32 @@ const std::set<std::string> x86BranchInstructions =
 		"jpo",
 		"js",
 		"jz",
-		"jczx"
-		"jezx"
+		"jcxz",
+		"jecxz",
+		"jrcxz",
 
 		"loop",
+		"loope",
+		"loopne",
 
 		"jmp",
+		"ljmp",
 
 		"call",
+		"lcall",
 
 		"ret",
+		"lret",
+		"iret",
+};
+
+// Instructions which don't branch, but which basic blocks shouldn't flow past
+const std::set<std::string> x86BlockEndInstructions =
+{
+		"hlt",
+		"ud2",
+		"int3",
+		"nop", // Function padding
 };
 
 class BfdDisassembler : public IDisassembler
@@ -95,8 +113,34 @@ public:
 		SectionCache_t::iterator it = m_cache.find(baseAddress);
 
 		// Not visited before
-		if (it == m_cache.end())
-			m_cache[baseAddress] = new Section(sectionData, sectionSize, baseAddress);
+		if (it != m_cache.end())
+			return;
+
+		Section *section = new Section(sectionData, sectionSize, baseAddress);
+
+		m_cache[baseAddress] = section;
+
+		// Setup basic blocks for the new section on the next lookup
+		m_newSections.push_back(section);
+	}
+
+	void addDataSection(const void *sectionData, size_t sectionSize, uint64_t baseAddress)
+	{
+		// Searched when the code has been disassembled
+		m_dataSections.push_back(new Section(sectionData, sectionSize, baseAddress));
+	}
+
+	void addEntryPoint(uint64_t address)
+	{
+		m_entryPoints.insert(address);
+	}
+
+	bool isEntryPoint(uint64_t address)
+	{
+		if (!m_dataSections.empty())
+			scanDataSections();
+
+		return m_entryPoints.find(address) != m_entryPoints.end();
 	}
 
 	bool verify(uint64_t address)
@@ -115,13 +159,15 @@ public:
 
 	const std::vector<uint64_t> &getBasicBlock(uint64_t address)
 	{
-		if (m_bbs.empty())
+		if (!m_newSections.empty())
 			setupBasicBlocks();
 
-		if (m_instructions.find(address) == m_instructions.end())
+		Instruction *insn = getInstruction(address);
+
+		if (!insn || !insn->getBasicBlock())
 			return m_empty;
 
-		return m_instructions[address].getBasicBlock()->getInstructionAddresses();
+		return insn->getBasicBlock()->getInstructionAddresses();
 	}
 
 private:
@@ -204,6 +250,17 @@ private:
 			memcpy(m_data, data, size);
 		}
 
+		~Section()
+		{
+			clearBasicBlocks();
+			free(m_data);
+		}
+
+		const uint8_t *getData() const
+		{
+			return (const uint8_t *)m_data;
+		}
+
 		uint64_t getBase() const
 		{
 			return m_startAddress;
@@ -219,6 +276,30 @@ private:
 			return m_disassembled;
 		}
 
+		bool hasBasicBlocks() const
+		{
+			return !m_bbs.empty();
+		}
+
+		BasicBlock *addBasicBlock()
+		{
+			BasicBlock *bb = new BasicBlock();
+
+			m_bbs.push_back(bb);
+
+			return bb;
+		}
+
+		void clearBasicBlocks()
+		{
+			for (std::vector<BasicBlock *>::iterator it = m_bbs.begin();
+					it != m_bbs.end();
+					++it)
+				delete *it;
+
+			m_bbs.clear();
+		}
+
 		void disassemble(BfdDisassembler &target, struct disassemble_info info, disassembler_ftype disassembler)
 		{
 			if (m_disassembled)
@@ -226,12 +307,13 @@ private:
 
 			m_disassembled = true;
 
-			info.buffer_vma = 0;
+			// Disassemble at the real address, so that branch targets are absolute
+			info.buffer_vma = m_startAddress;
 			info.buffer_length = m_size;
 			info.buffer = (bfd_byte *)m_data;
 			info.stream = (void *)&target;
 
-			uint64_t pc = 0;
+			uint64_t pc = m_startAddress;
 			int count;
 			do
 			{
@@ -241,12 +323,12 @@ private:
 				if (count < 0)
 					break;
 
-				target.m_instructions[pc + m_startAddress] = target.instructionFactory(pc, target.m_instructionVector);
+				target.m_instructions[pc] = target.instructionFactory(pc, target.m_instructionVector);
 				// Point back into the other map
-				target.m_orderedInstructions[pc + m_startAddress] = &target.m_instructions[pc + m_startAddress];
+				target.m_orderedInstructions[pc] = &target.m_instructions[pc];
 
 				pc += count;
-			} while (count > 0 && pc < m_size);
+			} while (count > 0 && pc < m_startAddress + m_size);
 		}
 
 	private:
@@ -255,6 +337,7 @@ private:
 		const uint64_t m_startAddress;
 
 		bool m_disassembled; // Lazy disassembly once it's used
+		std::vector<BasicBlock *> m_bbs;
 	};
 
 	// Implementation taken from EmilPRO, https://github.com/SimonKagstrom/emilpro
@@ -266,35 +349,48 @@ private:
 		if (vec.size() < 1)
 			return Instruction();
 
-		std::set<std::string>::const_iterator it = x86BranchInstructions.find(vec[0]);
+		std::string mnemonic = getMnemonic(vec[0]);
 
-		// Address?
-		if (it != x86BranchInstructions.end() &&
-				vec.size() >= 2 && string_is_integer(vec[1])) {
-			int64_t offset = string_to_integer(vec[1]);
+		if (x86BranchInstructions.find(mnemonic) != x86BranchInstructions.end()) {
+			// Returns and indirect branches end the block as well
+			branchTarget = BT_UNKNOWN;
 
-			// FIXME! Check if this is correct
-			if ( (offset & (1 << 31)) )
-				offset |= 0xffffffff00000000ULL;
-
-			branchTarget = pc + offset;
+			// Direct branches print the absolute target address
+			if (vec.size() >= 2 && string_is_integer(vec[1]))
+				branchTarget = string_to_integer(vec[1]);
+		} else if (x86BlockEndInstructions.find(mnemonic) != x86BlockEndInstructions.end()) {
+			branchTarget = BT_UNKNOWN;
 		}
 
 		return Instruction(branchTarget);
 	}
 
+	// "bnd jmp" -> "jmp", "callq" -> "call", "nopw" -> "nop"
+	std::string getMnemonic(const std::string &str)
+	{
+		size_t space = str.rfind(' ');
+		std::string out = space == std::string::npos ? str : str.substr(space + 1);
+
+		if (x86BranchInstructions.find(out) != x86BranchInstructions.end() ||
+				out.size() < 2)
+			return out;
+
+		char last = out[out.size() - 1];
+		if (last == 'q' || last == 'l' || last == 'w')
+			return out.substr(0, out.size() - 1);
+
+		return out;
+	}
+
 	Section *lookupSection(uint64_t address)
 	{
-		SectionCache_t::iterator it = m_cache.lower_bound(address);
+		SectionCache_t::iterator it = m_cache.upper_bound(address);
 
-		if (it == m_cache.end())
+		// Below the first section
+		if (it == m_cache.begin())
 			return NULL;
 		--it;
 
-		// Above the last symbol
-		if (it == m_cache.end())
-			return NULL;
-
 		Section *cur = it->second;
 		uint64_t end = cur->getBase() + cur->getSize() - 1;
 
@@ -310,57 +406,167 @@ private:
 		return cur;
 	}
 
-	void setupBasicBlocks()
+	void disassembleAll()
 	{
 		for (SectionCache_t::iterator it = m_cache.begin();
 				it != m_cache.end();
 				++it)
 			it->second->disassemble(*this, m_info, m_disassembler);
+	}
 
-		InstructionOrderedMap_t::iterator cur = m_orderedInstructions.begin();
+	/*
+	 * Only the new sections get basic blocks, the others are kept unless a
+	 * branch from a new section splits one of their blocks.
+	 */
+	void setupBasicBlocks()
+	{
+		std::set<Section *> rebuild(m_newSections.begin(), m_newSections.end());
 
-		// The no-instructions program. Uncommon.
-		if (cur == m_orderedInstructions.end())
-			return;
+		// Branches between sections need everything disassembled
+		disassembleAll();
 
-		InstructionOrderedMap_t::iterator next = cur;
-		next++;
+		for (std::vector<Section *>::iterator it = m_newSections.begin();
+				it != m_newSections.end();
+				++it) {
+			markLeaders(**it, rebuild);
+			markPendingTargets(**it);
+		}
+		m_newSections.clear();
+
+		for (std::set<Section *>::iterator it = rebuild.begin();
+				it != rebuild.end();
+				++it)
+			createBasicBlocks(**it);
+	}
+
+	// Mark branch targets as leaders, as well as the instruction after that
+	void markLeaders(Section &section, std::set<Section *> &rebuild)
+	{
+		InstructionOrderedMap_t::iterator cur = m_orderedInstructions.lower_bound(section.getBase());
+		InstructionOrderedMap_t::iterator end = m_orderedInstructions.lower_bound(section.getBase() + section.getSize());
+
+		// The no-instructions section. Uncommon.
+		if (cur == end)
+			return;
 
 		// The first instruction is always a leader
 		cur->second->makeLeader();
 
-		// The one-instructions program. Also uncommon.
-		if (next == m_orderedInstructions.end())
-			return;
+		for (; cur != end; ++cur) {
+			if (!cur->second->isBranch())
+				continue;
 
-		// Iterate the instruction pairs
-		for (; next != m_orderedInstructions.end(); ++cur, ++next) {
-			// Mark branch targets as leaders, as well as the instruction after that
-			if (cur->second->isBranch()) {
-				m_instructions[cur->second->getBranchTarget()].makeLeader();
+			InstructionOrderedMap_t::iterator next = cur;
+			if (++next != end)
 				next->second->makeLeader();
+
+			uint64_t targetAddress = cur->second->getBranchTarget();
+			if (targetAddress == BT_UNKNOWN)
+				continue;
+
+			Instruction *target = getInstruction(targetAddress);
+
+			// Not disassembled (yet), maybe in a later section
+			if (!target) {
+				m_pendingTargets.insert(targetAddress);
+				continue;
 			}
+
+			if (target->isLeader())
+				continue;
+			target->makeLeader();
+
+			// Splits a block in a section which is already setup
+			Section *other = lookupSection(targetAddress);
+			if (other && other->hasBasicBlocks())
+				rebuild.insert(other);
+		}
+	}
+
+	// Branches from earlier sections into this one
+	void markPendingTargets(Section &section)
+	{
+		std::set<uint64_t>::iterator it = m_pendingTargets.lower_bound(section.getBase());
+
+		while (it != m_pendingTargets.end() && *it < section.getBase() + section.getSize()) {
+			Instruction *target = getInstruction(*it);
+
+			if (target)
+				target->makeLeader();
+			m_pendingTargets.erase(it++);
 		}
+	}
 
-		// Create and populate basic blocks
+	void createBasicBlocks(Section &section)
+	{
+		InstructionOrderedMap_t::iterator it = m_orderedInstructions.lower_bound(section.getBase());
+		InstructionOrderedMap_t::iterator end = m_orderedInstructions.lower_bound(section.getBase() + section.getSize());
 		BasicBlock *bb = NULL;
 
-		m_bbs.push_back(bb);
-		for (InstructionOrderedMap_t::iterator it = m_orderedInstructions.begin();
-				it != m_orderedInstructions.end();
-				++it) {
+		section.clearBasicBlocks();
+		for (; it != end; ++it) {
 			Instruction *cur = it->second;
 
-			if (cur->isLeader()) {
-				bb = new BasicBlock();
-				m_bbs.push_back(bb);
-			}
+			if (cur->isLeader() || !bb)
+				bb = section.addBasicBlock();
 
 			cur->setBasicBlock(bb);
 			bb->addInstructionAddress(it->first);
 		}
 	}
 
+	void scanDataSections()
+	{
+		disassembleAll();
+
+		for (std::vector<Section *>::iterator it = m_dataSections.begin();
+				it != m_dataSections.end();
+				++it) {
+			scanForJumpTables(**it);
+			delete *it;
+		}
+		m_dataSections.clear();
+	}
+
+	/*
+	 * Jump table targets are entered without passing the block leader. The
+	 * tables hold either absolute addresses, or (in PIC code) 32-bit offsets
+	 * from the start of the table. Data which just happens to look like a
+	 * table only costs an extra breakpoint.
+	 */
+	void scanForJumpTables(const Section &section)
+	{
+		const uint8_t *data = section.getData();
+		size_t size = section.getSize();
+		size_t pointerSize = m_info.mach == bfd_mach_x86_64 ? 8 : 4;
+
+		for (size_t offset = 0; offset + 4 <= size; offset += 4) {
+			if (offset % pointerSize == 0 && offset + pointerSize <= size) {
+				uint64_t target = 0;
+
+				memcpy(&target, data + offset, pointerSize);
+				if (getInstruction(target))
+					m_entryPoints.insert(target);
+			}
+
+			uint64_t table = section.getBase() + offset;
+			size_t cur;
+
+			for (cur = offset; cur + 4 <= size; cur += 4) {
+				int32_t relative;
+
+				memcpy(&relative, data + cur, sizeof(relative));
+				if (!getInstruction(table + (int64_t)relative))
+					break;
+
+				m_entryPoints.insert(table + (int64_t)relative);
+			}
+
+			// Continue after the table
+			if (cur > offset)
+				offset = cur - 4;
+		}
+	}
 
 	Instruction *getInstruction(uint64_t address)
 	{
@@ -374,9 +580,13 @@ private:
 
 	void opcodesFprintFunc(const char *str)
 	{
-		std::string stdStr(str);
+		std::string stdStr = trim_string(std::string(str));
+
+		// Padding between the mnemonic and the operands
+		if (stdStr.empty())
+			return;
 
-		m_instructionVector.push_back(trim_string(stdStr));
+		m_instructionVector.push_back(stdStr);
 	}
 
 	static int opcodesFprintFuncStatic(void *info, const char *fmt, ...)
@@ -398,6 +608,7 @@ private:
 	typedef std::map<uint64_t, Section *> SectionCache_t;
 	typedef std::unordered_map<uint64_t, Instruction> InstructionAddressMap_t;
 	typedef std::map<uint64_t, Instruction *> InstructionOrderedMap_t;
+	typedef std::unordered_set<uint64_t> AddressSet_t;
 
 	struct disassemble_info m_info;
 	disassembler_ftype m_disassembler;
@@ -409,7 +620,10 @@ private:
 	InstructionAddressMap_t m_instructions;
 	InstructionOrderedMap_t m_orderedInstructions;
 
-	std::vector<BasicBlock *> m_bbs;
+	std::vector<Section *> m_newSections;
+	std::vector<Section *> m_dataSections;
+	std::set<uint64_t> m_pendingTargets; // Branch targets outside the disassembled code
+	AddressSet_t m_entryPoints;
 	std::vector<uint64_t> m_empty;
 };
 
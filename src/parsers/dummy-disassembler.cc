@@ -13,6 +13,19 @@ public:
 	{
 	}
 
+	void addDataSection(const void *sectionData, size_t sectionSize, uint64_t baseAddress)
+	{
+	}
+
+	void addEntryPoint(uint64_t address)
+	{
+	}
+
+	bool isEntryPoint(uint64_t address)
+	{
+		return false;
+	}
+
 	const std::vector<uint64_t> &getBasicBlock(uint64_t address)
 	{
 		return m_empty;
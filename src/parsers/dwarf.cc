@@ -1,33 +1,134 @@
 #include "dwarf.hh"
 
 #include <utils.hh>
+#include <filter.hh>
+#include <thread-pool.hh>
 
 #include <elfutils/libdw.h>
+#include <dwarf.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+#include <unordered_map>
 
 using namespace kcov;
 
+// Enough compilation units to parse them in parallel
+#define PARALLEL_MIN_CUS 16
+
 class DwarfParser::Impl
 {
 public:
-	Impl() :
+	Impl(DwarfParser &parser) :
+	m_parser(parser),
+	m_filter(NULL),
+	m_threads(0),
 	m_fd(-1),
 	m_dwarf(NULL)
 	{
 	}
 
+	// Filter results by source file, one map per thread
+	typedef std::unordered_map<std::string, bool> IncludedMap_t;
+
+	// Lines of a compilation unit, parsed by a worker
+	class CuLines : public IFileParser::ILineListener
+	{
+	public:
+		void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
+		{
+			// Consecutive lines are mostly from the same file
+			if (m_files.empty() || m_files.back() != file)
+				m_files.push_back(file);
+
+			m_lines.push_back(Line(m_files.size() - 1, lineNr, addr));
+		}
+
+		void replay(IFileParser::ILineListener &listener)
+		{
+			for (std::vector<Line>::const_iterator it = m_lines.begin();
+					it != m_lines.end();
+					++it)
+				listener.onLine(m_files[it->m_file], it->m_lineNr, it->m_addr);
+		}
+
+	private:
+		class Line
+		{
+		public:
+			Line(unsigned int file, unsigned int lineNr, uint64_t addr) :
+				m_file(file), m_lineNr(lineNr), m_addr(addr)
+			{
+			}
+
+			unsigned int m_file;
+			unsigned int m_lineNr;
+			uint64_t m_addr;
+		};
+
+		std::vector<std::string> m_files;
+		std::vector<Line> m_lines;
+	};
+
+	// Parses compilation units until none are left, with a Dwarf handle of its own
+	class CuTask : public IThreadPool::ITask
+	{
+	public:
+		CuTask(Impl &impl, const std::vector<Dwarf_Off> &dieOffsets,
+				std::vector<CuLines> &out, unsigned int *next) :
+			m_impl(impl), m_dieOffsets(dieOffsets), m_out(out), m_next(next)
+		{
+		}
+
+		void run()
+		{
+			// libdw isn't thread safe, but separate handles are fine
+			Dwarf *dwarf = dwarf_begin(m_impl.m_fd, DWARF_C_READ);
+
+			if (!dwarf)
+				return;
+
+			while (1) {
+				unsigned int cu = __atomic_fetch_add(m_next, 1, __ATOMIC_RELAXED);
+
+				if (cu >= m_dieOffsets.size())
+					break;
+
+				m_impl.forCuLines(dwarf, m_dieOffsets[cu], m_out[cu], m_included);
+			}
+
+			dwarf_end(dwarf);
+		}
+
+	private:
+		Impl &m_impl;
+		const std::vector<Dwarf_Off> &m_dieOffsets;
+		std::vector<CuLines> &m_out;
+		unsigned int *m_next;
+		IncludedMap_t m_included;
+	};
+
+	// Report the lines of the compilation unit at dieOffset
+	void forCuLines(Dwarf *dwarf, Dwarf_Off dieOffset, IFileParser::ILineListener &listener,
+			IncludedMap_t &included);
+
+	// Does any file of a compilation unit pass the filter?
+	bool cuIsIncluded(Dwarf_Files *files, size_t fileCount, const char *const *srcDirs,
+			IncludedMap_t &included);
+
+	DwarfParser &m_parser;
+	IFilter *m_filter;
+	unsigned int m_threads;
 	int m_fd;
 	Dwarf *m_dwarf;
 };
 
 DwarfParser::DwarfParser()
 {
-	m_impl = new DwarfParser::Impl();
+	m_impl = new DwarfParser::Impl(*this);
 }
 
 DwarfParser::~DwarfParser()
@@ -36,6 +137,108 @@ DwarfParser::~DwarfParser()
 	delete m_impl;
 }
 
+void DwarfParser::Impl::forCuLines(Dwarf *dwarf, Dwarf_Off dieOffset,
+		IFileParser::ILineListener &listener, IncludedMap_t &included)
+{
+	Dwarf_Lines* lines;
+	Dwarf_Files *files;
+	size_t lineCount;
+	size_t fileCount;
+	Dwarf_Die die;
+	unsigned int i;
+
+	if (dwarf_offdie(dwarf, dieOffset, &die) == NULL)
+		return;
+
+	/* Get the files */
+	if (dwarf_getsrcfiles(&die, &files, &fileCount) != 0)
+		return;
+
+	const char *const *srcDirs;
+	size_t ndirs = 0;
+
+	/* Lookup the compilation path */
+	if (dwarf_getsrcdirs(files, &srcDirs, &ndirs) != 0)
+		return;
+
+	if (ndirs == 0)
+		return;
+
+	/* Skip filtered compilation units before the lines are decoded */
+	if (!cuIsIncluded(files, fileCount, srcDirs, included))
+		return;
+
+	/* And the source lines */
+	if (dwarf_getsrclines(&die, &lines, &lineCount) != 0)
+		return;
+
+	/* Iterate through the source lines */
+	for (i = 0; i < lineCount; i++) {
+		Dwarf_Line *line;
+		int lineNr = 0;
+		const char* lineSource;
+		Dwarf_Word mtime, len;
+		bool isCode;
+		Dwarf_Addr addr;
+
+		if ( !(line = dwarf_onesrcline(lines, i)) )
+			continue;
+
+		if (dwarf_lineno(line, &lineNr) != 0)
+			continue;
+
+		if (!(lineSource = dwarf_linesrc(line, &mtime, &len)) )
+			continue;
+
+		if (dwarf_linebeginstatement(line, &isCode) != 0)
+			continue;
+
+		if (dwarf_lineaddr(line, &addr) != 0)
+			continue;
+
+		// Invalid line number?
+		if (lineNr == 0)
+			continue;
+
+		// Non-code?
+		if (!isCode)
+			continue;
+
+		listener.onLine(m_parser.fullPath(srcDirs, lineSource), lineNr, addr);
+	}
+}
+
+bool DwarfParser::Impl::cuIsIncluded(Dwarf_Files *files, size_t fileCount,
+		const char *const *srcDirs, IncludedMap_t &included)
+{
+	if (!m_filter)
+		return true;
+
+	for (size_t i = 0; i < fileCount; i++) {
+		const char *name = dwarf_filesrc(files, i, NULL, NULL);
+
+		if (!name)
+			continue;
+
+		std::string path = m_parser.fullPath(srcDirs, name);
+		IncludedMap_t::const_iterator it = included.find(path);
+		bool cur;
+
+		// Same as for the reported lines, which are mangled first
+		if (it == included.end()) {
+			cur = m_filter->runFilters(m_filter->mangleSourcePath(path));
+			included[path] = cur;
+		} else {
+			cur = it->second;
+		}
+
+		if (cur)
+			return true;
+	}
+
+	return false;
+}
+
 void DwarfParser::forEachLine(IFileParser::ILineListener& listener)
 {
 	if (!m_impl->m_dwarf)
@@ -44,23 +247,98 @@ void DwarfParser::forEachLine(IFileParser::ILineListener& listener)
 	Dwarf_Off offset = 0;
 	Dwarf_Off lastOffset = 0;
 	size_t headerSize;
+	std::vector<Dwarf_Off> dieOffsets;
+
+	/* Iterate over the headers */
+	while (dwarf_nextcu(m_impl->m_dwarf, offset, &offset, &headerSize, 0, 0, 0) == 0) {
+		dieOffsets.push_back(lastOffset + headerSize);
+		lastOffset = offset;
+	}
+
+	IThreadPool &pool = IThreadPool::getInstance();
+	unsigned int nThreads = pool.getThreadCount();
+
+	if (m_impl->m_threads != 0)
+		nThreads = m_impl->m_threads;
+
+	if (dieOffsets.size() < PARALLEL_MIN_CUS || nThreads == 1) {
+		Impl::IncludedMap_t included;
+
+		for (unsigned int i = 0; i < dieOffsets.size(); i++)
+			m_impl->forCuLines(m_impl->m_dwarf, dieOffsets[i], listener, included);
+
+		return;
+	}
+
+	// Decode the line tables in parallel, and report them in CU order
+	std::vector<Impl::CuLines> cuLines(dieOffsets.size());
+	std::vector<Impl::CuTask> tasks;
+	std::vector<IThreadPool::ITask *> taskPointers;
+	unsigned int next = 0;
+
+	tasks.reserve(nThreads);
+	for (unsigned int i = 0; i < nThreads; i++) {
+		tasks.push_back(Impl::CuTask(*m_impl, dieOffsets, cuLines, &next));
+		taskPointers.push_back(&tasks.back());
+	}
+
+	pool.run(taskPointers);
+
+	for (unsigned int i = 0; i < cuLines.size(); i++)
+		cuLines[i].replay(listener);
+}
+
+// Collect subprogram entry points, also from namespaces and classes
+static void collectFunctions(Dwarf_Die *scope, std::vector<Dwarf_Addr> &out)
+{
+	Dwarf_Die child;
+
+	if (dwarf_child(scope, &child) != 0)
+		return;
+
+	do {
+		Dwarf_Addr addr;
+
+		switch (dwarf_tag(&child))
+		{
+		case DW_TAG_subprogram:
+			// Declarations and abstract inline instances have no low_pc
+			if (dwarf_lowpc(&child, &addr) == 0 && addr != 0)
+				out.push_back(addr);
+			break;
+		case DW_TAG_namespace:
+		case DW_TAG_class_type:
+		case DW_TAG_structure_type:
+		case DW_TAG_union_type:
+			collectFunctions(&child, out);
+			break;
+		default:
+			break;
+		}
+	} while (dwarf_siblingof(&child, &child) == 0);
+}
+
+void DwarfParser::forEachFunction(IFileParser::ILineListener& listener)
+{
+	if (!m_impl->m_dwarf)
+		return;
+
+	Dwarf_Off offset = 0;
+	Dwarf_Off lastOffset = 0;
+	size_t headerSize;
+	Impl::IncludedMap_t included;
 
 	/* Iterate over the headers */
 	while (dwarf_nextcu(m_impl->m_dwarf, offset, &offset, &headerSize, 0, 0, 0) == 0) {
-		Dwarf_Lines* lines;
 		Dwarf_Files *files;
-		size_t lineCount;
 		size_t fileCount;
 		Dwarf_Die die;
-		unsigned int i;
-
-		if (dwarf_offdie(m_impl->m_dwarf, lastOffset + headerSize, &die) == NULL)
-			continue;
+		Dwarf_Off dieOffset = lastOffset + headerSize;
 
+		// Also when the DIE can't be read, the next CU starts here
 		lastOffset = offset;
 
-		/* Get the source lines */
-		if (dwarf_getsrclines(&die, &lines, &lineCount) != 0)
+		if (dwarf_offdie(m_impl->m_dwarf, dieOffset, &die) == NULL)
 			continue;
 
 		/* And the files */
@@ -77,39 +355,32 @@ void DwarfParser::forEachLine(IFileParser::ILineListener& listener)
 		if (ndirs == 0)
 			continue;
 
-		/* Iterate through the source lines */
-		for (i = 0; i < lineCount; i++) {
+		if (!m_impl->cuIsIncluded(files, fileCount, srcDirs, included))
+			continue;
+
+		std::vector<Dwarf_Addr> functions;
+
+		collectFunctions(&die, functions);
+
+		/* Report the function entries with the line of the entry address */
+		for (std::vector<Dwarf_Addr>::const_iterator it = functions.begin();
+				it != functions.end();
+				++it) {
 			Dwarf_Line *line;
 			int lineNr = 0;
 			const char* lineSource;
 			Dwarf_Word mtime, len;
-			bool isCode;
-			Dwarf_Addr addr;
 
-			if ( !(line = dwarf_onesrcline(lines, i)) )
+			if ( !(line = dwarf_getsrc_die(&die, *it)) )
 				continue;
 
-			if (dwarf_lineno(line, &lineNr) != 0)
+			if (dwarf_lineno(line, &lineNr) != 0 || lineNr == 0)
 				continue;
 
 			if (!(lineSource = dwarf_linesrc(line, &mtime, &len)) )
 				continue;
 
-			if (dwarf_linebeginstatement(line, &isCode) != 0)
-				continue;
-
-			if (dwarf_lineaddr(line, &addr) != 0)
-				continue;
-
-			// Invalid line number?
-			if (lineNr == 0)
-				continue;
-
-			// Non-code?
-			if (!isCode)
-				continue;
-
-			listener.onLine(fullPath(srcDirs, lineSource), lineNr, addr);
+			listener.onLine(fullPath(srcDirs, lineSource), lineNr, *it);
 		}
 	}
 }
@@ -189,6 +460,16 @@ std::string DwarfParser::fullPath(const char *const *srcDirs, const std::string
 
 
 
+void DwarfParser::setFilter(IFilter &filter)
+{
+	m_impl->m_filter = &filter;
+}
+
+void DwarfParser::setThreadCount(unsigned int nThreads)
+{
+	m_impl->m_threads = nThreads;
+}
+
 bool DwarfParser::open(const std::string& filename)
 {
 	close();
@@ -7,6 +7,8 @@
 
 namespace kcov
 {
+	class IFilter;
+
 	class DwarfParser
 	{
 	public:
@@ -16,10 +18,28 @@ namespace kcov
 
 		bool open(const std::string &filename);
 
+		/**
+		 * Skip compilation units where no source file passes @a filter,
+		 * without decoding their lines.
+		 */
+		void setFilter(IFilter &filter);
+
+		/**
+		 * Decode compilation units in at most @a nThreads threads, 0 (the
+		 * default) for the thread pool size and 1 to decode serially.
+		 */
+		void setThreadCount(unsigned int nThreads);
+
 		void forEachLine(IFileParser::ILineListener &listener);
 
 		void forAddress(IFileParser::ILineListener &listener, uint64_t address);
 
+		/**
+		 * Report the entry point of each function (DW_TAG_subprogram
+		 * low_pc), with the source line of the entry address.
+		 */
+		void forEachFunction(IFileParser::ILineListener &listener);
+
 	private:
 		class Impl;
 
@@ -6,15 +6,18 @@
 #include <phdr_data.h>
 #include <disassembler.hh>
 #include <elf.hh>
+#include <line-table-cache.hh>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <libelf.h>
 #include <dwarf.h>
 #include <elfutils/libdw.h>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <string>
 #include <configuration.hh>
@@ -56,6 +59,8 @@ public:
 		m_debuglinkCrc = 0;
 		m_relocation = 0;
 		m_invalidBreakpoints = 0;
+		m_granularity = GRANULARITY_ADDRESS;
+		m_lastFileId = -1;
 
 		IParserManager::getInstance().registerParser(*this);
 	}
@@ -104,6 +109,12 @@ public:
 		if (!m_initialized) {
 			m_verifyAddresses = IConfiguration::getInstance().keyAsInt("verify");
 
+			std::string granularity = IConfiguration::getInstance().keyAsString("granularity");
+			if (granularity == "line")
+				m_granularity = GRANULARITY_LINE;
+			else if (granularity == "function")
+				m_granularity = GRANULARITY_FUNCTION;
+
 			panic_if(elf_version(EV_CURRENT) == EV_NONE,
 					"ELF version failed\n");
 			m_initialized = true;
@@ -117,6 +128,8 @@ public:
 
 		m_curSegments.clear();
 		m_executableSegments.clear();
+		m_dataSegments.clear();
+		m_landingPads.clear();
 		for (uint32_t i = 0; data && i < data->n_segments; i++) {
 			struct phdr_data_segment *seg = &data->segments[i];
 
@@ -217,7 +230,8 @@ out_open:
 
 		parseOneElf();
 
-		setupSections();
+		setupSections(relocation);
+		setupLoadedSegments(relocation);
 
 		// Gcov data?
 		if (IConfiguration::getInstance().keyAsInt("gcov") && !m_gcnoFiles.empty())
@@ -294,24 +308,188 @@ out_open:
 		}
 	}
 
-	void setupSections()
+	// Sections are added at their load address, so solibs don't overlap
+	void setupSections(unsigned long relocation)
+	{
+		for (SegmentList_t::const_iterator it = m_executableSegments.begin();
+				it != m_executableSegments.end();
+				++it) {
+			if (!it->getData())
+				continue;
+
+			m_addressVerifier.addSection(it->getData(), it->getSize(),
+					adjustAddressBySegment(it->getBase()) + relocation);
+		}
+
+		// For the basic block entry points
+		for (SegmentList_t::const_iterator it = m_dataSegments.begin();
+				it != m_dataSegments.end();
+				++it) {
+			if (!it->getData())
+				continue;
+
+			m_addressVerifier.addDataSection(it->getData(), it->getSize(),
+					adjustAddressBySegment(it->getBase()) + relocation);
+		}
+
+		for (std::vector<uint64_t>::const_iterator it = m_landingPads.begin();
+				it != m_landingPads.end();
+				++it)
+			m_addressVerifier.addEntryPoint(adjustAddressBySegment(*it) + relocation);
+	}
+
+	/*
+	 * Keep track of the code for lookups of the original instructions. The
+	 * bytes are read from a read-only mapping of the file, which is shared
+	 * with the page cache, rather than kept in yet another copy.
+	 */
+	void setupLoadedSegments(unsigned long relocation)
 	{
+		const uint8_t *fileData = NULL;
+		size_t fileSize = 0;
+
 		for (SegmentList_t::const_iterator it = m_executableSegments.begin();
 				it != m_executableSegments.end();
 				++it) {
-			m_addressVerifier.addSection(it->getData(), it->getSize(), it->getBase());
+			if (!it->getData())
+				continue;
+
+			if (!fileData && !mapFile(m_filename, fileData, fileSize))
+				return;
+
+			// Truncated file?
+			if (it->getFileOffset() + it->getSize() > fileSize)
+				continue;
+
+			uint64_t base = adjustAddressBySegment(it->getBase()) + relocation;
+
+			m_loadedSegments[base] = LoadedSegment(m_filename, fileData + it->getFileOffset(),
+					base, it->getSize(), it->getFileOffset());
+		}
+	}
+
+	bool mapFile(const std::string &filename, const uint8_t *&data, size_t &size)
+	{
+		MappedFileMap_t::const_iterator it = m_mappedFiles.find(filename);
+
+		if (it != m_mappedFiles.end()) {
+			data = it->second.first;
+			size = it->second.second;
+
+			return true;
+		}
+
+		int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat st;
+
+		if (fd < 0)
+			return false;
+
+		if (fstat(fd, &st) < 0 || st.st_size == 0) {
+			close(fd);
+			return false;
 		}
+
+		void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		close(fd);
+		if (p == MAP_FAILED)
+			return false;
+
+		// Kept for the rest of the run
+		data = (const uint8_t *)p;
+		size = st.st_size;
+		m_mappedFiles[filename] = std::make_pair(data, size);
+
+		return true;
+	}
+
+	bool getOriginalData(uint64_t addr, void *dst, size_t size)
+	{
+		const LoadedSegment *seg = lookupLoadedSegment(addr);
+
+		// Crossing the segment end?
+		if (!seg || addr + size > seg->m_base + seg->m_size)
+			return false;
+
+		memcpy(dst, seg->m_data + (addr - seg->m_base), size);
+
+		return true;
+	}
+
+	bool getFileOffset(uint64_t addr, std::string &file, uint64_t &offset)
+	{
+		const LoadedSegment *seg = lookupLoadedSegment(addr);
+
+		if (!seg)
+			return false;
+
+		file = seg->m_file;
+		offset = seg->m_fileOffset + (addr - seg->m_base);
+
+		return true;
 	}
 
 	bool parseOneDwarf(unsigned long relocation)
 	{
+		ILineTableCache &cache = ILineTableCache::getInstance();
 		unsigned invalidBreakpoints = 0;
 
 		m_invalidBreakpoints = 0;
 		m_relocation = relocation;
 
-		DwarfParser dp;
+		std::string mode = m_granularity == GRANULARITY_FUNCTION ? "function" : "line";
+		std::string filterSignature = m_filter ? m_filter->getSignature() : "";
+
+		/*
+		 * Compilation units without included files are skipped, so tables
+		 * parsed with a filter are kept by the filter settings as well.
+		 */
+		if (filterSignature != "")
+			mode += "-" + filterSignature;
+
+		std::string cacheKey = cache.getKey(m_filename, m_buildId, mode);
+
+		// Parsed before, e.g., by another run in a kcov --server?
+		if (!cache.replay(cacheKey, *this)) {
+			DwarfParser dp;
+
+			if (!openDwarf(dp))
+				return false;
+
+			IFileParser::ILineListener *recorder = cache.record(cacheKey, *this);
+			IFileParser::ILineListener &listener = recorder ? *recorder : *this;
 
+			if (m_filter)
+				dp.setFilter(*m_filter);
+
+			/* Iterate over the headers */
+			if (m_granularity == GRANULARITY_FUNCTION)
+				dp.forEachFunction(listener);
+			else
+				dp.forEachLine(listener);
+
+			if (recorder)
+				cache.done(recorder);
+		}
+
+		// One address per line, collected by onLine
+		for (LineAddressMap_t::const_iterator it = m_lineAddresses.begin();
+				it != m_lineAddresses.end();
+				++it)
+			reportLine(it->first.first, it->first.second, it->second);
+		m_lineAddresses.clear();
+
+		if (m_invalidBreakpoints > 0) {
+			kcov_debug(STATUS_MSG, "kcov: %u invalid breakpoints skipped in %s\n",
+					invalidBreakpoints, m_filename.c_str());
+		}
+
+		return true;
+	}
+
+	bool openDwarf(DwarfParser &dp)
+	{
 		bool rv = dp.open(m_filename);
 
 		if (!rv && m_buildId.length() > 0) {
@@ -342,19 +520,9 @@ out_open:
 					warning("kcov requires binaries built with -g/-ggdb, a build-id file\n"
 							"or GNU debug link information.\n");
 			kcov_debug(ELF_MSG, "No debug symbols in %s.\n", m_filename.c_str());
-
-			return false;
-		}
-
-		/* Iterate over the headers */
-		dp.forEachLine(*this);
-
-		if (m_invalidBreakpoints > 0) {
-			kcov_debug(STATUS_MSG, "kcov: %u invalid breakpoints skipped in %s\n",
-					invalidBreakpoints, m_filename.c_str());
 		}
 
-		return true;
+		return rv;
 	}
 
 	bool parseOneElf()
@@ -379,6 +547,9 @@ out_open:
 				++it)
 			m_executableSegments.push_back(*it);
 
+		m_dataSegments = m_elf->getDataSegments();
+		m_landingPads = m_elf->getLandingPads();
+
 		// Gcov data
 		std::vector<std::string> gcdaFiles = m_elf->getGcovGcdaFiles();
 		for (std::vector<std::string>::iterator it = gcdaFiles.begin();
@@ -413,11 +584,58 @@ out_open:
 	}
 
 private:
+	// Executable code of a parsed file, in a mapping of the file
+	class LoadedSegment
+	{
+	public:
+		LoadedSegment() :
+			m_data(NULL), m_base(0), m_size(0), m_fileOffset(0)
+		{
+		}
+
+		LoadedSegment(const std::string &file, const uint8_t *data, uint64_t base,
+				size_t size, uint64_t fileOffset) :
+			m_file(file), m_data(data), m_base(base), m_size(size), m_fileOffset(fileOffset)
+		{
+		}
+
+		std::string m_file;
+		const uint8_t *m_data;
+		uint64_t m_base;
+		size_t m_size;
+		uint64_t m_fileOffset;
+	};
+
+	const LoadedSegment *lookupLoadedSegment(uint64_t addr) const
+	{
+		LoadedSegmentMap_t::const_iterator it = m_loadedSegments.upper_bound(addr);
+
+		if (it == m_loadedSegments.begin())
+			return NULL;
+		--it;
+
+		if (addr >= it->second.m_base + it->second.m_size)
+			return NULL;
+
+		return &it->second;
+	}
+
 	typedef std::vector<IFileParser::ILineListener *> LineListenerList_t;
 	typedef std::vector<IFileListener *> FileListenerList_t;
 	typedef std::vector<std::string> FileList_t;
+	typedef std::map<uint64_t, LoadedSegment> LoadedSegmentMap_t;
+	typedef std::unordered_map<std::string, std::pair<const uint8_t *, size_t> > MappedFileMap_t;
+	typedef std::map<std::pair<std::string, unsigned int>, uint64_t> LineAddressMap_t;
+	typedef std::unordered_map<std::string, unsigned int> FileIdMap_t;
+
+	enum Granularity
+	{
+		GRANULARITY_ADDRESS,  //< Every line table address
+		GRANULARITY_LINE,     //< The lowest address of each file:line
+		GRANULARITY_FUNCTION, //< Function entry points only
+	};
 
-	bool addressIsValid(uint64_t addr, unsigned &invalidBreakpoints) const
+	bool addressIsValid(uint64_t addr, uint64_t relocatedAddr, unsigned &invalidBreakpoints) const
 	{
 		for (SegmentList_t::const_iterator it = m_executableSegments.begin();
 				it != m_executableSegments.end();
@@ -426,7 +644,7 @@ private:
 				bool out = true;
 
 				if (m_verifyAddresses) {
-					out = m_addressVerifier.verify(addr);
+					out = m_addressVerifier.verify(relocatedAddr);
 
 					if (!out) {
 						kcov_debug(ELF_MSG, "kcov: Address 0x%llx is not at an instruction boundary, skipping\n",
@@ -460,15 +678,65 @@ private:
 	// From IFileParser::ILineListener
 	void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
 	{
-		if (!addressIsValid(addr, m_invalidBreakpoints))
+		uint64_t relocatedAddr = adjustAddressBySegment(addr) + m_relocation;
+
+		if (!addressIsValid(addr, relocatedAddr, m_invalidBreakpoints))
+			return;
+
+		if (m_granularity == GRANULARITY_LINE) {
+			LineAddressMap_t::key_type key(file, lineNr);
+			LineAddressMap_t::iterator it = m_lineAddresses.find(key);
+
+			if (it == m_lineAddresses.end() || relocatedAddr < it->second)
+				m_lineAddresses[key] = relocatedAddr;
+
 			return;
+		}
+
+		reportLine(file, lineNr, relocatedAddr);
+	}
 
-		std::string rp = m_filter->mangleSourcePath(file);
+	void reportLine(const std::string &file, unsigned int lineNr, uint64_t relocatedAddr)
+	{
+		unsigned int fileId = getFileId(file);
+		const std::string &rp = m_mangledFiles[fileId];
 
 		for (LineListenerList_t::const_iterator it = m_lineListeners.begin();
 				it != m_lineListeners.end();
 				++it)
-			(*it)->onLine(rp, lineNr, adjustAddressBySegment(addr) + m_relocation);
+			(*it)->onFileLine(rp, fileId, lineNr, relocatedAddr);
+	}
+
+	// Intern the mangled path of file, lines come grouped by file
+	unsigned int getFileId(const std::string &file)
+	{
+		if (m_lastFileId >= 0 && file == m_lastFile)
+			return m_lastFileId;
+
+		FileIdMap_t::const_iterator it = m_fileIds.find(file);
+		unsigned int fileId;
+
+		if (it != m_fileIds.end()) {
+			fileId = it->second;
+		} else {
+			std::string rp = m_filter->mangleSourcePath(file);
+			FileIdMap_t::const_iterator mangledIt = m_mangledFileIds.find(rp);
+
+			// Different paths can mangle to the same file
+			if (mangledIt != m_mangledFileIds.end()) {
+				fileId = mangledIt->second;
+			} else {
+				fileId = m_mangledFiles.size();
+				m_mangledFiles.push_back(rp);
+				m_mangledFileIds[rp] = fileId;
+			}
+			m_fileIds[file] = fileId;
+		}
+
+		m_lastFile = file;
+		m_lastFileId = fileId;
+
+		return fileId;
 	}
 
 
@@ -585,6 +853,10 @@ private:
 
 	SegmentList_t m_curSegments;
 	SegmentList_t m_executableSegments;
+	SegmentList_t m_dataSegments;
+	std::vector<uint64_t> m_landingPads;
+	LoadedSegmentMap_t m_loadedSegments; // By relocated start address
+	MappedFileMap_t m_mappedFiles;
 	FileList_t m_gcnoFiles;
 
 	IDisassembler &m_addressVerifier;
@@ -603,6 +875,15 @@ private:
 	bool m_initialized;
 	uint64_t m_relocation;
 	uint32_t m_invalidBreakpoints;
+	enum Granularity m_granularity;
+	LineAddressMap_t m_lineAddresses;
+
+	// Dense IDs of the (mangled) source files
+	FileIdMap_t m_fileIds;
+	FileIdMap_t m_mangledFileIds;
+	FileList_t m_mangledFiles;
+	std::string m_lastFile;
+	int m_lastFileId;
 
 	/***** Add strings to update path information. *******/
 	std::string m_origRoot;
@@ -4,8 +4,26 @@
 
 #include <elfutils/libdw.h>
 
+#include <map>
+#include <algorithm>
+
 using namespace kcov;
 
+// Pointer encodings in .eh_frame and .gcc_except_table
+#define EH_PE_ABSPTR      0x00
+#define EH_PE_ULEB128     0x01
+#define EH_PE_UDATA2      0x02
+#define EH_PE_UDATA4      0x03
+#define EH_PE_UDATA8      0x04
+#define EH_PE_SLEB128     0x09
+#define EH_PE_SDATA2      0x0a
+#define EH_PE_SDATA4      0x0b
+#define EH_PE_SDATA8      0x0c
+#define EH_PE_PCREL       0x10
+#define EH_PE_FORMAT_MASK 0x0f
+#define EH_PE_APPLY_MASK  0x70
+#define EH_PE_OMIT        0xff
+
 class ElfImpl : public IElf
 {
 public:
@@ -47,6 +65,16 @@ public:
 		return m_segments;
 	}
 
+	virtual const std::vector<Segment> &getDataSegments()
+	{
+		return m_dataSegments;
+	}
+
+	virtual const std::vector<uint64_t> &getLandingPads()
+	{
+		return m_landingPads;
+	}
+
 	virtual void *getRawData(size_t &sz)
 	{
 		sz = m_fileSize;
@@ -54,7 +82,176 @@ public:
 	}
 
 private:
+	// A section in the file data, only valid while parsing
+	class RawSection
+	{
+	public:
+		RawSection(const void *data = NULL, size_t size = 0, uint64_t address = 0) :
+			m_data((const uint8_t *)data), m_size(size), m_address(address)
+		{
+		}
+
+		bool contains(uint64_t address) const
+		{
+			return m_data && address >= m_address && address < m_address + m_size;
+		}
+
+		const uint8_t *m_data;
+		size_t m_size;
+		uint64_t m_address;
+	};
+
+	// Reads (little-endian) DWARF exception handling data from a section
+	class EhReader
+	{
+	public:
+		EhReader(const RawSection &section, size_t offset, unsigned int pointerSize) :
+			m_section(section), m_offset(offset), m_pointerSize(pointerSize),
+			m_ok(offset <= section.m_size)
+		{
+		}
+
+		bool ok() const
+		{
+			return m_ok;
+		}
+
+		size_t getOffset() const
+		{
+			return m_offset;
+		}
+
+		uint64_t readUnsigned(unsigned int bytes)
+		{
+			uint64_t out = 0;
+
+			if (!m_ok || m_section.m_size - m_offset < bytes) {
+				m_ok = false;
+				return 0;
+			}
+
+			for (unsigned int i = 0; i < bytes; i++)
+				out |= (uint64_t)m_section.m_data[m_offset + i] << (i * 8);
+			m_offset += bytes;
+
+			return out;
+		}
+
+		uint64_t readUleb128()
+		{
+			uint64_t out = 0;
+			unsigned int shift = 0;
+			uint8_t byte;
+
+			do {
+				byte = readUnsigned(1);
+				if (shift < 64)
+					out |= (uint64_t)(byte & 0x7f) << shift;
+				shift += 7;
+			} while (m_ok && (byte & 0x80));
+
+			return out;
+		}
+
+		int64_t readSleb128()
+		{
+			uint64_t out = 0;
+			unsigned int shift = 0;
+			uint8_t byte;
+
+			do {
+				byte = readUnsigned(1);
+				if (shift < 64)
+					out |= (uint64_t)(byte & 0x7f) << shift;
+				shift += 7;
+			} while (m_ok && (byte & 0x80));
+
+			if (shift < 64 && (byte & 0x40))
+				out |= ~0ULL << shift;
+
+			return (int64_t)out;
+		}
+
+		const char *readString()
+		{
+			const char *out = (const char *)m_section.m_data + m_offset;
+
+			while (m_ok && readUnsigned(1) != 0)
+				;
+
+			return m_ok ? out : NULL;
+		}
+
+		// Only absolute and pc-relative values are used for code addresses
+		uint64_t readEncoded(uint8_t encoding)
+		{
+			uint64_t address = m_section.m_address + m_offset;
+			uint64_t out;
+
+			switch (encoding & EH_PE_FORMAT_MASK) {
+			case EH_PE_ABSPTR:
+				out = readUnsigned(m_pointerSize);
+				break;
+			case EH_PE_ULEB128:
+				out = readUleb128();
+				break;
+			case EH_PE_UDATA2:
+				out = readUnsigned(2);
+				break;
+			case EH_PE_UDATA4:
+				out = readUnsigned(4);
+				break;
+			case EH_PE_UDATA8:
+			case EH_PE_SDATA8:
+				out = readUnsigned(8);
+				break;
+			case EH_PE_SLEB128:
+				out = readSleb128();
+				break;
+			case EH_PE_SDATA2:
+				out = (int16_t)readUnsigned(2);
+				break;
+			case EH_PE_SDATA4:
+				out = (int32_t)readUnsigned(4);
+				break;
+			default:
+				m_ok = false;
+				return 0;
+			}
+
+			if ((encoding & EH_PE_APPLY_MASK) == EH_PE_PCREL)
+				out += address;
+			else if ((encoding & EH_PE_APPLY_MASK) != 0)
+				m_ok = false;
+
+			if (m_pointerSize == 4)
+				out &= 0xffffffffULL;
+
+			return out;
+		}
+
+	private:
+		const RawSection &m_section;
+		size_t m_offset;
+		unsigned int m_pointerSize;
+		bool m_ok;
+	};
+
+	class Cie
+	{
+	public:
+		Cie() :
+			m_valid(false), m_fdeEncoding(EH_PE_ABSPTR), m_lsdaEncoding(EH_PE_OMIT)
+		{
+		}
+
+		bool m_valid;
+		uint8_t m_fdeEncoding;
+		uint8_t m_lsdaEncoding;
+	};
+
 	typedef std::vector<std::string> FileList_t;
+	typedef std::map<size_t, Cie> CieMap_t; // By offset in .eh_frame
 
 	bool parse()
 	{
@@ -65,6 +262,9 @@ private:
 		size_t shstrndx;
 		bool ret = false;
 		bool doScanForGcda = IConfiguration::getInstance().keyAsInt("gcov");
+		bool doScanForBlockEntries = IConfiguration::getInstance().keyAsInt("basic-blocks");
+		RawSection ehFrame;
+		RawSection exceptTable;
 		unsigned int i;
 		char *raw;
 		size_t sz;
@@ -206,10 +406,20 @@ private:
 				m_debugLinkValid = true;
 			}
 
+			if (doScanForBlockEntries) {
+				if (strcmp(name, ".eh_frame") == 0)
+					ehFrame = RawSection(data->d_buf, data->d_size, sh_addr);
+				else if (strcmp(name, ".gcc_except_table") == 0)
+					exceptTable = RawSection(data->d_buf, data->d_size, sh_addr);
+				else if (sh_type == SHT_PROGBITS &&
+						(sh_flags & (SHF_ALLOC | SHF_WRITE | SHF_EXECINSTR)) == SHF_ALLOC)
+					m_dataSegments.push_back(Segment(m_fileData + sh_offset, sh_addr, sh_addr, sh_size, sh_offset));
+			}
+
 			if ((sh_flags & (SHF_EXECINSTR | SHF_ALLOC)) != (SHF_EXECINSTR | SHF_ALLOC))
 				continue;
 
-			Segment seg(m_fileData + sh_offset, sh_addr, sh_addr, sh_size);
+			Segment seg(m_fileData + sh_offset, sh_addr, sh_addr, sh_size, sh_offset);
 
 			m_segments.push_back(seg);
 		}
@@ -229,6 +439,9 @@ private:
 				m_gcnoFiles.push_back(gcno);
 		}
 
+		if (doScanForBlockEntries)
+			parseLandingPads(ehFrame, exceptTable, elfIs32Bit ? 4 : 8);
+
 		ret = true;
 
 out_elf_begin:
@@ -237,12 +450,155 @@ out_elf_begin:
 		return ret;
 	}
 
+	/*
+	 * Landing pads are entered by the unwinder, not from the code before
+	 * them. The FDEs in .eh_frame point to the LSDA of each function in
+	 * .gcc_except_table, which lists the landing pads of its call sites.
+	 */
+	void parseLandingPads(const RawSection &ehFrame, const RawSection &exceptTable, unsigned int pointerSize)
+	{
+		CieMap_t cies;
+		size_t offset = 0;
+
+		if (!ehFrame.m_data || !exceptTable.m_data)
+			return;
+
+		while (offset < ehFrame.m_size) {
+			EhReader reader(ehFrame, offset, pointerSize);
+			uint64_t length = reader.readUnsigned(4);
+
+			// The terminator
+			if (length == 0)
+				break;
+			if (length == 0xffffffffULL)
+				length = reader.readUnsigned(8);
+
+			size_t idOffset = reader.getOffset();
+			uint64_t id = reader.readUnsigned(4);
+
+			if (!reader.ok() || length > ehFrame.m_size - idOffset)
+				break;
+			offset = idOffset + length;
+
+			// A CIE, parsed when an FDE refers to it
+			if (id == 0 || id > idOffset)
+				continue;
+
+			CieMap_t::iterator it = cies.find(idOffset - id);
+			if (it == cies.end())
+				it = cies.insert(CieMap_t::value_type(idOffset - id, parseCie(ehFrame, idOffset - id, pointerSize))).first;
+
+			const Cie &cie = it->second;
+			if (!cie.m_valid || cie.m_lsdaEncoding == EH_PE_OMIT)
+				continue;
+
+			uint64_t start = reader.readEncoded(cie.m_fdeEncoding);
+			reader.readEncoded(cie.m_fdeEncoding & EH_PE_FORMAT_MASK); // The range
+			reader.readUleb128(); // Augmentation data length
+			uint64_t lsda = reader.readEncoded(cie.m_lsdaEncoding);
+
+			if (reader.ok() && exceptTable.contains(lsda))
+				parseLsda(exceptTable, lsda - exceptTable.m_address, start, pointerSize);
+		}
+
+		std::sort(m_landingPads.begin(), m_landingPads.end());
+		m_landingPads.erase(std::unique(m_landingPads.begin(), m_landingPads.end()),
+				m_landingPads.end());
+	}
+
+	Cie parseCie(const RawSection &ehFrame, size_t offset, unsigned int pointerSize)
+	{
+		EhReader reader(ehFrame, offset, pointerSize);
+		Cie out;
+
+		if (reader.readUnsigned(4) == 0xffffffffULL)
+			reader.readUnsigned(8);
+		if (reader.readUnsigned(4) != 0)
+			return out;
+
+		uint8_t version = reader.readUnsigned(1);
+		const char *augmentation = reader.readString();
+
+		if (!augmentation)
+			return out;
+
+		if (strstr(augmentation, "eh"))
+			reader.readUnsigned(pointerSize);
+		reader.readUleb128(); // Code alignment
+		reader.readSleb128(); // Data alignment
+		if (version == 1)
+			reader.readUnsigned(1); // Return address register
+		else
+			reader.readUleb128();
+
+		if (augmentation[0] != 'z') {
+			out.m_valid = reader.ok();
+			return out;
+		}
+
+		reader.readUleb128(); // Augmentation data length
+		for (const char *p = augmentation + 1; *p; p++) {
+			switch (*p) {
+			case 'L':
+				out.m_lsdaEncoding = reader.readUnsigned(1);
+				break;
+			case 'R':
+				out.m_fdeEncoding = reader.readUnsigned(1);
+				break;
+			case 'P':
+				// The personality routine, not needed
+				reader.readEncoded(reader.readUnsigned(1) & EH_PE_FORMAT_MASK);
+				break;
+			case 'S':
+			case 'B':
+				break;
+			default:
+				// Unknown augmentation data
+				return out;
+			}
+		}
+		out.m_valid = reader.ok();
+
+		return out;
+	}
+
+	void parseLsda(const RawSection &exceptTable, size_t offset, uint64_t functionStart, unsigned int pointerSize)
+	{
+		EhReader reader(exceptTable, offset, pointerSize);
+		uint64_t landingPadBase = functionStart;
+
+		uint8_t landingPadBaseEncoding = reader.readUnsigned(1);
+		if (landingPadBaseEncoding != EH_PE_OMIT)
+			landingPadBase = reader.readEncoded(landingPadBaseEncoding);
+
+		uint8_t typeTableEncoding = reader.readUnsigned(1);
+		if (typeTableEncoding != EH_PE_OMIT)
+			reader.readUleb128(); // Type table offset
+
+		// The call site table holds offsets, so only the format matters
+		uint8_t callSiteEncoding = reader.readUnsigned(1) & EH_PE_FORMAT_MASK;
+		uint64_t callSiteTableSize = reader.readUleb128();
+		size_t end = reader.getOffset() + callSiteTableSize;
+
+		while (reader.ok() && reader.getOffset() < end) {
+			reader.readEncoded(callSiteEncoding); // Call site start
+			reader.readEncoded(callSiteEncoding); // ... and length
+			uint64_t landingPad = reader.readEncoded(callSiteEncoding);
+			reader.readUleb128(); // Action
+
+			if (reader.ok() && landingPad != 0)
+				m_landingPads.push_back(landingPadBase + landingPad);
+		}
+	}
+
 	std::vector<std::string> m_gcnoFiles;
 	std::vector<std::string> m_gcdaFiles;
 	std::string m_buildId;
 	bool m_debugLinkValid;
 	std::pair<std::string, uint32_t> m_debugLink;
 	std::vector<Segment> m_segments;
+	std::vector<Segment> m_dataSegments;
+	std::vector<uint64_t> m_landingPads;
 
 	char *m_fileData;
 	size_t m_fileSize;
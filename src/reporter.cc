@@ -10,16 +10,33 @@
 #include <list>
 #include <unordered_map>
 #include <functional>
+#include <algorithm>
 #include <map>
 #include <fstream>
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "swap-endian.hh"
 
 using namespace kcov;
 
 #define KCOV_MAGIC      0x6b636f76 /* "kcov" */
-#define KCOV_DB_VERSION 6
+#define KCOV_DB_VERSION 7
+#define KCOV_DB_SNAPSHOT_VERSION 6 // v7 without a journal, still readable
+
+#define DB_COMPACT_MIN_ENTRIES 1024 // Journal entries before compacting
 
+#define NO_ENTRY 0xffffffffU // Address or line index
+
+/*
+ * coverage.db: The header, followed by (address, line ID, index, hits)
+ * entries. The hits are added when loading, so new hits can be appended
+ * to the file (the journal) without rewriting it.
+ */
 struct marshalHeaderStruct
 {
 	uint32_t magic;
@@ -27,6 +44,13 @@ struct marshalHeaderStruct
 	uint64_t checksum;
 };
 
+/*
+ * The coverage data is kept in columns rather than in objects per line:
+ * Addresses (with hits and the line they belong to) and lines (with the
+ * line ID, hits and the order of the first hit) are indexed by the order
+ * they were added. Each file maps line numbers to line indices, and a
+ * sorted index is used for lookups by address.
+ */
 class Reporter :
 		public IReporter,
 		public IFileParser::ILineListener,
@@ -36,10 +60,17 @@ class Reporter :
 {
 public:
 	Reporter(IFileParser &fileParser, ICollector &collector, IFilter &filter) :
+		m_nrFiles(0),
+		m_lastAddress(NO_ENTRY),
+		m_nrLines(0), m_executedLines(0),
 		m_fileParser(fileParser), m_collector(collector), m_filter(filter),
+		m_filterCache(filter),
 		m_maxPossibleHits(fileParser.maxPossibleHits()),
 		m_unmarshallingDone(false),
-		m_order(1) // "First" hit - 0 marks unset
+		m_dbCompacted(false), m_dbSnapshotEntries(0), m_dbJournalEntries(0),
+		m_order(1), // "First" hit - 0 marks unset
+		m_snapshot(*this),
+		m_linesChanged(true), m_hitsChanged(true)
 	{
 		m_fileParser.registerLineListener(*this);
 		m_fileParser.registerFileListener(*this);
@@ -78,10 +109,12 @@ public:
 		FileMap_t::iterator it = m_files.find(file);
 
 		// Not code if the file doesn't exist!
-		if (it == m_files.end())
+		if (it == m_files.end() || !it->second)
 			return false;
 
-		return it->second->lineIsCode(lineNr);
+		uint32_t line = it->second->getLine(lineNr);
+
+		return line != NO_ENTRY && !m_lineUnreachable[line];
 	}
 
 	LineExecutionCount getLineExecutionCount(const std::string &file, unsigned int lineNr)
@@ -92,13 +125,15 @@ public:
 
 		FileMap_t::const_iterator it = m_files.find(file);
 
-		if (it != m_files.end()) {
-			const Line *line = it->second->getLine(lineNr);
+		if (it != m_files.end() && it->second) {
+			uint32_t line = it->second->getLine(lineNr);
 
-			if (line && !line->isUnreachable()) {
-				hits = line->hits();
-				possibleHits = line->possibleHits(m_maxPossibleHits != IFileParser::HITS_UNLIMITED);
-				order = line->getOrder();
+			if (line != NO_ENTRY && !m_lineUnreachable[line]) {
+				hits = m_lineHits[line];
+				// 0 means any number of hits are possible
+				if (m_maxPossibleHits != IFileParser::HITS_UNLIMITED)
+					possibleHits = m_lineAddressCount[line];
+				order = m_lineOrder[line];
 			}
 		}
 
@@ -107,34 +142,24 @@ public:
 
 	ExecutionSummary getExecutionSummary()
 	{
-		unsigned int executedLines = 0;
-		unsigned int nrLines = 0;
-
-		// Summarize all files
-		for (FileMap_t::const_iterator it = m_files.begin();
-				it != m_files.end();
-				++it) {
-			const std::string &fileName = it->first;
-			const File *file = it->second;
-
-			// Don't include non-existing files in summary
-			if (!file_exists(fileName))
-				continue;
-
-			// And not filtered ones either
-			if (!m_filter.runFilters(fileName))
-				continue;
-
-			executedLines += file->getExecutedLines();
-			nrLines += file->getNrLines();
-		}
-
-		return ExecutionSummary(nrLines, executedLines);
+		// Kept up to date as lines are added and hit
+		return ExecutionSummary(m_nrLines, m_executedLines);
 	}
 
 	void *marshal(size_t *szOut)
 	{
-		size_t sz = getMarshalSize();
+		size_t n = 0;
+
+		for (uint32_t i = 0; i < m_addresses.size(); i++) {
+			if (m_addressHits[i])
+				n++;
+		}
+		for (PendingFilesMap_t::const_iterator it = m_pendingFiles.begin();
+				it != m_pendingFiles.end();
+				++it)
+			n += it->second.size();
+
+		size_t sz = n * getMarshalEntrySize() + sizeof(struct marshalHeaderStruct);
 		void *start;
 		uint8_t *p;
 
@@ -144,13 +169,32 @@ public:
 		memset(start, 0, sz);
 		p = marshalHeader((uint8_t *)start);
 
-		// Marshal all lines in the files
-		for (FileMap_t::const_iterator it = m_files.begin();
-				it != m_files.end();
-				++it) {
-			const File *cur = it->second;
+		// Marshal all addresses with hits
+		uint64_t *data = (uint64_t *)p;
+		for (uint32_t i = 0; i < m_addresses.size(); i++) {
+			// No hits? Ignore if so
+			if (!m_addressHits[i])
+				continue;
 
-			p = cur->marshal(p, *this);
+			// Address, line ID, index in the line and number of hits
+			*data++ = to_be<uint64_t>(m_addresses[i]);
+			*data++ = to_be<uint64_t>(m_lineIds[m_addressLine[i]]);
+			*data++ = to_be<uint64_t>(getAddressIndex(i));
+			*data++ = to_be<uint64_t>(m_addressHits[i]);
+		}
+
+		// Keep hits in shared libraries which haven't been loaded in this run
+		for (PendingFilesMap_t::const_iterator it = m_pendingFiles.begin();
+				it != m_pendingFiles.end();
+				++it) {
+			for (PendingHitsList_t::const_iterator fit = it->second.begin();
+					fit != it->second.end();
+					++fit) {
+				*data++ = to_be<uint64_t>(fit->m_addr);
+				*data++ = to_be<uint64_t>(it->first);
+				*data++ = to_be<uint64_t>(fit->m_index);
+				*data++ = to_be<uint64_t>(fit->m_hits);
+			}
 		}
 
 		*szOut = sz;
@@ -164,6 +208,9 @@ public:
 		uint8_t *p = start;
 		size_t n;
 
+		if (sz < sizeof(struct marshalHeaderStruct))
+			return false;
+
 		p = unMarshalHeader(p);
 
 		if (!p)
@@ -177,13 +224,11 @@ public:
 			uint64_t hits;
 			uint64_t addrIndex;
 
-			p = Line::unMarshal(p, &addr, &hits, &fileHash, &addrIndex);
+			p = unMarshalEntry(p, &addr, &hits, &fileHash, &addrIndex);
 
 			if (!hits)
 				continue;
 
-			AddrToLineMap_t::iterator it = m_addrToLine.find(addr);
-
 			/*
 			 * Can't find this file/line
 			 *
@@ -194,17 +239,17 @@ public:
 			 * Typically because it's in a shared library, which hasn't been
 			 * loaded yet.
 			 */
-			if (it == m_addrToLine.end()) {
-				LineIdToFileMap_t::iterator lit = m_lineIdToFileMap.find(fileHash);
+			if (lookupAddress(addr) == NO_ENTRY) {
+				uint32_t line = lookupLineId(fileHash);
 
-				if (lit == m_lineIdToFileMap.end()) {
+				if (line == NO_ENTRY) {
 					// No line ID (shared library?). Add to pending
-					m_pendingFiles[fileHash].push_back(PendingFileAddress(addrIndex, hits));
+					m_pendingFiles[fileHash].push_back(PendingFileAddress(addr, addrIndex, hits));
 				} else {
 					// line ID exists, but not address (PIEs etc)
-					reportAddress(fileHash, hits);
+					reportLine(line, hits);
 
-					lit->second->registerHitIndex(addrIndex, hits, m_maxPossibleHits != IFileParser::HITS_UNLIMITED);
+					registerHitIndex(line, addrIndex, hits);
 				}
 
 				continue;
@@ -219,34 +264,135 @@ public:
 
 	virtual void writeCoverageDatabase()
 	{
-		size_t sz;
-		void *data = marshal(&sz);
+		// Rewrite the database once per run and when the journal grows large
+		if (!m_dbCompacted ||
+				m_dbJournalEntries > std::max(m_dbSnapshotEntries, (size_t)DB_COMPACT_MIN_ENTRIES)) {
+			compactCoverageDatabase();
+			return;
+		}
+
+		appendCoverageDatabase();
+	}
 
-		if (data)
-			write_file(data, sz, "%s", m_dbFileName.c_str());
+	void takeSnapshot()
+	{
+		// Line numbers and addresses, which change when files are parsed
+		if (m_linesChanged) {
+			m_snapshot.m_files.clear();
+			for (FileMap_t::const_iterator it = m_files.begin();
+					it != m_files.end();
+					++it)
+				m_snapshot.m_files[it->first] = it->second->m_lines;
 
-		free(data);
+			m_snapshot.m_lineUnreachable = m_lineUnreachable;
+			m_snapshot.m_lineAddressCount = m_lineAddressCount;
+			m_linesChanged = false;
+		}
+
+		// Copied into the same buffers every time
+		if (m_hitsChanged) {
+			m_snapshot.m_lineHits = m_lineHits;
+			m_snapshot.m_lineOrder = m_lineOrder;
+			m_snapshot.m_summary = ExecutionSummary(m_nrLines, m_executedLines);
+			m_hitsChanged = false;
+		}
+	}
+
+	IReporter &getSnapshot()
+	{
+		return m_snapshot;
 	}
 
 
 private:
+	class File;
+
 	size_t getMarshalEntrySize()
 	{
 		return 4 * sizeof(uint64_t);
 	}
 
-	size_t getMarshalSize()
+	void compactCoverageDatabase()
 	{
-		size_t out = 0;
+		size_t sz;
+		void *data = marshal(&sz);
 
-		// Sum all file sizes
-		for (FileMap_t::const_iterator it = m_files.begin();
-				it != m_files.end();
-				++it) {
-			out += it->second->marshalSize();
+		if (!data)
+			return;
+
+		// Replace the old database atomically, so a crash leaves one of them
+		std::string tmpName = m_dbFileName + ".tmp";
+
+		if (write_file(data, sz, "%s", tmpName.c_str()) == 0 &&
+				rename(tmpName.c_str(), m_dbFileName.c_str()) == 0) {
+			for (uint32_t i = 0; i < m_dirtyAddresses.size(); i++) {
+				uint32_t address = m_dirtyAddresses[i];
+
+				m_addressFlushedHits[address] = m_addressHits[address];
+			}
+			m_dirtyAddresses.clear();
+
+			m_dbCompacted = true;
+			m_dbSnapshotEntries = (sz - sizeof(struct marshalHeaderStruct)) / getMarshalEntrySize();
+			m_dbJournalEntries = 0;
+		}
+
+		free(data);
+	}
+
+	// Append the hits since the last write
+	void appendCoverageDatabase()
+	{
+		if (m_dirtyAddresses.empty())
+			return;
+
+		std::vector<uint64_t> data;
+
+		data.reserve(m_dirtyAddresses.size() * 4);
+		for (uint32_t i = 0; i < m_dirtyAddresses.size(); i++) {
+			uint32_t address = m_dirtyAddresses[i];
+
+			// Pending hits from the database, now on a loaded address
+			if (m_addressHits[address] == m_addressFlushedHits[address])
+				continue;
+
+			data.push_back(to_be<uint64_t>(m_addresses[address]));
+			data.push_back(to_be<uint64_t>(m_lineIds[m_addressLine[address]]));
+			data.push_back(to_be<uint64_t>(getAddressIndex(address)));
+			data.push_back(to_be<uint64_t>(m_addressHits[address] - m_addressFlushedHits[address]));
+		}
+
+		if (data.empty()) {
+			m_dirtyAddresses.clear();
+			return;
 		}
 
-		return out * getMarshalEntrySize() + sizeof(struct marshalHeaderStruct);
+		int fd = open(m_dbFileName.c_str(), O_WRONLY | O_APPEND);
+
+		if (fd < 0) {
+			// Removed behind our back?
+			compactCoverageDatabase();
+			return;
+		}
+
+		size_t sz = data.size() * sizeof(uint64_t);
+		ssize_t r = write(fd, data.data(), sz);
+
+		close(fd);
+
+		// Partial entries are ignored when loading, rewrite everything next time
+		if (r != (ssize_t)sz) {
+			m_dbCompacted = false;
+			return;
+		}
+
+		for (uint32_t i = 0; i < m_dirtyAddresses.size(); i++) {
+			uint32_t address = m_dirtyAddresses[i];
+
+			m_addressFlushedHits[address] = m_addressHits[address];
+		}
+		m_dbJournalEntries += data.size() / 4;
+		m_dirtyAddresses.clear();
 	}
 
 	uint8_t *marshalHeader(uint8_t *p)
@@ -267,7 +413,9 @@ private:
 		if (be_to_host<uint32_t>(hdr->magic) != KCOV_MAGIC)
 			return NULL;
 
-		if (be_to_host<uint32_t>(hdr->db_version) != KCOV_DB_VERSION)
+		uint32_t version = be_to_host<uint32_t>(hdr->db_version);
+
+		if (version != KCOV_DB_VERSION && version != KCOV_DB_SNAPSHOT_VERSION)
 			return NULL;
 
 		if (be_to_host<uint64_t>(hdr->checksum) != m_fileParser.getChecksum())
@@ -276,15 +424,49 @@ private:
 		return p + sizeof(struct marshalHeaderStruct);
 	}
 
+	static uint8_t *unMarshalEntry(uint8_t *p,
+			uint64_t *outAddr, uint64_t *outHits, uint64_t *outFileHash,
+			uint64_t *outIndex)
+	{
+		uint64_t *data = (uint64_t *)p;
+
+		*outAddr = be_to_host<uint64_t>(*data++);
+		*outFileHash = be_to_host<uint64_t>(*data++);
+		*outIndex = be_to_host<uint64_t>(*data++);
+		*outHits = be_to_host<uint64_t>(*data++);
+
+		return (uint8_t *)data;
+	}
+
 	/* Called when the file is parsed */
 	void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
 	{
 		if (!m_filter.runFilters(file))
 			return;
 
-		kcov_debug(INFO_MSG, "REPORT %s:%u at 0x%lx\n",
-				file.c_str(), lineNr, (unsigned long)addr);
+		addFileLine(getFile(file), file, lineNr, addr);
+	}
+
+	// Likewise, from parsers with file IDs
+	void onFileLine(const std::string &file, unsigned int fileId,
+			unsigned int lineNr, uint64_t addr)
+	{
+		if (!m_filterCache.runFilters(fileId, file))
+			return;
+
+		if (fileId >= m_filesByParserId.size())
+			m_filesByParserId.resize(fileId + 1, NULL);
+
+		File *&fp = m_filesByParserId[fileId];
 
+		if (!fp)
+			fp = &getFile(file);
+
+		addFileLine(*fp, file, lineNr, addr);
+	}
+
+	File &getFile(const std::string &file)
+	{
 		File *fp = m_files[file];
 
 		if (!fp) {
@@ -310,37 +492,42 @@ private:
 			}
 
 
-			fp = new File(hash);
+			fp = new File(hash, m_nrFiles++);
+
+			// Don't include non-existing or filtered files in the summary
+			fp->m_inSummary = file_exists(file) && m_filter.runFilters(file);
 
 			// Mark unreachable lines separately (often none)
 			const std::vector<std::string> &lines = ISourceFileCache::getInstance().getLines(file);
 			for (unsigned int nr = 1; nr <= lines.size(); nr++) {
-				if (!m_filter.runLineFilters(file, lineNr, lines[nr - 1])) {
-					Line *line = new Line(fp->getFileHash(), nr, true);
-
-					fp->addLine(nr, line);
-				}
+				if (!m_filter.runLineFilters(file, nr, lines[nr - 1]))
+					addLine(*fp, nr, true);
 			}
 
 			m_files[file] = fp;
+			m_filesByHash[(uint32_t)hash] = fp;
 		}
 
-		Line *line = fp->getLine(lineNr);
+		return *fp;
+	}
 
-		if (!line) {
+	void addFileLine(File &fp, const std::string &file, unsigned int lineNr, uint64_t addr)
+	{
+		kcov_debug(INFO_MSG, "REPORT %s:%u at 0x%lx\n",
+				file.c_str(), lineNr, (unsigned long)addr);
 
-			line = new Line(fp->getFileHash(), lineNr);
-			fp->addLine(lineNr, line);
-		}
+		uint32_t line = fp.getLine(lineNr);
 
-		uint64_t lineId = line->lineId();
+		if (line == NO_ENTRY)
+			line = addLine(fp, lineNr, false);
 
-		line->addAddress(addr);
-		m_addrToLine[addr] = line;
-		m_lineIdToFileMap[lineId] = line;
+		uint64_t lineId = m_lineIds[line];
+
+		// For onBreakpoint, which follows
+		m_lastAddress = addAddress(line, addr);
 
 		// Report pending addresses for this file/line
-		PendingFilesMap_t::const_iterator it = m_pendingFiles.find(lineId);
+		PendingFilesMap_t::iterator it = m_pendingFiles.find(lineId);
 		if (it != m_pendingFiles.end()) {
 			for (PendingHitsList_t::const_iterator fit = it->second.begin();
 					fit != it->second.end();
@@ -349,19 +536,23 @@ private:
 				unsigned long hits = val.m_hits;
 				uint64_t index = val.m_index;
 
-				reportAddress(lineId, hits);
+				reportLine(line, hits);
+
+				uint32_t address = registerHitIndex(line, index, hits);
 
-				line->registerHitIndex(index, hits, m_maxPossibleHits != IFileParser::HITS_UNLIMITED);
+				// Already in the database if it has been rewritten since loading
+				if (address != NO_ENTRY && m_dbCompacted)
+					m_addressFlushedHits[address] += hits;
 			}
 
 			// Handled now
-			m_pendingFiles[lineId].clear();
+			m_pendingFiles.erase(it);
 		}
 
 		for (ListenerList_t::const_iterator it = m_listeners.begin();
 				it != m_listeners.end();
 				++it)
-				(*it)->onLineReporter(file, lineNr, lineId);
+				(*it)->onLineReporter(file, fp.m_id, lineNr, lineId, line);
 	}
 
 	// Called when a file is added (e.g., a shared library)
@@ -371,50 +562,102 @@ private:
 		if (m_unmarshallingDone)
 			return;
 
-		void *data;
-		size_t sz;
+		m_unmarshallingDone = true;
 
-		data = read_file(&sz, "%s", m_dbFileName.c_str());
+		int fd = open(m_dbFileName.c_str(), O_RDONLY);
+		struct stat st;
 
-		if (data && !unMarshal(data, sz))
-			kcov_debug(INFO_MSG, "Can't unmarshal %s\n", m_dbFileName.c_str());
+		if (fd < 0)
+			return;
 
-		m_unmarshallingDone = true;
+		if (fstat(fd, &st) < 0 || st.st_size == 0) {
+			close(fd);
+			return;
+		}
 
-		free(data);
+		void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		close(fd);
+		if (data == MAP_FAILED)
+			return;
+
+		if (!unMarshal(data, st.st_size))
+			kcov_debug(INFO_MSG, "Can't unmarshal %s\n", m_dbFileName.c_str());
+
+		munmap(data, st.st_size);
 	}
 
 	/* Called during runtime */
-	void reportAddress(uint64_t lineHash, unsigned long hits)
+	void reportLine(uint32_t line, unsigned long hits)
 	{
 		// Report the line hash (losing partial hit info from now on, but
 		// that's only for the merge-reporter anyway)
 		for (ListenerList_t::const_iterator it = m_listeners.begin();
 				it != m_listeners.end();
 				++it)
-			(*it)->onAddress(lineHash, hits);
+			(*it)->onLineHit(line, m_lineIds[line], hits);
+	}
+
+	void addressHit(uint32_t address, unsigned long hits)
+	{
+		uint32_t line = m_addressLine[address];
+
+		if (m_maxPossibleHits != IFileParser::HITS_UNLIMITED)
+			setAddressHits(address, 1);
+		else
+			setAddressHits(address, m_addressHits[address] + hits);
+
+		// Setup the hit order
+		if (m_lineOrder[line] == 0) {
+			m_lineOrder[line] = m_order;
+			m_order++;
+			m_hitsChanged = true;
+		}
+
+		reportLine(line, hits);
 	}
 
 	// From ICollector::IListener
 	void onAddressHit(uint64_t addr, unsigned long hits)
 	{
-		AddrToLineMap_t::iterator it = m_addrToLine.find(addr);
+		uint32_t address = lookupAddress(addr);
 
-		if (it == m_addrToLine.end())
+		if (address == NO_ENTRY)
 			return;
 
 		kcov_debug(INFO_MSG, "REPORT hit at 0x%llx\n", (unsigned long long)addr);
-		Line *line = it->second;
+		addressHit(address, hits);
+	}
 
-		line->registerHit(addr, hits, m_maxPossibleHits != IFileParser::HITS_UNLIMITED);
+	// From ICollector::IListener, called after onLine for the address
+	void onBreakpoint(unsigned int id, uint64_t addr)
+	{
+		uint32_t address = m_lastAddress;
 
-		// Setup the hit order
-		if (line->getOrder() == 0) {
-			line->setOrder(m_order);
-			m_order++;
+		if (address == NO_ENTRY || m_addresses[address] != addr)
+			address = lookupAddress(addr);
+
+		// Filtered out
+		if (address == NO_ENTRY)
+			return;
+
+		if (id >= m_breakpoints.size())
+			m_breakpoints.resize(id + 1, NO_ENTRY);
+
+		m_breakpoints[id] = address;
+	}
+
+	// From ICollector::IListener
+	void onBreakpointHit(unsigned int id, uint64_t addr, unsigned long hits)
+	{
+		// Not from onBreakpoint?
+		if (id >= m_breakpoints.size() || m_breakpoints[id] == NO_ENTRY ||
+				m_addresses[m_breakpoints[id]] != addr) {
+			onAddressHit(addr, hits);
+			return;
 		}
 
-		reportAddress(line->lineId(), hits);
+		addressHit(m_breakpoints[id], hits);
 	}
 
 	// From IReporter::IListener - report recursively
@@ -422,329 +665,365 @@ private:
 	{
 	}
 
-	class Line
+	uint32_t addLine(File &file, unsigned int lineNr, bool unreachable)
 	{
-	public:
-		// More efficient than an unordered_map
-		typedef std::vector<std::pair<uint64_t, int>> AddrToHitsMap_t;
+		uint32_t line = m_lineIds.size();
+
+		m_lineIds.push_back((file.m_fileHash << 32ULL) | lineNr);
+		m_lineHits.push_back(0);
+		m_lineOrder.push_back(0);
+		m_lineAddressCount.push_back(0);
+		m_lineFirstAddress.push_back(NO_ENTRY);
+		m_lineUnreachable.push_back(unreachable);
+		m_lineFile.push_back(&file);
+		m_linesChanged = true;
+		m_hitsChanged = true;
+
+		file.addLine(lineNr, line);
+		if (!unreachable && file.m_inSummary)
+			m_nrLines++;
+
+		return line;
+	}
 
-		Line(uint64_t fileHash, unsigned int lineNr, bool unreachable = false) :
-			m_lineId((fileHash << 32ULL) | lineNr),
-			m_order(0), m_unreachable(unreachable)
-		{
+	// Returns the address index (the existing one if the line has the address)
+	uint32_t addAddress(uint32_t line, uint64_t addr)
+	{
+		for (uint32_t cur = m_lineFirstAddress[line]; cur != NO_ENTRY; cur = m_addressNext[cur]) {
+			if (m_addresses[cur] == addr)
+				return cur;
 		}
 
-		bool isUnreachable() const
-		{
-			return m_unreachable;
-		}
+		uint32_t address = m_addresses.size();
 
-		uint64_t getOrder() const
-		{
-			return m_order;
-		}
+		m_addresses.push_back(addr);
+		m_addressHits.push_back(0);
+		m_addressFlushedHits.push_back(0);
+		m_addressLine.push_back(line);
+		m_addressNext.push_back(m_lineFirstAddress[line]);
+		m_lineFirstAddress[line] = address;
+		m_lineAddressCount[line]++;
+		m_linesChanged = true;
 
-		void setOrder(uint64_t order)
-		{
-			m_order = order;
-		}
+		return address;
+	}
 
-		void addAddress(uint64_t addr)
-		{
-			// Check if it already exists
-			for (AddrToHitsMap_t::iterator it = m_addrs.begin();
-					it != m_addrs.end();
-					++it) {
-				if (it->first == addr)
-					return;
-			}
+	// The index of an address in its line, in the order they were added
+	uint32_t getAddressIndex(uint32_t address) const
+	{
+		uint32_t out = 0;
 
-			m_addrs.push_back(std::pair<uint64_t, int>(addr, 0));
-		}
+		// Linked from the last one added
+		for (uint32_t cur = m_addressNext[address]; cur != NO_ENTRY; cur = m_addressNext[cur])
+			out++;
 
-		void registerHit(uint64_t addr, unsigned long hits, bool singleShot)
-		{
-			AddrToHitsMap_t::iterator it;
+		return out;
+	}
 
-			for (it = m_addrs.begin();
-					it != m_addrs.end();
-					++it) {
-				if (it->first == addr)
-					break;
-			}
+	// Returns the address index, or NO_ENTRY for broken data
+	uint32_t registerHitIndex(uint32_t line, uint64_t index, unsigned long hits)
+	{
+		// Avoid broken data
+		if (m_lineAddressCount[line] <= index)
+			return NO_ENTRY;
 
-			// Add one last
-			if (it == m_addrs.end()) {
-				m_addrs.push_back(std::pair<uint64_t, int>(addr, 0));
-				--it;
-			}
+		uint32_t address = m_lineFirstAddress[line];
 
-			if (singleShot)
-				it->second = 1;
-			else
-				it->second += hits;
-		}
+		for (uint64_t i = m_lineAddressCount[line] - 1; i > index; i--)
+			address = m_addressNext[address];
 
-		void registerHitIndex(uint64_t index, unsigned long hits, bool singleShot)
-		{
-			// Avoid broken data
-			if (m_addrs.size() <= index)
-				return;
+		setAddressHits(address, m_addressHits[address] + hits);
 
-			m_addrs[index].second += hits;
-		}
+		return address;
+	}
 
-		void clearHits()
-		{
-			for (AddrToHitsMap_t::iterator it = m_addrs.begin();
-					it != m_addrs.end();
-					++it)
-				it->second = 0;
-		}
+	void setAddressHits(uint32_t address, uint32_t hits)
+	{
+		uint32_t before = m_addressHits[address];
 
-		unsigned int hits() const
-		{
-			unsigned int out = 0;
+		if (hits == before)
+			return;
 
-			for (AddrToHitsMap_t::const_iterator it = m_addrs.begin();
-					it != m_addrs.end();
-					++it)
-				out += it->second;
+		// Not already waiting to be written to the database?
+		if (before == m_addressFlushedHits[address])
+			m_dirtyAddresses.push_back(address);
 
-			return out;
-		}
+		m_addressHits[address] = hits;
+		addLineHits(m_addressLine[address], hits - before);
+	}
 
-		unsigned int possibleHits(bool singleShot) const
-		{
-			if (singleShot)
-				return m_addrs.size();
+	// Count the line as executed on the first hit
+	void addLineHits(uint32_t line, uint32_t hits)
+	{
+		bool executed = m_lineHits[line] != 0;
 
-			return 0; // Meaning any number of hits are possible
-		}
+		m_lineHits[line] += hits;
+		m_hitsChanged = true;
+		if (executed || !m_lineHits[line] || m_lineUnreachable[line])
+			return;
 
-		uint64_t lineId() const
-		{
-			return m_lineId;
-		}
+		if (m_lineFile[line]->m_inSummary)
+			m_executedLines++;
+	}
 
-		uint8_t *marshal(uint8_t *start, const Reporter &parent)
-		{
-			uint64_t *data = (uint64_t *)start;
-			unsigned int addrIndex = 0;
-
-			for (AddrToHitsMap_t::const_iterator it = m_addrs.begin();
-					it != m_addrs.end();
-					++it, addrIndex++) {
-				// No hits? Ignore if so
-				if (!it->second)
-					continue;
-
-				uint64_t hash = m_lineId;
-				uint64_t addr = it->first;
-
-				// Address, hash, index and number of hits
-				*data++ = to_be<uint64_t>(addr);
-				*data++ = to_be<uint64_t>(hash);
-				*data++ = to_be<uint64_t>(addrIndex);
-				*data++ = to_be<uint64_t>(it->second);
-			}
+	// Lines with addresses only, like the addresses in the database
+	uint32_t lookupLineId(uint64_t lineId)
+	{
+		FileByHashMap_t::const_iterator it = m_filesByHash.find((uint32_t)(lineId >> 32ULL));
 
-			return (uint8_t *)data;
-		}
+		if (it == m_filesByHash.end())
+			return NO_ENTRY;
 
-		size_t marshalSize() const
-		{
-			unsigned int n = 0;
+		uint32_t line = it->second->getLine((uint32_t)lineId);
 
-			for (AddrToHitsMap_t::const_iterator it = m_addrs.begin();
-					it != m_addrs.end();
-					++it) {
-				// No hits? Ignore if so
-				if (!it->second)
-					continue;
+		if (line == NO_ENTRY || m_lineAddressCount[line] == 0)
+			return NO_ENTRY;
 
-				n++;
-			}
+		return line;
+	}
 
-			// Address, file hash and number of hits (64-bit values)
-			return n * sizeof(uint64_t) * 4;
-		}
+	// The last address added wins if there are duplicates (in different lines)
+	uint32_t lookupAddress(uint64_t addr)
+	{
+		// Addresses added since the last lookup
+		if (m_sortedAddresses.size() != m_addresses.size())
+			sortAddresses();
 
-		static uint8_t *unMarshal(uint8_t *p,
-				uint64_t *outAddr, uint64_t *outHits, uint64_t *outFileHash,
-				uint64_t *outIndex)
-		{
-			uint64_t *data = (uint64_t *)p;
+		std::vector<uint32_t>::const_iterator it = std::upper_bound(m_sortedAddresses.begin(),
+				m_sortedAddresses.end(), addr, AddressCompare(m_addresses));
 
-			*outAddr = be_to_host<uint64_t>(*data++);
-			*outFileHash = be_to_host<uint64_t>(*data++);
-			*outIndex = be_to_host<uint64_t>(*data++);
-			*outHits = be_to_host<uint64_t>(*data++);
+		if (it == m_sortedAddresses.begin() || m_addresses[*(it - 1)] != addr)
+			return NO_ENTRY;
 
-			return (uint8_t *)data;
-		}
+		return *(it - 1);
+	}
 
-	private:
-		AddrToHitsMap_t m_addrs;
-		uint64_t m_lineId;
-		uint64_t m_order;
-		bool m_unreachable;
-	};
+	void sortAddresses()
+	{
+		size_t nSorted = m_sortedAddresses.size();
 
-	class File
+		for (uint32_t i = nSorted; i < m_addresses.size(); i++)
+			m_sortedAddresses.push_back(i);
+
+		// Stable, so equal addresses stay in the order they were added
+		std::stable_sort(m_sortedAddresses.begin() + nSorted, m_sortedAddresses.end(),
+				AddressCompare(m_addresses));
+		std::inplace_merge(m_sortedAddresses.begin(), m_sortedAddresses.begin() + nSorted,
+				m_sortedAddresses.end(), AddressCompare(m_addresses));
+	}
+
+	class AddressCompare
 	{
 	public:
-		File(uint64_t hash) : m_fileHash(hash), m_nrLines(0)
+		AddressCompare(const std::vector<uint64_t> &addresses) :
+			m_addresses(addresses)
 		{
 		}
 
-		~File()
+		bool operator()(uint32_t a, uint32_t b) const
 		{
-			for (unsigned int i = 0; i < m_lines.size(); i++) {
-				Line *cur = m_lines[i];
+			return m_addresses[a] < m_addresses[b];
+		}
 
-				if (!cur)
-					continue;
+		bool operator()(uint64_t addr, uint32_t b) const
+		{
+			return addr < m_addresses[b];
+		}
 
-				delete cur;
-			}
+	private:
+		const std::vector<uint64_t> &m_addresses;
+	};
+
+	class File
+	{
+	public:
+		File(uint64_t hash, unsigned int id) :
+			m_fileHash(hash), m_id(id), m_inSummary(false)
+		{
 		}
 
-		void addLine(unsigned int lineNr, Line *line)
+		void addLine(unsigned int lineNr, uint32_t line)
 		{
 			// Resize the vector to fit this line
 			if (lineNr >= m_lines.size())
-				m_lines.resize(lineNr + 1);
+				m_lines.resize(lineNr + 1, NO_ENTRY);
 
 			m_lines[lineNr] = line;
-			if (!line->isUnreachable())
-				m_nrLines++;
 		}
 
-		Line *getLine(unsigned int lineNr) const
+		uint32_t getLine(unsigned int lineNr) const
 		{
 			if (lineNr >= m_lines.size())
-				return NULL;
+				return NO_ENTRY;
 
 			return m_lines[lineNr];
 		}
 
-		uint64_t getFileHash() const
+		uint64_t m_fileHash;
+		unsigned int m_id; // In the order of addition
+		std::vector<uint32_t> m_lines; // Line number -> line index
+		bool m_inSummary; // Exists and isn't filtered
+	};
+
+	// The coverage data as of the last takeSnapshot(), for the writers
+	class Snapshot : public IReporter
+	{
+	public:
+		Snapshot(Reporter &reporter) :
+			m_reporter(reporter)
 		{
-			return m_fileHash;
 		}
 
-		// Marshal all line data
-		uint8_t *marshal(uint8_t *p, const Reporter &reporter) const
+		void registerListener(IReporter::IListener &listener)
 		{
-			for (unsigned int i = 0; i < m_lines.size(); i++) {
-				Line *cur = m_lines[i];
+			m_reporter.registerListener(listener);
+		}
 
-				if (!cur)
-					continue;
+		bool fileIsIncluded(const std::string &file)
+		{
+			return m_reporter.fileIsIncluded(file);
+		}
 
-				p = cur->marshal(p, reporter);
-			}
+		bool lineIsCode(const std::string &file, unsigned int lineNr)
+		{
+			uint32_t line = getLine(file, lineNr);
 
-			return p;
+			return line != NO_ENTRY && !m_lineUnreachable[line];
 		}
 
-		size_t marshalSize() const
+		LineExecutionCount getLineExecutionCount(const std::string &file, unsigned int lineNr)
 		{
-			size_t out = 0;
+			uint32_t line = getLine(file, lineNr);
 
-			for (unsigned int i = 0; i < m_lines.size(); i++) {
-				Line *cur = m_lines[i];
+			if (line == NO_ENTRY || m_lineUnreachable[line])
+				return LineExecutionCount(0, 0, 0);
 
-				if (!cur)
-					continue;
+			// 0 means any number of hits are possible
+			unsigned int possibleHits = 0;
 
-				out += cur->marshalSize();
-			}
+			if (m_reporter.m_maxPossibleHits != IFileParser::HITS_UNLIMITED)
+				possibleHits = m_lineAddressCount[line];
 
-			return out;
+			return LineExecutionCount(m_lineHits[line], possibleHits, m_lineOrder[line]);
 		}
 
-		unsigned int getExecutedLines() const
+		ExecutionSummary getExecutionSummary()
 		{
-			unsigned int out = 0;
-
-			for (unsigned int i = 0; i < m_lines.size(); i++) {
-				Line *cur = m_lines[i];
-
-				if (!cur)
-					continue;
+			return m_summary;
+		}
 
-				if (cur->isUnreachable())
-					continue;
+		void *marshal(size_t *szOut)
+		{
+			return m_reporter.marshal(szOut);
+		}
 
-				// Hits as zero or one (executed or not)
-				out += !!cur->hits();
-			}
+		bool unMarshal(void *data, size_t sz)
+		{
+			return m_reporter.unMarshal(data, sz);
+		}
 
-			return out;
+		void writeCoverageDatabase()
+		{
+			m_reporter.writeCoverageDatabase();
 		}
 
-		unsigned int getNrLines() const
+		void takeSnapshot()
 		{
-			return m_nrLines;
+			m_reporter.takeSnapshot();
 		}
 
-		bool lineIsCode(unsigned int lineNr) const
+		uint32_t getLine(const std::string &file, unsigned int lineNr) const
 		{
-			if (lineNr >= m_lines.size())
-				return false;
+			SnapshotFileMap_t::const_iterator it = m_files.find(file);
 
-			if (!m_lines[lineNr])
-				return false;
+			if (it == m_files.end() || lineNr >= it->second.size())
+				return NO_ENTRY;
 
-			return !m_lines[lineNr]->isUnreachable();
+			return it->second[lineNr];
 		}
 
-	private:
-		uint64_t m_fileHash;
-		std::vector<Line *> m_lines;
-		unsigned int m_nrLines;
+		typedef std::unordered_map<std::string, std::vector<uint32_t>> SnapshotFileMap_t;
+
+		Reporter &m_reporter;
+		SnapshotFileMap_t m_files; // Line number -> line index
+		std::vector<bool> m_lineUnreachable;
+		std::vector<uint32_t> m_lineAddressCount;
+		std::vector<uint32_t> m_lineHits;
+		std::vector<uint64_t> m_lineOrder;
+		ExecutionSummary m_summary;
 	};
 
 	class PendingFileAddress
 	{
 	public:
-		PendingFileAddress(uint64_t index, unsigned long hits) :
-			m_index(index), m_hits(hits)
+		PendingFileAddress(uint64_t addr, uint64_t index, unsigned long hits) :
+			m_addr(addr), m_index(index), m_hits(hits)
 		{
 		}
 
+		uint64_t m_addr;
 		uint64_t m_index;
 		unsigned long m_hits;
 	};
 
 	typedef std::unordered_map<std::string, File *> FileMap_t;
-	typedef std::unordered_map<uint64_t, Line *> AddrToLineMap_t;
-	typedef std::unordered_map<uint64_t, unsigned long> AddrToHitsMap_t;
+	typedef std::unordered_map<uint32_t, File *> FileByHashMap_t; // By the line ID file part
 	typedef std::vector<IReporter::IListener *> ListenerList_t;
-	typedef std::unordered_map<uint64_t, Line *> LineIdToFileMap_t;
 	typedef std::vector<PendingFileAddress> PendingHitsList_t; // Address, hits
 	typedef std::unordered_map<uint64_t, PendingHitsList_t> PendingFilesMap_t;
 
 	FileMap_t m_files;
-	AddrToLineMap_t m_addrToLine;
-	AddrToHitsMap_t m_pendingHits;
+	FileByHashMap_t m_filesByHash;
+	std::vector<File *> m_filesByParserId; // From onFileLine
+	unsigned int m_nrFiles;
+
+	// By address index
+	std::vector<uint64_t> m_addresses;
+	std::vector<uint32_t> m_addressHits;
+	std::vector<uint32_t> m_addressFlushedHits; // As written to the database
+	std::vector<uint32_t> m_addressLine;
+	std::vector<uint32_t> m_addressNext; // The one added before in the same line
+	std::vector<uint32_t> m_sortedAddresses; // Address indices, by address
+	uint32_t m_lastAddress;
+
+	// By line index
+	std::vector<uint64_t> m_lineIds;
+	std::vector<uint32_t> m_lineHits; // Of all addresses
+	std::vector<uint64_t> m_lineOrder;
+	std::vector<uint32_t> m_lineAddressCount;
+	std::vector<uint32_t> m_lineFirstAddress; // The last one added
+	std::vector<bool> m_lineUnreachable;
+	std::vector<File *> m_lineFile;
+
+	// For the summary
+	unsigned int m_nrLines;
+	unsigned int m_executedLines;
+
+	std::vector<uint32_t> m_breakpoints; // Breakpoint ID -> address index
+
 	ListenerList_t m_listeners;
 	PendingFilesMap_t m_pendingFiles;
-	LineIdToFileMap_t m_lineIdToFileMap;
 	std::hash<std::string> m_fileHash;
 	bool m_hashFilename;
 
 	IFileParser &m_fileParser;
 	ICollector &m_collector;
 	IFilter &m_filter;
+	FilterCache m_filterCache;
 	enum IFileParser::PossibleHits m_maxPossibleHits;
 
 	bool m_unmarshallingDone;
 	std::string m_dbFileName;
+	std::vector<uint32_t> m_dirtyAddresses; // With hits not in the database
+	bool m_dbCompacted;
+	size_t m_dbSnapshotEntries;
+	size_t m_dbJournalEntries;
 
 	uint64_t m_order;
+
+	Snapshot m_snapshot;
+	bool m_linesChanged;
+	bool m_hitsChanged;
 };
 
 // The merge mode doesn't have/need a proper reporter
@@ -0,0 +1,555 @@
+#include <server.hh>
+#include <line-table-cache.hh>
+#include <source-file-cache.hh>
+#include <utils.hh>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <vector>
+
+using namespace kcov;
+
+#define SERVER_MAGIC 0x6b637372 /* "kcsr" */
+
+/*
+ * A request: The header (with stdin, stdout and stderr of the client
+ * attached), then the working directory, argv and the environment as
+ * NUL-terminated strings. The reply is the exit code (an int).
+ */
+struct request_header
+{
+	uint32_t magic;
+	uint32_t size; // Of the strings
+	uint32_t argc;
+	uint32_t envc;
+	uint32_t umask;
+};
+
+static bool write_all(int fd, const void *data, size_t size)
+{
+	const uint8_t *p = (const uint8_t *)data;
+
+	while (size > 0) {
+		ssize_t r = send(fd, p, size, MSG_NOSIGNAL);
+
+		// Not a socket
+		if (r < 0 && errno == ENOTSOCK)
+			r = write(fd, p, size);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+
+		p += r;
+		size -= r;
+	}
+
+	return true;
+}
+
+static bool read_all(int fd, void *data, size_t size)
+{
+	uint8_t *p = (uint8_t *)data;
+
+	while (size > 0) {
+		ssize_t r = read(fd, p, size);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+
+		p += r;
+		size -= r;
+	}
+
+	return true;
+}
+
+static bool setup_address(struct sockaddr_un &addr, const std::string &socketPath)
+{
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (socketPath.size() >= sizeof(addr.sun_path))
+		return false;
+	strcpy(addr.sun_path, socketPath.c_str());
+
+	return true;
+}
+
+
+static int g_clientFd = -1;
+
+// Forwarded to kcov in the server, which forwards it to the program
+static void client_signal_handler(int sig)
+{
+	uint8_t v = sig;
+
+	if (write(g_clientFd, &v, sizeof(v)) < 0)
+		_exit(1);
+}
+
+bool kcov::runThroughServer(const std::string &socketPath, int argc, const char *argv[], int &exitCode)
+{
+	struct sockaddr_un addr;
+
+	if (!setup_address(addr, socketPath))
+		return false;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		kcov_debug(INFO_MSG, "kcov: No server at %s, running locally\n", socketPath.c_str());
+		close(fd);
+
+		return false;
+	}
+
+	std::string strings;
+	char *cwd = get_current_dir_name();
+	unsigned int envc = 0;
+
+	strings += std::string(cwd ? cwd : "/") + '\0';
+	free(cwd);
+
+	for (int i = 0; i < argc; i++)
+		strings += std::string(argv[i]) + '\0';
+
+	for (char **p = environ; *p; p++, envc++)
+		strings += std::string(*p) + '\0';
+
+	mode_t mask = umask(0);
+	umask(mask);
+
+	struct request_header hdr;
+
+	hdr.magic = SERVER_MAGIC;
+	hdr.size = strings.size();
+	hdr.argc = argc;
+	hdr.envc = envc;
+	hdr.umask = mask;
+
+	// The header, with stdin/stdout/stderr
+	int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = {&hdr, sizeof(hdr)};
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	ssize_t r;
+	do {
+		r = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	} while (r < 0 && errno == EINTR);
+
+	if (r != sizeof(hdr) || !write_all(fd, strings.data(), strings.size())) {
+		error("kcov: Can't send the request to the server at %s\n", socketPath.c_str());
+		close(fd);
+
+		return false;
+	}
+
+	g_clientFd = fd;
+	signal(SIGINT, client_signal_handler);
+	signal(SIGTERM, client_signal_handler);
+	signal(SIGHUP, client_signal_handler);
+
+	int32_t code;
+	if (!read_all(fd, &code, sizeof(code))) {
+		error("kcov: The server didn't report an exit code\n");
+		code = 1;
+	}
+	close(fd);
+
+	exitCode = code;
+
+	return true;
+}
+
+
+class Server : public IServer
+{
+public:
+	Server(const std::string &socketPath) :
+		m_socketPath(socketPath),
+		m_listenFd(-1),
+		m_clientFd(-1),
+		m_resultFd(-1),
+		m_done(false)
+	{
+	}
+
+	bool run(int &argc, const char **&argv)
+	{
+		struct sockaddr_un addr;
+
+		if (!setup_address(addr, m_socketPath)) {
+			error("kcov: Socket path %s too long\n", m_socketPath.c_str());
+
+			return false;
+		}
+
+		m_listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (m_listenFd < 0) {
+			error("kcov: Can't create socket\n");
+
+			return false;
+		}
+
+		// The clients run kcov as the server user, so create the socket private
+		mode_t mask = umask(077);
+		int rv;
+
+		unlink(m_socketPath.c_str());
+		rv = bind(m_listenFd, (struct sockaddr *)&addr, sizeof(addr));
+		umask(mask);
+
+		if (rv < 0 || listen(m_listenFd, 64) < 0) {
+			error("kcov: Can't listen on %s\n", m_socketPath.c_str());
+
+			return false;
+		}
+
+		ILineTableCache::getInstance().enable();
+
+		kcov_debug(INFO_MSG, "kcov: Serving on %s\n", m_socketPath.c_str());
+
+		while (1) {
+			std::vector<struct pollfd> pfds;
+			struct pollfd pfd;
+
+			pfd.fd = m_listenFd;
+			pfd.events = POLLIN;
+			pfds.push_back(pfd);
+
+			for (WorkerList_t::const_iterator it = m_workers.begin();
+					it != m_workers.end();
+					++it) {
+				pfd.fd = it->m_fd;
+				pfds.push_back(pfd);
+			}
+
+			// Timeout to reap the workers
+			if (poll(pfds.data(), pfds.size(), 1000) < 0 && errno != EINTR) {
+				error("kcov: poll failed\n");
+
+				return false;
+			}
+			reapWorkers();
+
+			for (unsigned int i = 1; i < pfds.size(); i++) {
+				if (pfds[i].revents)
+					readResult(pfds[i].fd);
+			}
+
+			if (!(pfds[0].revents & POLLIN))
+				continue;
+
+			int clientFd = accept4(m_listenFd, NULL, NULL, SOCK_CLOEXEC);
+			if (clientFd < 0)
+				continue;
+
+			if (!peerIsOwner(clientFd)) {
+				close(clientFd);
+				continue;
+			}
+
+			if (startWorker(clientFd) && setupRequest(argc, argv))
+				return true;
+		}
+	}
+
+	void done(int exitCode)
+	{
+		int32_t code = exitCode;
+
+		m_done = true;
+
+		write_all(m_clientFd, &code, sizeof(code));
+		close(m_clientFd);
+
+		// What's new, so that the server can keep it
+		size_t tableSize;
+		void *tables = ILineTableCache::getInstance().marshal(&tableSize);
+		uint64_t size = tableSize;
+		std::string sources;
+
+		std::vector<std::string> files = ISourceFileCache::getInstance().getFiles();
+		for (std::vector<std::string>::const_iterator it = files.begin();
+				it != files.end();
+				++it)
+			sources += *it + '\0';
+
+		signal(SIGPIPE, SIG_IGN);
+		if (write_all(m_resultFd, &size, sizeof(size)) &&
+				write_all(m_resultFd, tables, tableSize))
+			write_all(m_resultFd, sources.data(), sources.size());
+		close(m_resultFd);
+
+		free(tables);
+	}
+
+private:
+	class Worker
+	{
+	public:
+		Worker(pid_t pid, int fd) :
+			m_pid(pid), m_fd(fd)
+		{
+		}
+
+		pid_t m_pid;
+		int m_fd;
+		std::string m_data;
+	};
+
+	typedef std::vector<Worker> WorkerList_t;
+
+	// Only serve the user the server runs as
+	bool peerIsOwner(int fd)
+	{
+		struct ucred cred;
+		socklen_t len = sizeof(cred);
+
+		if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+			warning("Can't get the client credentials, refusing\n");
+
+			return false;
+		}
+
+		if (cred.uid != geteuid()) {
+			warning("Refusing client with uid %u\n", (unsigned int)cred.uid);
+
+			return false;
+		}
+
+		return true;
+	}
+
+	bool startWorker(int clientFd)
+	{
+		int result[2];
+
+		if (pipe2(result, O_CLOEXEC) < 0) {
+			close(clientFd);
+
+			return false;
+		}
+
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			close(clientFd);
+			close(result[0]);
+			close(result[1]);
+
+			return false;
+		}
+
+		if (pid == 0) {
+			close(m_listenFd);
+			close(result[0]);
+			for (WorkerList_t::const_iterator it = m_workers.begin();
+					it != m_workers.end();
+					++it)
+				close(it->m_fd);
+			m_workers.clear();
+
+			m_clientFd = clientFd;
+			m_resultFd = result[1];
+
+			return true;
+		}
+
+		close(clientFd);
+		close(result[1]);
+		m_workers.push_back(Worker(pid, result[0]));
+
+		return false;
+	}
+
+	// In the worker
+	bool setupRequest(int &argc, const char **&argv)
+	{
+		struct request_header hdr;
+		int fds[3];
+		char control[CMSG_SPACE(sizeof(fds))];
+		struct iovec iov = {&hdr, sizeof(hdr)};
+		struct msghdr msg;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		ssize_t r;
+		do {
+			r = recvmsg(m_clientFd, &msg, MSG_CMSG_CLOEXEC);
+		} while (r < 0 && errno == EINTR);
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+		if (r != sizeof(hdr) || hdr.magic != SERVER_MAGIC ||
+				!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+				cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+			_exit(1);
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+		char *strings = (char *)xmalloc(hdr.size + 1);
+		if (!read_all(m_clientFd, strings, hdr.size))
+			_exit(1);
+		strings[hdr.size] = '\0';
+
+		std::vector<const char *> parts;
+		for (char *p = strings; p < strings + hdr.size; p += strlen(p) + 1)
+			parts.push_back(p);
+
+		if (parts.size() != 1 + hdr.argc + hdr.envc || hdr.argc == 0)
+			_exit(1);
+
+		for (unsigned int i = 0; i < 3; i++) {
+			dup2(fds[i], i);
+			close(fds[i]);
+		}
+
+		if (chdir(parts[0]) < 0)
+			_exit(1);
+		umask(hdr.umask);
+
+		clearenv();
+		for (unsigned int i = 0; i < hdr.envc; i++)
+			putenv((char *)parts[1 + hdr.argc + i]);
+
+		// Intentional memory leak, the strings are used until kcov exits
+		argc = hdr.argc;
+		argv = (const char **)xmalloc(sizeof(char *) * (argc + 1));
+		for (int i = 0; i < argc; i++)
+			argv[i] = parts[1 + i];
+		argv[argc] = NULL;
+
+		// Another run might have changed the sources
+		ISourceFileCache::getInstance().revalidate();
+
+		pthread_t thread;
+		pthread_create(&thread, NULL, Server::clientThreadStatic, (void *)this);
+
+		return true;
+	}
+
+	static void *clientThreadStatic(void *pThis)
+	{
+		Server *p = (Server *)pThis;
+
+		p->clientThread();
+
+		return NULL;
+	}
+
+	// Signals from the client, to this process (which forwards them to the program)
+	void clientThread()
+	{
+		uint8_t sig;
+
+		while (read_all(m_clientFd, &sig, sizeof(sig)))
+			kill(getpid(), sig);
+
+		// The client is gone
+		if (!m_done)
+			kill(getpid(), SIGTERM);
+	}
+
+	void readResult(int fd)
+	{
+		WorkerList_t::iterator it;
+
+		for (it = m_workers.begin(); it != m_workers.end(); ++it) {
+			if (it->m_fd == fd)
+				break;
+		}
+		if (it == m_workers.end())
+			return;
+
+		char buf[64 * 1024];
+		ssize_t r = read(fd, buf, sizeof(buf));
+
+		if (r < 0 && errno == EINTR)
+			return;
+		if (r > 0) {
+			it->m_data.append(buf, r);
+			return;
+		}
+
+		// Done, keep the results
+		uint64_t size;
+		const std::string &data = it->m_data;
+
+		if (data.size() >= sizeof(size)) {
+			memcpy(&size, data.data(), sizeof(size));
+
+			if (size <= data.size() - sizeof(size)) {
+				ILineTableCache::getInstance().unmarshal(data.data() + sizeof(size), size);
+
+				// NUL-terminated source file paths
+				size_t pos = sizeof(size) + size;
+				while (pos < data.size()) {
+					std::string cur = data.c_str() + pos;
+
+					ISourceFileCache::getInstance().getLines(cur);
+					pos += cur.size() + 1;
+				}
+			}
+		}
+
+		close(fd);
+		m_workers.erase(it);
+	}
+
+	void reapWorkers()
+	{
+		int status;
+
+		while (waitpid(-1, &status, WNOHANG) > 0)
+			;
+	}
+
+	std::string m_socketPath;
+	int m_listenFd;
+	WorkerList_t m_workers;
+
+	// In the workers
+	int m_clientFd;
+	int m_resultFd;
+	volatile bool m_done;
+};
+
+IServer &IServer::create(const std::string &socketPath)
+{
+	return *new Server(socketPath);
+}
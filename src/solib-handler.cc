@@ -9,6 +9,7 @@
 #include <generated-data-base.hh>
 
 #include <mutex>
+#include <atomic>
 #include <vector>
 #include <unordered_map>
 #include <signal.h>
@@ -18,6 +19,7 @@
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
@@ -32,11 +34,13 @@ public:
 	SolibHandler(IFileParser &parser, ICollector &collector) :
 		m_ldPreloadString(NULL),
 		m_envString(NULL),
+		m_ownerString(NULL),
 		m_solibFd(-1),
 		m_solibThreadValid(false),
 		m_threadShouldExit(false),
 		m_parser(&parser),
-		m_hasSetupRelocation(false)
+		m_hasSetupRelocation(false),
+		m_reportsParsed(0)
 {
 		memset(&m_solibThread, 0, sizeof(m_solibThread));
 
@@ -94,7 +98,14 @@ public:
 		// Skip this very special library
 		m_foundSolibs[get_real_path(kcov_solib_path)] = true;
 
-		write_file(__library_data.data(), __library_data.size(), "%s", kcov_solib_path.c_str());
+		// Replace, don't overwrite: Programs followed by another kcov (--follow-exec) have it mapped
+		std::string tmpPath = fmt("%s.%d", kcov_solib_path.c_str(), getpid());
+
+		write_file(__library_data.data(), __library_data.size(), "%s", tmpPath.c_str());
+		if (rename(tmpPath.c_str(), kcov_solib_path.c_str()) < 0) {
+			unlink(tmpPath.c_str());
+			write_file(__library_data.data(), __library_data.size(), "%s", kcov_solib_path.c_str());
+		}
 
 		unlink(kcov_solib_pipe_path.c_str());
 
@@ -137,9 +148,21 @@ public:
 				ICapabilities::getInstance().hasCapability("handle-solibs")) {
 			if (file_exists(kcov_solib_path))
 				putenv(m_ldPreloadString);
+
+			// Run by the library, see --fork-server
+			const std::string &forkServer = IConfiguration::getInstance().keyAsString("fork-server");
+			if (forkServer != "")
+				putenv(xstrdup(fmt("KCOV_FORK_SERVER=%s", forkServer.c_str()).c_str()));
 		}
 		putenv(m_envString);
 
+		// Programs traced by another kcov (--follow-exec) report to that one
+		std::string ownerEnv = fmt("KCOV_SOLIB_OWNER=%d", getpid());
+		free(m_ownerString);
+		m_ownerString = (char *)xmalloc(ownerEnv.size() + 1);
+		strcpy(m_ownerString, ownerEnv.c_str());
+		putenv(m_ownerString);
+
 		m_solibPath = kcov_solib_pipe_path;
 		pthread_create(&m_solibThread, NULL,
 				SolibHandler::threadStatic, (void *)this);
@@ -245,6 +268,24 @@ public:
 		}
 
 		free(p);
+		// The engines poll this from their threads
+		m_reportsParsed.fetch_add(1, std::memory_order_release);
+	}
+
+	bool dataPending()
+	{
+		int unread = 0;
+		bool out;
+
+		m_phdrListMutex.lock();
+		out = !m_phdrs.empty();
+		m_phdrListMutex.unlock();
+
+		// Written by the tracee, but not yet read by the solib thread
+		if (!out && m_solibFd >= 0 && ioctl(m_solibFd, FIONREAD, &unread) == 0)
+			out = unread > 0;
+
+		return out;
 	}
 
 
@@ -257,6 +298,7 @@ public:
 	std::string m_solibDirectory;
 	char *m_ldPreloadString;
 	char *m_envString;
+	char *m_ownerString;
 	int m_solibFd;
 	bool m_solibThreadValid;
 	bool m_threadShouldExit;
@@ -268,6 +310,7 @@ public:
 
 	IFileParser *m_parser;
 	bool m_hasSetupRelocation;
+	std::atomic<unsigned int> m_reportsParsed;
 };
 
 
@@ -286,3 +329,19 @@ void kcov::blockUntilSolibDataRead()
 	if (g_handler->m_solibThreadValid)
 		g_handler->m_solibDataReadSemaphore.wait();
 }
+
+bool kcov::solibDataPending()
+{
+	if (!g_handler)
+		return false;
+
+	return g_handler->dataPending();
+}
+
+unsigned int kcov::solibReportsParsed()
+{
+	if (!g_handler)
+		return 0;
+
+	return g_handler->m_reportsParsed.load(std::memory_order_acquire);
+}
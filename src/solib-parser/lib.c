@@ -4,6 +4,9 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <poll.h>
 #include <libelf.h>
 #include <fcntl.h>
 #include <stdint.h>
@@ -11,13 +14,21 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
 #include <link.h>
 #include <dlfcn.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include <phdr_data.h>
+#include <inprocess_data.h>
 
 static struct phdr_data *phdr_data;
 
+static struct inprocess_data *inprocess;
+
 static int phdrCallback(struct dl_phdr_info *info, size_t size, void *data)
 {
 	// the first entry is used to determine the executable's "base address"
@@ -40,18 +51,115 @@ static int phdrSizeCallback(struct dl_phdr_info *info, size_t size, void *data)
 	return 0;
 }
 
-static void parse_solibs(void)
+/* A field of /proc/PID/status, or -1 if it can't be read */
+static int get_status_field(const char *status_path, const char *field)
+{
+	char buf[4096];
+	char *p;
+	ssize_t r;
+	int fd;
+
+	fd = open(status_path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	r = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (r <= 0)
+		return -1;
+	buf[r] = '\0';
+
+	p = strstr(buf, field);
+	if (!p)
+		return -1;
+
+	return atoi(p + strlen(field));
+}
+
+static int get_tracer(void)
+{
+	return get_status_field("/proc/self/status", "TracerPid:");
+}
+
+/* kcov detaches from processes without breakpoints left, don't trap there */
+static int is_traced(void)
+{
+	return get_tracer() != 0;
+}
+
+/*
+ * Programs exec:ed with --follow-exec are traced by another kcov, which reads
+ * from the FIFO in the output directory of the program.
+ */
+static const char *get_solib_path(char *buf, size_t size)
+{
+	const char *path = getenv("KCOV_SOLIB_PATH");
+	const char *owner = getenv("KCOV_SOLIB_OWNER");
+	char status_path[64];
+	char exe[PATH_MAX];
+	char *base;
+	ssize_t r;
+	int tracer;
+	int i;
+
+	if (!path || !owner)
+		return path;
+
+	tracer = get_tracer();
+	if (tracer <= 0)
+		return path;
+
+	/* The tracer is a thread in kcov */
+	snprintf(status_path, sizeof(status_path), "/proc/%d/status", tracer);
+	if (get_status_field(status_path, "Tgid:") == atoi(owner))
+		return path;
+
+	r = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	if (r <= 0)
+		return path;
+	exe[r] = '\0';
+
+	/* [out-dir]/[binary]/kcov-solib.pipe -> [out-dir] */
+	if (snprintf(buf, size, "%s", path) >= size)
+		return path;
+	for (i = 0; i < 2; i++) {
+		char *slash = strrchr(buf, '/');
+
+		if (!slash)
+			return path;
+		*slash = '\0';
+	}
+
+	base = strrchr(exe, '/');
+	base = base ? base + 1 : exe;
+
+	if (strlen(buf) + strlen(base) + sizeof("//kcov-solib.pipe") > size)
+		return path;
+	strcat(buf, "/");
+	strcat(buf, base);
+	strcat(buf, "/kcov-solib.pipe");
+
+	return buf;
+}
+
+/*
+ * Returns 0 if the report was written, -1 otherwise. @ticket_out (if given)
+ * is set to the in-process request number of the report, or 0
+ */
+static int parse_solibs(uint32_t *ticket_out)
 {
-	char *kcov_solib_path;
+	char path_buf[PATH_MAX];
+	const char *kcov_solib_path;
 	void *p;
 	ssize_t written;
 	size_t allocSize;
 	size_t sz;
+	uint32_t ticket = 0;
 	int fd;
 
-	kcov_solib_path = getenv("KCOV_SOLIB_PATH");
+	kcov_solib_path = get_solib_path(path_buf, sizeof(path_buf));
 	if (!kcov_solib_path)
-		return;
+		return -1;
 
 	allocSize = sizeof(struct phdr_data);
 	dl_iterate_phdr(phdrSizeCallback, &allocSize);
@@ -59,7 +167,7 @@ static void parse_solibs(void)
 	phdr_data = phdr_data_new(allocSize);
 	if (!phdr_data) {
 		fprintf(stderr, "kcov-solib: Can't allocate %zu bytes\n", allocSize);
-		return;
+		return -1;
 	}
 
 
@@ -70,8 +178,12 @@ static void parse_solibs(void)
 	fd = open(kcov_solib_path, O_WRONLY);
 	if (fd < 0) {
 		fprintf(stderr, "kcov-solib: Can't open %s\n", kcov_solib_path);
-		return;
+		return -1;
 	}
+
+	/* kcov parses the reports in FIFO order */
+	if (inprocess)
+		ticket = __atomic_add_fetch(&inprocess->requests, 1, __ATOMIC_SEQ_CST);
 	written = write(fd, p, sz);
 
 	if (written != sz)
@@ -80,6 +192,11 @@ static void parse_solibs(void)
 	phdr_data_free(p);
 
 	close(fd);
+
+	if (ticket_out)
+		*ticket_out = ticket;
+
+	return written == sz ? 0 : -1;
 }
 
 static void force_breakpoint(void)
@@ -99,6 +216,330 @@ static void force_breakpoint(void)
 			);
 }
 
+/*
+ * In-process breakpoints (kcov --in-process): kcov publishes the breakpoint
+ * addresses in a shared file, and the int3:s are installed and handled here
+ * instead of stopping the program for kcov to handle them.
+ */
+#if defined(__i386__) || defined(__x86_64__)
+# if defined(__x86_64__)
+#  define INPROCESS_PC REG_RIP
+# else
+#  define INPROCESS_PC REG_EIP
+# endif
+
+static uint16_t *inprocess_orig; /* 0x100 | the original byte, per slot */
+static uint32_t inprocess_installed;
+static int inprocess_mem_fd = -1;
+static int inprocess_wake_fd = -1;
+static int inprocess_main_only;
+static uint64_t inprocess_main_start;
+static uint64_t inprocess_main_end;
+static struct sigaction inprocess_old_action;
+
+static int inprocess_lookup(uint64_t addr)
+{
+	uint64_t *entries = inprocess_data_entries(inprocess);
+	uint32_t mask = inprocess->n_slots - 1;
+	uint32_t slot = inprocess_data_hash(inprocess, addr);
+	uint32_t i;
+
+	for (i = 0; i <= mask; i++, slot = (slot + 1) & mask) {
+		uint64_t cur = __atomic_load_n(&entries[slot], __ATOMIC_RELAXED);
+
+		if (cur == addr)
+			return slot;
+		if (cur == 0)
+			break;
+	}
+
+	return -1;
+}
+
+/*
+ * The text is patched through /proc/self/mem, which ignores the page
+ * protection, so it's never left writable. Forks get a file of their own,
+ * the inherited one is for the memory of the parent.
+ */
+static void inprocess_open_mem(void)
+{
+	if (inprocess_mem_fd >= 0)
+		close(inprocess_mem_fd);
+	inprocess_mem_fd = open("/proc/self/mem", O_RDWR | O_CLOEXEC);
+}
+
+static int inprocess_peek(uint64_t addr, uint8_t *val)
+{
+	return pread(inprocess_mem_fd, val, 1, (off_t)addr) == 1;
+}
+
+static int inprocess_poke(uint64_t addr, uint8_t val)
+{
+	return pwrite(inprocess_mem_fd, &val, 1, (off_t)addr) == 1;
+}
+
+/* Wake kcov up if it's waiting for hits */
+static void inprocess_wake(void)
+{
+	char c = 'w';
+
+	if (inprocess_wake_fd >= 0 &&
+			__atomic_exchange_n(&inprocess->waiting, 0, __ATOMIC_SEQ_CST)) {
+		if (write(inprocess_wake_fd, &c, 1) != 1)
+			return;
+	}
+}
+
+static void inprocess_trap_handler(int sig, siginfo_t *info, void *context)
+{
+	ucontext_t *uc = (ucontext_t *)context;
+	uint64_t pc = (uint64_t)(unsigned long)uc->uc_mcontext.gregs[INPROCESS_PC] - 1;
+	uint64_t *hits = inprocess_data_hits(inprocess);
+	int saved_errno = errno;
+	int slot = -1;
+
+	if (info->si_code == SI_KERNEL)
+		slot = inprocess_lookup(pc);
+
+	if (slot >= 0 && inprocess_orig[slot]) {
+		volatile uint8_t *p = (volatile uint8_t *)(unsigned long)pc;
+
+		__atomic_fetch_or(&hits[slot / 64], 1ULL << (slot % 64), __ATOMIC_RELAXED);
+		__atomic_add_fetch(&inprocess->hits, 1, __ATOMIC_SEQ_CST);
+		inprocess_wake();
+
+		/* Another thread might have hit (and restored) it as well */
+		if (*p == 0xcc)
+			inprocess_poke(pc, inprocess_orig[slot] & 0xff);
+		uc->uc_mcontext.gregs[INPROCESS_PC] = pc;
+		errno = saved_errno;
+
+		return;
+	}
+
+	/* Not ours */
+	if (inprocess_old_action.sa_flags & SA_SIGINFO) {
+		inprocess_old_action.sa_sigaction(sig, info, context);
+	} else if (inprocess_old_action.sa_handler == SIG_DFL) {
+		signal(sig, SIG_DFL);
+		raise(sig);
+	} else if (inprocess_old_action.sa_handler != SIG_IGN) {
+		inprocess_old_action.sa_handler(sig);
+	}
+}
+
+static int inprocess_main_callback(struct dl_phdr_info *info, size_t size, void *data)
+{
+	int i;
+
+	/* The first entry is the executable */
+	for (i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *cur = &info->dlpi_phdr[i];
+		uint64_t start = info->dlpi_addr + cur->p_vaddr;
+
+		if (cur->p_type != PT_LOAD)
+			continue;
+
+		if (inprocess_main_start == 0 || start < inprocess_main_start)
+			inprocess_main_start = start;
+		if (start + cur->p_memsz > inprocess_main_end)
+			inprocess_main_end = start + cur->p_memsz;
+	}
+	*(uint64_t *)data = info->dlpi_addr;
+
+	return 1;
+}
+
+static void inprocess_setup(void)
+{
+	const char *path = getenv("KCOV_INPROCESS_PATH");
+	const char *wake = getenv("KCOV_INPROCESS_WAKE");
+	struct inprocess_data *p;
+	struct sigaction sa;
+	struct stat st;
+	char exe[PATH_MAX];
+	uint64_t relocation = 0;
+	uint32_t expected = 0;
+	ssize_t r;
+	int fd;
+
+	if (!path)
+		return;
+
+	r = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	if (r <= 0)
+		return;
+	exe[r] = '\0';
+
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*p)) {
+		close(fd);
+		return;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return;
+
+	/* Only the covered program, other programs it runs are left alone */
+	if (p->magic != INPROCESS_DATA_MAGIC || p->version != INPROCESS_DATA_VERSION ||
+			st.st_size < inprocess_data_size(p->n_slots) ||
+			strcmp(p->executable, exe) != 0) {
+		munmap(p, st.st_size);
+		return;
+	}
+
+	inprocess_open_mem();
+	if (inprocess_mem_fd < 0) {
+		fprintf(stderr, "kcov-solib: Can't open /proc/self/mem\n");
+		munmap(p, st.st_size);
+		return;
+	}
+
+	inprocess_orig = mmap(NULL, p->n_slots * sizeof(uint16_t), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (inprocess_orig == MAP_FAILED) {
+		munmap(p, st.st_size);
+		return;
+	}
+
+	dl_iterate_phdr(inprocess_main_callback, &relocation);
+
+	/*
+	 * The addresses of shared libraries are only valid for the first
+	 * instance (and its forks). Exec:ed instances at the same relocation
+	 * get the breakpoints in the executable.
+	 */
+	if (!__atomic_compare_exchange_n(&p->has_relocation, &expected, 1, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		if (p->relocation != relocation) {
+			munmap(inprocess_orig, p->n_slots * sizeof(uint16_t));
+			munmap(p, st.st_size);
+			return;
+		}
+		inprocess_main_only = 1;
+	}
+	p->relocation = relocation;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = inprocess_trap_handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+
+	/* kcov keeps the FIFO open for reading, so this doesn't fail or block */
+	if (wake)
+		inprocess_wake_fd = open(wake, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	pthread_atfork(NULL, NULL, inprocess_open_mem);
+
+	inprocess = p;
+	sigaction(SIGTRAP, &sa, &inprocess_old_action);
+}
+
+static void inprocess_install(void)
+{
+	uint32_t n = __atomic_load_n(&inprocess->n_entries, __ATOMIC_ACQUIRE);
+	uint64_t *entries = inprocess_data_entries(inprocess);
+	uint32_t *order = inprocess_data_order(inprocess);
+
+	for (; inprocess_installed < n; inprocess_installed++) {
+		uint32_t slot = order[inprocess_installed];
+		uint64_t addr = entries[slot];
+		uint8_t orig;
+
+		if (inprocess_main_only &&
+				(addr < inprocess_main_start || addr >= inprocess_main_end))
+			continue;
+
+		/* Unmapped, or already ours */
+		if (!inprocess_peek(addr, &orig) || orig == 0xcc)
+			continue;
+
+		inprocess_orig[slot] = 0x100 | orig;
+		if (!inprocess_poke(addr, 0xcc))
+			inprocess_orig[slot] = 0;
+	}
+}
+
+/* Report the solibs and wait for kcov to publish their breakpoints */
+static void inprocess_report(void)
+{
+	const char *owner = getenv("KCOV_SOLIB_OWNER");
+	uint32_t ticket = 0;
+	int i;
+
+	if (!inprocess_main_only)
+		parse_solibs(&ticket);
+	if (ticket)
+		inprocess_wake();
+
+	for (i = 0; ticket && i < 60 * 1000; i++) {
+		if ((int32_t)(__atomic_load_n(&inprocess->acks, __ATOMIC_ACQUIRE) - ticket) >= 0)
+			break;
+
+		/* Don't wait for a kcov which is gone */
+		if (owner && kill(atoi(owner), 0) < 0 && errno == ESRCH)
+			return;
+
+		usleep(1000);
+	}
+
+	inprocess_install();
+}
+#else
+static void inprocess_setup(void)
+{
+}
+
+static void inprocess_report(void)
+{
+}
+#endif
+
+/*
+ * With the uprobe engine (kcov --uprobes), the first process reports its
+ * solibs and waits until kcov has probed them: kcov writes one byte per
+ * report to the sync FIFO, which it keeps open.
+ */
+static int uprobe_sync(void)
+{
+	const char *pid = getenv("KCOV_UPROBE_PID");
+	const char *path = getenv("KCOV_UPROBE_SYNC");
+	struct pollfd pfd;
+	char c;
+	int fd;
+	int r;
+
+	if (!pid || atoi(pid) != getpid())
+		return 0;
+
+	/* Not blocking when kcov is gone */
+	fd = path ? open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC) : -1;
+	if (fd < 0)
+		return 1;
+
+	if (parse_solibs(NULL) == 0) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+
+		/* Don't hang on reports kcov can't parse */
+		do {
+			r = poll(&pfd, 1, 5000);
+		} while (r < 0 && errno == EINTR);
+
+		if (r > 0 && (pfd.revents & POLLIN))
+			r = read(fd, &c, 1);
+		else
+			fprintf(stderr, "kcov-solib: No reply from kcov, continuing\n");
+	}
+	close(fd);
+
+	return 1;
+}
+
 static void *(*orig_dlopen)(const char *, int);
 void *dlopen(const char *filename, int flag)
 {
@@ -109,15 +550,134 @@ void *dlopen(const char *filename, int flag)
 
 	out = orig_dlopen(filename, flag);
 
-	parse_solibs();
+	if (inprocess) {
+		inprocess_report();
+		return out;
+	}
+
+	if (uprobe_sync())
+		return out;
+
+	if (!is_traced())
+		return out;
+
+	parse_solibs(NULL);
 	force_breakpoint();
 
 	return out;
 }
 
 
+/* The list of input files, read at once to be done with it before forking */
+static char *fork_server_read_list(const char *path)
+{
+	char *out = NULL;
+	size_t size = 0;
+	ssize_t r;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	do {
+		char *p = realloc(out, size + 65536 + 1);
+
+		if (!p) {
+			free(out);
+			close(fd);
+			return NULL;
+		}
+		out = p;
+
+		r = read(fd, out + size, 65536);
+		if (r > 0)
+			size += r;
+	} while (r > 0 || (r < 0 && errno == EINTR));
+	close(fd);
+
+	out[size] = '\0';
+
+	return out;
+}
+
+/*
+ * kcov --fork-server: The program is instrumented (and its solibs reported)
+ * once, and then run once per input in a fork from here, with the input on
+ * stdin. kcov traces the forks like any other children. Returns in the
+ * forks, the server exits when the inputs are done.
+ */
+static void fork_server(void)
+{
+	const char *env = getenv("KCOV_FORK_SERVER");
+	int exit_code = 0;
+	char *list;
+	char *cur;
+
+	if (!env)
+		return;
+
+	list = fork_server_read_list(env);
+	if (!list) {
+		fprintf(stderr, "kcov: Can't read the fork server input list %s\n", env);
+		_exit(1);
+	}
+
+	/* Not for exec:ed programs */
+	unsetenv("KCOV_FORK_SERVER");
+
+	for (cur = strtok(list, "\n"); cur; cur = strtok(NULL, "\n")) {
+		pid_t pid;
+		int status;
+
+		pid = fork();
+		if (pid < 0) {
+			fprintf(stderr, "kcov: fork failed for %s\n", cur);
+			exit_code = 1;
+			break;
+		}
+
+		if (pid == 0) {
+			int fd = open(cur, O_RDONLY);
+
+			if (fd < 0) {
+				fprintf(stderr, "kcov: Can't open input %s\n", cur);
+				_exit(1);
+			}
+			dup2(fd, STDIN_FILENO);
+			close(fd);
+			free(list);
+
+			return;
+		}
+
+		while (waitpid(pid, &status, 0) < 0) {
+			if (errno != EINTR) {
+				status = 0;
+				break;
+			}
+		}
+
+		/* The last failing input decides the exit code */
+		if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+			exit_code = WEXITSTATUS(status);
+		else if (WIFSIGNALED(status))
+			exit_code = 128 + WTERMSIG(status);
+	}
+
+	free(list);
+	_exit(exit_code);
+}
+
 void  __attribute__((constructor))kcov_solib_at_startup(void)
 {
-	parse_solibs();
-	force_breakpoint();
+	inprocess_setup();
+	if (inprocess) {
+		inprocess_report();
+	} else if (!uprobe_sync() && is_traced()) {
+		parse_solibs(NULL);
+		force_breakpoint();
+	}
+
+	fork_server();
 }
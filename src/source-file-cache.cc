@@ -3,13 +3,28 @@
 
 #include <unordered_map>
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
 using namespace kcov;
 
+// In ns, 0 if the file is missing
+static uint64_t get_mtime(const std::string &filePath)
+{
+	struct stat st;
+
+	if (stat(filePath.c_str(), &st) < 0)
+		return 0;
+
+	return (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+}
+
 class SourceFileCache : public ISourceFileCache
 {
 public:
 	SourceFileCache() :
-		m_empty()
+		m_empty(),
+		m_generation(0)
 	{
 	}
 
@@ -34,6 +49,36 @@ public:
 		return file.m_crc;
 	}
 
+	void revalidate()
+	{
+		// Missing files might have appeared, or existing ones removed
+		revalidate_file_caches();
+
+		for (std::unordered_map<std::string, File *>::iterator it = m_files.begin();
+				it != m_files.end();) {
+			if (it->second == &m_empty)
+				it = m_files.erase(it);
+			else
+				++it;
+		}
+
+		m_generation++;
+	}
+
+	std::vector<std::string> getFiles()
+	{
+		std::vector<std::string> out;
+
+		for (std::unordered_map<std::string, File *>::const_iterator it = m_files.begin();
+				it != m_files.end();
+				++it) {
+			if (it->second != &m_empty)
+				out.push_back(it->first);
+		}
+
+		return out;
+	}
+
 private:
 	class File
 	{
@@ -41,7 +86,9 @@ private:
 		File() :
 			m_data(NULL),
 			m_dataSize(0),
-			m_crc(0)
+			m_crc(0),
+			m_mtime(0),
+			m_generation(0)
 		{
 		}
 
@@ -50,8 +97,8 @@ private:
 			free((void*)m_data);
 		}
 
-		File(const uint8_t *data, size_t size) :
-			m_data(data), m_dataSize(size)
+		File(const uint8_t *data, size_t size, uint64_t mtime, unsigned int generation) :
+			m_data(data), m_dataSize(size), m_mtime(mtime), m_generation(generation)
 		{
 			std::string fileData((const char*)m_data, size);
 
@@ -64,14 +111,30 @@ private:
 		size_t m_dataSize;
 		std::vector<std::string> m_lines;
 		uint32_t m_crc;
+		uint64_t m_mtime;
+		unsigned int m_generation; // When m_mtime was last checked
 	};
 
 	const File &lookupFile(const std::string filePath)
 	{
 		std::unordered_map<std::string, File *>::iterator it = m_files.find(filePath);
 
-		if (it != m_files.end())
-			return *it->second;
+		if (it != m_files.end()) {
+			File *cur = it->second;
+
+			if (cur == &m_empty || cur->m_generation == m_generation)
+				return *cur;
+
+			// Cached by an earlier run
+			if (get_mtime(filePath) == cur->m_mtime) {
+				cur->m_generation = m_generation;
+
+				return *cur;
+			}
+
+			delete cur;
+			m_files.erase(it);
+		}
 
 		/* Doesn't exist - put it as empty in the cache */
 		if (!file_exists(filePath))
@@ -82,11 +145,12 @@ private:
 		}
 
 		size_t sz;
+		uint64_t mtime = get_mtime(filePath);
 		uint8_t *p = (uint8_t *)read_file(&sz, "%s", filePath.c_str());
 
 		// Can read?
 		if (p)
-			m_files[filePath] = new File(p, sz);
+			m_files[filePath] = new File(p, sz, mtime, m_generation);
 		else // Unreadable, populate with empty
 			m_files[filePath] = &m_empty;
 
@@ -94,6 +158,7 @@ private:
 	}
 
 	File m_empty;
+	unsigned int m_generation;
 
 	/* Pointer to avoid copies when populating the map. Move semantics
 	 * would be better, but is >= C++11.
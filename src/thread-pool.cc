@@ -0,0 +1,171 @@
+#include <thread-pool.hh>
+#include <utils.hh>
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+
+using namespace kcov;
+
+class ThreadPool : public IThreadPool
+{
+public:
+	ThreadPool() :
+		m_started(false)
+	{
+	}
+
+	void run(const std::vector<ITask *> &tasks)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		if (!m_started)
+			startWorkers();
+
+		// Nothing to gain from the workers
+		if (tasks.size() <= 1 || m_nWorkers == 0) {
+			lock.unlock();
+
+			for (unsigned int i = 0; i < tasks.size(); i++)
+				tasks[i]->run();
+
+			return;
+		}
+
+		Batch batch(tasks.size());
+
+		for (unsigned int i = 0; i < tasks.size(); i++)
+			m_jobs.push_back(Job(tasks[i], &batch));
+		m_cond.notify_all();
+
+		// Help out until our tasks are done, possibly with other batches
+		while (batch.m_left != 0) {
+			if (m_jobs.empty()) {
+				m_cond.wait(lock);
+				continue;
+			}
+
+			runOne(lock);
+		}
+	}
+
+	unsigned int getThreadCount()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (!m_started)
+			startWorkers();
+
+		return m_nWorkers + 1;
+	}
+
+private:
+	class Batch
+	{
+	public:
+		Batch(unsigned int left) :
+			m_left(left)
+		{
+		}
+
+		unsigned int m_left;
+	};
+
+	class Job
+	{
+	public:
+		Job(ITask *task, Batch *batch) :
+			m_task(task), m_batch(batch)
+		{
+		}
+
+		ITask *m_task;
+		Batch *m_batch;
+	};
+
+	// Called with the lock held and a job queued
+	void runOne(std::unique_lock<std::mutex> &lock)
+	{
+		Job job = m_jobs.front();
+
+		m_jobs.pop_front();
+
+		lock.unlock();
+		job.m_task->run();
+		lock.lock();
+
+		job.m_batch->m_left--;
+		if (job.m_batch->m_left == 0)
+			m_cond.notify_all();
+	}
+
+	void startWorkers()
+	{
+		long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+		sigset_t set, oldSet;
+
+		m_started = true;
+		m_nWorkers = 0;
+
+		// Signals are handled by the collector thread
+		sigfillset(&set);
+		pthread_sigmask(SIG_BLOCK, &set, &oldSet);
+
+		// The calling thread runs tasks as well
+		for (long i = 1; i < nCpus; i++) {
+			pthread_t thread;
+
+			if (pthread_create(&thread, NULL, ThreadPool::threadStatic, (void *)this) != 0) {
+				kcov_debug(INFO_MSG, "Can't create worker thread\n");
+				break;
+			}
+			pthread_detach(thread);
+			m_nWorkers++;
+		}
+
+		pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+	}
+
+	static void *threadStatic(void *pThis)
+	{
+		ThreadPool *p = (ThreadPool *)pThis;
+
+		p->workerThread();
+
+		return NULL;
+	}
+
+	void workerThread()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		while (1) {
+			while (m_jobs.empty())
+				m_cond.wait(lock);
+
+			runOne(lock);
+		}
+	}
+
+	typedef std::deque<Job> JobQueue_t;
+
+	bool m_started;
+	unsigned int m_nWorkers;
+	JobQueue_t m_jobs;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+};
+
+IThreadPool &IThreadPool::getInstance()
+{
+	static ThreadPool *g_instance;
+
+	if (!g_instance)
+		g_instance = new ThreadPool();
+
+	return *g_instance;
+}
@@ -21,6 +21,7 @@
 #include <stdexcept>
 #include <algorithm>
 #include <unordered_map>
+#include <mutex>
 
 int g_kcov_debug_mask = STATUS_MSG;
 static void* (*mocked_read_callback)(size_t* out_size, const char* path);
@@ -253,12 +254,14 @@ bool file_readable(FILE *fp, unsigned int ms)
 }
 
 static std::unordered_map<std::string, bool> statCache;
+static std::mutex statCacheMutex; // The writers run in several threads
 
 bool file_exists(const std::string &path)
 {
 	if (mocked_file_exists_callback)
 		return mocked_file_exists_callback(path);
 
+	std::lock_guard<std::mutex> lock(statCacheMutex);
 	bool out;
 
 	if (statCache.find(path) == statCache.end()) {
@@ -465,8 +468,12 @@ std::string trim_string(const std::string &strIn, const std::string &trimEndChar
 // Cache for ::realpath - it's apparently one of the reasons why kcov is slow
 typedef std::unordered_map<std::string, std::string> PathMap_t;
 static PathMap_t realPathCache;
+static std::mutex realPathMutex; // Filters also run in the DWARF parser threads
+
 const std::string &get_real_path(const std::string &path)
 {
+	// The returned references stay valid, entries are never removed
+	std::lock_guard<std::mutex> lock(realPathMutex);
 	PathMap_t::const_iterator it = realPathCache.find(path);
 	if (it != realPathCache.end())
 		return it->second;
@@ -484,6 +491,27 @@ const std::string &get_real_path(const std::string &path)
 	return realPathCache[path];
 }
 
+void revalidate_file_caches()
+{
+	std::lock_guard<std::mutex> statLock(statCacheMutex);
+	std::lock_guard<std::mutex> pathLock(realPathMutex);
+
+	statCache.clear();
+
+	// Update in place, references to the entries must stay valid
+	for (PathMap_t::iterator it = realPathCache.begin();
+			it != realPathCache.end();
+			++it) {
+		char *rp = ::realpath(it->first.c_str(), NULL);
+
+		if (rp)
+			it->second = rp;
+		else
+			it->second = it->first;
+		free(rp);
+	}
+}
+
 
 bool string_is_integer(const std::string &str, unsigned base)
 {
@@ -145,12 +145,12 @@ private:
 	std::string getHeader(unsigned int nCodeLines, unsigned int nExecutedLines)
 	{
 		time_t t;
-		struct tm *tm;
+		struct tm tm;
 		char date_buf[80];
 
 		t = time(NULL);
-		tm = localtime(&t);
-		strftime(date_buf, sizeof(date_buf), "%s", tm);
+		localtime_r(&t, &tm);
+		strftime(date_buf, sizeof(date_buf), "%s", &tm);
 
 		if (nCodeLines == 0)
 			nCodeLines = 1;
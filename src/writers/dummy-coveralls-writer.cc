@@ -15,9 +15,17 @@ public:
 	{
 	}
 
+	void onSnapshot()
+	{
+	}
+
 	void write()
 	{
 	}
+
+	void onWritten()
+	{
+	}
 };
 
 namespace kcov
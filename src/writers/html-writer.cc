@@ -3,6 +3,7 @@
 #include <configuration.hh>
 #include <writer.hh>
 #include <utils.hh>
+#include <thread-pool.hh>
 #include <generated-data-base.hh>
 
 #include <sys/stat.h>
@@ -284,15 +285,28 @@ private:
 
 	void write()
 	{
+		std::vector<FileTask> tasks;
+		std::vector<IThreadPool::ITask *> taskPointers;
+
+		tasks.reserve(m_files.size());
 		for (FileMap_t::const_iterator it = m_files.begin();
 				it != m_files.end();
-				++it)
-			writeOne(it->second);
+				++it) {
+			tasks.push_back(FileTask(*this, it->second));
+			taskPointers.push_back(&tasks.back());
+		}
+
+		// The files are written in parallel
+		IThreadPool::getInstance().run(taskPointers);
 
 		setupCommonPaths();
 
 		writeIndex();
+	}
 
+	// After the summary.db of the other writers have been written
+	void onWritten()
+	{
 		if (m_includeInTotals)
 			writeGlobalIndex();
 	}
@@ -364,12 +378,12 @@ private:
 	std::string getDateNow()
 	{
 		time_t t;
-		struct tm *tm;
+		struct tm tm;
 		char date_buf[128];
 
 		t = time(NULL);
-		tm = localtime(&t);
-		strftime(date_buf, sizeof(date_buf), "%Y-%m-%d %H:%M:%S", tm);
+		localtime_r(&t, &tm);
+		strftime(date_buf, sizeof(date_buf), "%Y-%m-%d %H:%M:%S", &tm);
 
 		return std::string(date_buf);
 	}
@@ -414,6 +428,23 @@ private:
 	}
 
 
+	class FileTask : public IThreadPool::ITask
+	{
+	public:
+		FileTask(HtmlWriter &writer, File *file) :
+			m_writer(writer), m_file(file)
+		{
+		}
+
+		void run()
+		{
+			m_writer.writeOne(m_file);
+		}
+
+		HtmlWriter &m_writer;
+		File *m_file;
+	};
+
 	std::string m_outDirectory;
 	std::string m_indexDirectory;
 	std::string m_summaryDbFileName;
@@ -118,12 +118,12 @@ private:
 	std::string getDateNow()
 	{
 		time_t t;
-		struct tm *tm;
+		struct tm tm;
 		char date_buf[128];
 
 		t = time(NULL);
-		tm = localtime(&t);
-		strftime(date_buf, sizeof(date_buf), "%Y-%m-%d %H:%M:%S", tm);
+		localtime_r(&t, &tm);
+		strftime(date_buf, sizeof(date_buf), "%Y-%m-%d %H:%M:%S", &tm);
 
 		return std::string(date_buf);
 	}
@@ -21,7 +21,7 @@ struct summaryStruct
 };
 
 WriterBase::WriterBase(IFileParser &parser, IReporter &reporter) :
-		m_fileParser(parser), m_reporter(reporter),
+		m_fileParser(parser), m_reporter(reporter.getSnapshot()),
 		m_commonPath("not set")
 {
 		m_fileParser.registerLineListener(*this);
@@ -36,8 +36,17 @@ WriterBase::~WriterBase()
 
 		delete cur;
 	}
+	for (FileMap_t::iterator it = m_newFiles.begin();
+			it != m_newFiles.end();
+			++it) {
+		File *cur = it->second;
+
+		delete cur;
+	}
 
 	m_files.clear();
+	m_newFiles.clear();
+	m_newFileOrder.clear();
 }
 
 WriterBase::File::File(const std::string &filename) :
@@ -93,13 +102,49 @@ void WriterBase::onLine(const std::string &file, unsigned int lineNr, uint64_t a
 	if (!m_reporter.fileIsIncluded(file))
 		return;
 
-	if (m_files.find(file) != m_files.end())
+	if (m_files.find(file) != m_files.end() ||
+			m_newFiles.find(file) != m_newFiles.end())
 		return;
 
 	if (!file_exists(file))
 		return;
 
-	m_files[file] = new File(file);
+	// m_files belongs to write(), which might be running
+	File *p = new File(file);
+
+	m_newFiles[file] = p;
+	m_newFileOrder.push_back(p);
+}
+
+void WriterBase::onFileLine(const std::string &file, unsigned int fileId,
+		unsigned int lineNr, uint64_t addr)
+{
+	// Only the file matters here, not the lines
+	if (fileId < m_fileIdSeen.size() && m_fileIdSeen[fileId])
+		return;
+
+	if (fileId >= m_fileIdSeen.size())
+		m_fileIdSeen.resize(fileId + 1, false);
+	m_fileIdSeen[fileId] = true;
+
+	onLine(file, lineNr, addr);
+}
+
+void WriterBase::onSnapshot()
+{
+	m_reporter.takeSnapshot();
+
+	for (unsigned int i = 0; i < m_newFileOrder.size(); i++) {
+		File *cur = m_newFileOrder[i];
+
+		m_files[cur->m_name] = cur;
+	}
+	m_newFiles.clear();
+	m_newFileOrder.clear();
+}
+
+void WriterBase::onWritten()
+{
 }
 
 
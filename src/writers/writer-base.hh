@@ -6,6 +6,7 @@
 
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 namespace kcov
 {
@@ -46,6 +47,13 @@ namespace kcov
 		/* Called when the ELF is parsed */
 		void onLine(const std::string &file, unsigned int lineNr, uint64_t addr);
 
+		void onFileLine(const std::string &file, unsigned int fileId,
+				unsigned int lineNr, uint64_t addr);
+
+		void onSnapshot();
+
+		void onWritten();
+
 
 		void *marshalSummary(IReporter::ExecutionSummary &summary,
 				const std::string &name, size_t *sz);
@@ -57,8 +65,11 @@ namespace kcov
 		void setupCommonPaths();
 
 		IFileParser &m_fileParser;
-		IReporter &m_reporter;
+		IReporter &m_reporter; // The snapshot
 		FileMap_t m_files;
+		FileMap_t m_newFiles; // Until the next snapshot
+		std::vector<File *> m_newFileOrder; // Keep the order of m_files
+		std::vector<bool> m_fileIdSeen; // onLine done for the file ID
 		std::string m_commonPath;
 	};
 }
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+static volatile long counts[2];
+
+static long work(long i)
+{
+	return i % 7;
+}
+
+static long late_work(long i)
+{
+	return i % 5;
+}
+
+static void run(volatile long *count, time_t end)
+{
+	long i;
+
+	for (i = 0; time(NULL) < end; i++)
+		*count += work(i);
+}
+
+static void *thread(void *arg)
+{
+	run(&counts[1], *(time_t *)arg);
+
+	return NULL;
+}
+
+/*
+ * Runs past the attach duration, then executes code kcov never saw hit:
+ * With breakpoints left behind, the program would die of a SIGTRAP.
+ */
+int main(int argc, const char *argv[])
+{
+	time_t end = time(NULL) + 3;
+	pthread_t t;
+	FILE *fp;
+
+	if (argc < 2)
+		return 1;
+
+	pthread_create(&t, NULL, thread, &end);
+	run(&counts[0], end);
+	pthread_join(t, NULL);
+
+	fp = fopen(argv[1], "w");
+	if (!fp)
+		return 1;
+	fprintf(fp, "done %ld\n", late_work(counts[0] + counts[1]));
+	fclose(fp);
+
+	return 0;
+}
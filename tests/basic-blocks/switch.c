@@ -0,0 +1,57 @@
+#include <stdio.h>
+
+/*
+ * Enough dense cases for a jump table, so that the cases are entered
+ * through an indirect jump rather than a direct branch. The even cases
+ * start in the middle of the basic block of the odd case before them.
+ */
+static int classify(int v)
+{
+	int out = 0;
+
+	switch (v) {
+	case 0:
+		out = 10;
+		break;
+	case 1:
+		out += 1;
+		/* Fall through */
+	case 2:
+		out += 2;
+		break;
+	case 3:
+		out += 3;
+		/* Fall through */
+	case 4:
+		out += 4;
+		break;
+	case 5:
+		out += 5;
+		/* Fall through */
+	case 6:
+		out += 6;
+		break;
+	case 7:
+		out += 7;
+		/* Fall through */
+	default:
+		out = -1;
+		break;
+	}
+
+	return out;
+}
+
+int main(int argc, const char *argv[])
+{
+	int sum = 0;
+	int i;
+
+	// Only the even cases
+	for (i = 0; i < 8; i += 2)
+		sum += classify(i);
+
+	printf("%d\n", sum);
+
+	return 0;
+}
@@ -0,0 +1,15 @@
+#include <stdio.h>
+
+int main(int argc, const char *argv[])
+{
+	int c = getchar();
+
+	if (c == 'a')
+		printf("a\n");
+	else if (c == 'b')
+		printf("b\n");
+	else
+		printf("something else\n");
+
+	return 0;
+}
@@ -0,0 +1,53 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+static volatile sig_atomic_t stops;
+
+static void sigchld(int sig, siginfo_t *info, void *ctx)
+{
+	if (info->si_code == CLD_STOPPED)
+		stops++;
+}
+
+int main(int argc, const char *argv[])
+{
+	struct sigaction sa;
+	int status;
+	pid_t child;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = sigchld;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigaction(SIGCHLD, &sa, NULL);
+
+	child = fork();
+	if (child < 0) {
+		fprintf(stderr, "fork failed!\n");
+		return -1;
+	}
+
+	if (child == 0) {
+		printf("In child\n");
+		return 3;
+	}
+
+	/* The child is never seen stopped, only exiting */
+	while (waitpid(child, &status, WUNTRACED) < 0)
+		;
+
+	if (WIFSTOPPED(status)) {
+		printf("Child stopped\n");
+		return 1;
+	}
+
+	if (stops != 0) {
+		printf("Got CLD_STOPPED\n");
+		return 2;
+	}
+
+	return WEXITSTATUS(status) == 3 ? 0 : 3;
+}
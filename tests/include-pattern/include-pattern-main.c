@@ -0,0 +1,12 @@
+#include <stdio.h>
+
+#include "../include/code-header.h"
+
+int main(int argc, const char *argv[])
+{
+	int v = header_sum(argc, 2);
+
+	printf("%d\n", v);
+
+	return 0;
+}
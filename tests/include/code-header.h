@@ -0,0 +1,13 @@
+#ifndef CODE_HEADER_H
+#define CODE_HEADER_H
+
+static inline int header_sum(int a, int b)
+{
+	int out = a;
+
+	out += b;
+
+	return out;
+}
+
+#endif
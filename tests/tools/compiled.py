@@ -3,6 +3,8 @@ import unittest
 import parse_cobertura
 import sys
 import os
+import subprocess
+import time
 
 class illegal_insn(testbase.KcovTestCase):
     @unittest.skipIf(not sys.platform.startswith("linux"), "Linux-only")
@@ -25,6 +27,18 @@ class fork_no_wait(testbase.KcovTestCase):
         assert parse_cobertura.hitsPerLine(dom, "fork-no-wait.c", 22) >= 1
         assert parse_cobertura.hitsPerLine(dom, "fork-no-wait.c", 24) >= 1
 
+class fork_wait_untraced(testbase.KcovTestCase):
+    @unittest.skipIf(not sys.platform.startswith("linux"), "Linux-only")
+    def runTest(self):
+        self.setUp()
+        # Forked processes are handed over to another tracer thread
+        rv,o = self.do(testbase.kcov + " --configure=tracer-threads=2 " + testbase.outbase + "/kcov " + testbase.testbuild + "/fork-wait-untraced", False)
+        assert rv == 0
+
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/fork-wait-untraced/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "fork-wait-untraced.c", 35) >= 1
+        assert parse_cobertura.hitsPerLine(dom, "fork-wait-untraced.c", 52) >= 1
+
 class ForkBase(testbase.KcovTestCase):
     def doTest(self, binary):
         self.setUp()
@@ -59,6 +73,21 @@ class vfork(testbase.KcovTestCase):
         assert parse_cobertura.hitsPerLine(dom, "vfork.c", 12) >= 1
         assert parse_cobertura.hitsPerLine(dom, "vfork.c", 18) >= 1
 
+class follow_exec(testbase.KcovTestCase):
+    @unittest.skipIf(not sys.platform.startswith("linux"), "Linux-only")
+    def runTest(self):
+        self.setUp()
+        rv,o = self.do(testbase.kcov + " --follow-exec " + testbase.outbase + "/kcov " + testbase.testbuild + "/fork+exec " + testbase.testbuild + "/main-tests", False)
+        assert rv == 0
+
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/fork+exec/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "fork+exec.c", 26) >= 1
+
+        # The exec:ed program is covered in its own directory
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/main-tests/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "main.cc", 9) == 1
+        assert parse_cobertura.hitsPerLine(dom, "main.cc", 25) == 1
+
 class shared_library(testbase.KcovTestCase):
     @unittest.skipIf(not sys.platform.startswith("linux"), "Linux-only, Issue #157")
     def runTest(self):
@@ -95,6 +124,19 @@ class shared_library_filter_out(testbase.KcovTestCase):
         assert parse_cobertura.hitsPerLine(dom, "solib.c", 5) == None
 
 
+# The compilation unit is kept for the included header, although its main file is filtered
+class include_pattern_header(testbase.KcovTestCase):
+    def runTest(self):
+        self.setUp()
+        rv,o = self.do(testbase.kcov + " --include-pattern=code-header.h " + testbase.outbase + "/kcov " + testbase.testbuild + "/include-pattern", False)
+        assert rv == 0
+
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/include-pattern/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "code-header.h", 6) == 1
+        assert parse_cobertura.hitsPerLine(dom, "code-header.h", 8) == 1
+        assert parse_cobertura.hitsPerLine(dom, "include-pattern-main.c", 7) == None
+
+
 class shared_library_accumulate(testbase.KcovTestCase):
     @unittest.skipIf(not sys.platform.startswith("linux"), "Linux-only, Issue #157")
     def runTest(self):
@@ -132,6 +174,70 @@ class main_test_verify(MainTestBase):
     def runTest(self):
         self.doTest("--verify")
 
+class main_test_in_process(MainTestBase):
+    @unittest.skipIf(not sys.platform.startswith("linux"), "Linux-only")
+    def runTest(self):
+        self.doTest("--in-process")
+
+class in_process_too_many_breakpoints(testbase.KcovTestCase):
+    @unittest.skipIf(not sys.platform.startswith("linux"), "Linux-only")
+    def runTest(self):
+        self.setUp()
+        rv,o = self.do(testbase.kcov + " --in-process --configure=in-process-max-breakpoints=3 " + testbase.outbase + "/kcov " + testbase.testbuild + "/main-tests", False)
+        assert rv != 0
+        assert b"in-process-max-breakpoints" in o
+        assert not os.path.exists(testbase.outbase + "/kcov/main-tests/cobertura.xml")
+
+class main_test_uprobes(MainTestBase):
+    @unittest.skipIf(not os.path.exists("/sys/kernel/tracing/uprobe_events") or os.geteuid() != 0, "Needs root and tracefs")
+    def runTest(self):
+        self.doTest("--uprobes")
+
+class uprobes_too_many_probes(testbase.KcovTestCase):
+    @unittest.skipIf(not os.path.exists("/sys/kernel/tracing/uprobe_events") or os.geteuid() != 0, "Needs root and tracefs")
+    def runTest(self):
+        self.setUp()
+        rv,o = self.do(testbase.kcov + " --uprobes --configure=uprobe-max-probes=5 " + testbase.outbase + "/kcov " + testbase.testbuild + "/main-tests", False)
+        assert rv != 0
+        assert b"uprobe-max-probes" in o
+        assert not os.path.exists(testbase.outbase + "/kcov/main-tests/cobertura.xml")
+
+class main_test_basic_blocks(MainTestBase):
+    def runTest(self):
+        self.doTest("--basic-blocks")
+
+class basic_blocks_switch(testbase.KcovTestCase):
+    def runTest(self):
+        self.setUp()
+        rv,o = self.do(testbase.kcov + " " + testbase.outbase + "/kcov " + testbase.testbuild + "/basic-blocks-switch", False)
+        assert rv == 0
+        rv,o = self.do(testbase.kcov + " --basic-blocks " + testbase.outbase + "/kcov-bb " + testbase.testbuild + "/basic-blocks-switch", False)
+        assert rv == 0
+
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/basic-blocks-switch/cobertura.xml")
+        bbDom = parse_cobertura.parseFile(testbase.outbase + "/kcov-bb/basic-blocks-switch/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "switch.c", 13) == 1
+        assert parse_cobertura.hitsPerLine(dom, "switch.c", 16) == 0
+        assert parse_cobertura.hitsPerLine(dom, "switch.c", 31) == 1
+
+        # The cases are entered through the jump table, not by a branch
+        for line in range(1, 58):
+            assert parse_cobertura.hitsPerLine(dom, "switch.c", line) == parse_cobertura.hitsPerLine(bbDom, "switch.c", line)
+
+class main_test_line_granularity(MainTestBase):
+    def runTest(self):
+        self.doTest("--granularity=line")
+
+class function_granularity(testbase.KcovTestCase):
+    def runTest(self):
+        self.setUp()
+        rv,o = self.do(testbase.kcov + " --granularity=function " + testbase.outbase + "/kcov " + testbase.testbuild + "/main-tests 5", False)
+
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/main-tests/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "main.cc", 21) == 1
+        assert parse_cobertura.hitsPerLine(dom, "main.cc", 22) == None
+        assert parse_cobertura.hitsPerLine(dom, "main.cc", 25) == None
+
 class main_test_lldb_raw_breakpoints(MainTestBase):
     def runTest(self):
         self.doTest("--configure=lldb-use-raw-breakpoint-writes=1")
@@ -267,6 +373,96 @@ class signals_crash(testbase.KcovTestCase):
         rv,o = self.do(testbase.kcov + " " + testbase.outbase + "/kcov " + testbase.testbuild + "/signals abrt self", False)
         assert o.find("kcov: Process exited with signal 6") != -1
 
+class fork_server(testbase.KcovTestCase):
+    @unittest.skipIf(not sys.platform.startswith("linux"), "Linux-only")
+    def runTest(self):
+        self.setUp()
+        inputs = []
+        for name in ["a", "b"]:
+            path = testbase.outbase + "/kcov/input-" + name
+            f = open(path, "w")
+            f.write(name)
+            f.close()
+            inputs.append(path)
+
+        f = open(testbase.outbase + "/kcov/inputs", "w")
+        f.write("\n".join(inputs) + "\n")
+        f.close()
+
+        rv,o = self.do(testbase.kcov + " --fork-server=" + testbase.outbase + "/kcov/inputs " + testbase.outbase + "/kcov " + testbase.testbuild + "/stdin-dependent", False)
+        assert rv == 0
+
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/stdin-dependent/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "stdin-dependent.c", 8) == 1
+        assert parse_cobertura.hitsPerLine(dom, "stdin-dependent.c", 10) == 1
+        assert parse_cobertura.hitsPerLine(dom, "stdin-dependent.c", 12) == 0
+
+class server(testbase.KcovTestCase):
+    @unittest.skipIf(not sys.platform.startswith("linux"), "Linux-only")
+    def runTest(self):
+        self.setUp()
+        socket = testbase.outbase + "/kcov/server.sock"
+        server = subprocess.Popen([testbase.kcov, "--server=" + socket])
+        for i in range(0, 50):
+            if os.path.exists(socket):
+                break
+            time.sleep(0.1)
+
+        try:
+            os.environ["KCOV_SERVER"] = socket
+            # The second run uses what the server kept from the first
+            for i in range(0, 2):
+                rv,o = self.do(testbase.kcov + " " + testbase.outbase + "/kcov " + testbase.testbuild + "/argv_dependent a", False)
+                assert rv == 0
+
+            # The exit code is passed back to the client
+            rv,o = self.do(testbase.kcov + " " + testbase.outbase + "/kcov " + testbase.testbuild + "/signals segv self", False)
+            assert o.find("kcov: Process exited with signal 11") != -1
+            assert rv != 0
+        finally:
+            del os.environ["KCOV_SERVER"]
+            server.kill()
+            server.wait()
+
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/argv_dependent/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "argv-dependent.c", 5) == 0
+        assert parse_cobertura.hitsPerLine(dom, "argv-dependent.c", 11) >= 1
+
+class line_cache(testbase.KcovTestCase):
+    @unittest.skipIf(not sys.platform.startswith("linux"), "Linux-only")
+    def runTest(self):
+        self.setUp()
+        cache = testbase.outbase + "/kcov/line-cache"
+        # The second run uses the line table stored by the first
+        for i in range(0, 2):
+            rv,o = self.do(testbase.kcov + " --line-cache=" + cache + " " + testbase.outbase + "/kcov " + testbase.testbuild + "/main-tests", False)
+
+            dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/main-tests/cobertura.xml")
+            assert parse_cobertura.hitsPerLine(dom, "main.cc", 9) == 1
+            assert parse_cobertura.hitsPerLine(dom, "main.cc", 14) == None
+
+        assert len(os.listdir(cache)) >= 1
+
+class line_cache_filtered(testbase.KcovTestCase):
+    @unittest.skipIf(not sys.platform.startswith("linux"), "Linux-only")
+    def runTest(self):
+        self.setUp()
+        cache = testbase.outbase + "/kcov/line-cache"
+        # Only the included compilation units are parsed and kept
+        for i in range(0, 2):
+            rv,o = self.do(testbase.kcov + " --line-cache=" + cache + " --include-pattern=subdir2 " + testbase.outbase + "/kcov " + testbase.testbuild + "/main-tests", False)
+
+            dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/main-tests/cobertura.xml")
+            assert parse_cobertura.hitsPerLine(dom, "file2.c", 6) == 1
+            assert parse_cobertura.hitsPerLine(dom, "main.cc", 9) == None
+
+        # Not reused without the filter
+        rv,o = self.do(testbase.kcov + " --line-cache=" + cache + " " + testbase.outbase + "/kcov " + testbase.testbuild + "/main-tests", False)
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/main-tests/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "main.cc", 9) == 1
+        assert parse_cobertura.hitsPerLine(dom, "file2.c", 6) == 1
+        assert len(os.listdir(cache)) >= 2
+
 class collect_and_report_only(testbase.KcovTestCase):
     # Cannot work with combined Engine / Parser
     @unittest.skipIf(not sys.platform.startswith("linux"), "Linux-only")
@@ -314,6 +510,29 @@ class attach_process_with_threads_creates_threads(testbase.KcovTestCase):
         assert parse_cobertura.hitsPerLine(dom, "thread-main.c", 21) >= 1
         assert parse_cobertura.hitsPerLine(dom, "thread-main.c", 9) >= 1
 
+class attach_duration(testbase.KcovTestCase):
+    @unittest.skipIf(not sys.platform.startswith("linux"), "Linux-only")
+    def runTest(self):
+        self.setUp()
+        marker = testbase.outbase + "/attach-duration.out"
+        if os.path.exists(marker):
+            os.remove(marker)
+
+        # kcov detaches after a second, the program runs for three
+        rv,o = self.do(testbase.kcov + " --attach-duration=1 " + testbase.outbase + "/kcov " + testbase.testbuild + "/attach-duration " + marker, False)
+        assert rv == 0
+
+        dom = parse_cobertura.parseFile(testbase.outbase + "/kcov/attach-duration/cobertura.xml")
+        assert parse_cobertura.hitsPerLine(dom, "attach-duration.c", 10) >= 1
+        assert parse_cobertura.hitsPerLine(dom, "attach-duration.c", 15) == 0
+
+        # Without kcov, it finishes (and doesn't die on a breakpoint)
+        for i in range(0, 100):
+            if os.path.exists(marker) and open(marker).read().startswith("done"):
+                break
+            time.sleep(0.1)
+        assert open(marker).read().startswith("done")
+
 class merge_same_file_in_multiple_binaries(testbase.KcovTestCase):
     def runTest(self):
         self.setUp()
@@ -0,0 +1,90 @@
+#include "test.hh"
+
+#include <file-parser.hh>
+
+#include <string>
+#include <vector>
+
+#include "../../src/parsers/dwarf.cc"
+
+using namespace kcov;
+
+class LineOrderListener : public IFileParser::ILineListener
+{
+public:
+	void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
+	{
+		m_lines.push_back(Line(file, lineNr, addr));
+	}
+
+	class Line
+	{
+	public:
+		Line(const std::string &file, unsigned int lineNr, uint64_t addr) :
+			m_file(file), m_lineNr(lineNr), m_addr(addr)
+		{
+		}
+
+		bool operator==(const Line &other) const
+		{
+			return m_file == other.m_file && m_lineNr == other.m_lineNr &&
+					m_addr == other.m_addr;
+		}
+
+		std::string m_file;
+		unsigned int m_lineNr;
+		uint64_t m_addr;
+	};
+
+	std::vector<Line> m_lines;
+};
+
+static unsigned int countCus(const char *filename)
+{
+	int fd = open(filename, O_RDONLY);
+	Dwarf_Off offset = 0;
+	size_t headerSize;
+	unsigned int out = 0;
+
+	if (fd < 0)
+		return 0;
+
+	Dwarf *dwarf = dwarf_begin(fd, DWARF_C_READ);
+
+	while (dwarf && dwarf_nextcu(dwarf, offset, &offset, &headerSize, 0, 0, 0) == 0)
+		out++;
+
+	if (dwarf)
+		dwarf_end(dwarf);
+	close(fd);
+
+	return out;
+}
+
+TEST(dwarfParallelDecoding, DEADLINE_REALTIME_MS(60000))
+{
+	// The unit test binary itself, with one CU per source file
+	const char *filename = "/proc/self/exe";
+
+	ASSERT_TRUE(countCus(filename) >= PARALLEL_MIN_CUS);
+
+	LineOrderListener serial;
+	DwarfParser serialParser;
+
+	ASSERT_TRUE(serialParser.open(filename));
+	serialParser.setThreadCount(1);
+	serialParser.forEachLine(serial);
+
+	// Parallel even without more than one CPU, tasks then run one by one
+	LineOrderListener parallel;
+	DwarfParser parallelParser;
+
+	ASSERT_TRUE(parallelParser.open(filename));
+	parallelParser.setThreadCount(4);
+	parallelParser.forEachLine(parallel);
+
+	ASSERT_TRUE(serial.m_lines.size() > 0U);
+	ASSERT_TRUE(serial.m_lines.size() == parallel.m_lines.size());
+	for (unsigned int i = 0; i < serial.m_lines.size(); i++)
+		ASSERT_TRUE(serial.m_lines[i] == parallel.m_lines[i]);
+}
@@ -1,6 +1,7 @@
 #include "test.hh"
 
 #include <file-parser.hh>
+#include <configuration.hh>
 #include <utils.hh>
 
 #include <string>
@@ -8,6 +9,8 @@
 
 #include <map>
 
+#include "../../src/parsers/elf.cc"
+
 using namespace kcov;
 
 class FunctionListener : public IFileParser::ILineListener
@@ -66,3 +69,32 @@ TEST(elf, DEADLINE_REALTIME_MS(30000))
 	std::string str = FunctionListener::constructString("/test-source.c", 8);
 	ASSERT_TRUE(listener.m_lineMap[str] > 0);
 }
+
+TEST(elfLandingPads, DEADLINE_REALTIME_MS(30000))
+{
+	const char *argv[] = {"kcov", "--basic-blocks", "/tmp/kcov-ut", "/proc/self/exe"};
+
+	// Only collected for basic blocks
+	ASSERT_TRUE(IConfiguration::getInstance().parse(4, argv));
+	elf_version(EV_CURRENT);
+
+	IElf *elf = IElf::create("/proc/self/exe");
+	ASSERT_TRUE(elf);
+
+	// The unit test binary itself catches exceptions
+	const std::vector<uint64_t> &pads = elf->getLandingPads();
+	const std::vector<Segment> &segments = elf->getSegments();
+
+	ASSERT_TRUE(pads.size() > 0U);
+	for (unsigned int i = 0; i < pads.size(); i++) {
+		bool inCode = false;
+
+		for (unsigned int j = 0; j < segments.size(); j++) {
+			if (segments[j].addressIsWithinSegment(pads[i]))
+				inCode = true;
+		}
+		ASSERT_TRUE(inCode);
+	}
+
+	delete elf;
+}
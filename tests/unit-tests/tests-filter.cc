@@ -80,6 +80,29 @@ TEST(filter)
 	res = filter.runFilters("/tmp");
 	ASSERT_TRUE(res);
 
+	// Results by file ID, the path is only used the first time
+	FilterCache cache(filter);
+
+	res = cache.runFilters(3, "/tmp");
+	ASSERT_TRUE(res);
+	res = cache.runFilters(0, std::string(crpcut::get_start_dir()) + "/svenne");
+	ASSERT_FALSE(res);
+	res = cache.runFilters(3, std::string(crpcut::get_start_dir()) + "/svenne");
+	ASSERT_TRUE(res);
+
+	// Overlapping patterns, "rce.c" ends within a partial "source.cx"
+	const char *argv6[] = {NULL, "--exclude-pattern=source.cx,rce.c", "/tmp/vobb", filename.c_str(), "tjena"};
+	res = conf.parse(5, argv6);
+	ASSERT_TRUE(res);
+	filter.setup();
+
+	res = filter.runFilters("/src/source.c");
+	ASSERT_FALSE(res);
+	res = filter.runFilters("/src/source.cx");
+	ASSERT_FALSE(res);
+	res = filter.runFilters("/src/source.h");
+	ASSERT_TRUE(res);
+
 	res = filter.runLineFilters("Kalle", 15, "Inget speciellt");
 	ASSERT_TRUE(res);
 }
@@ -4,10 +4,13 @@
 #include <collector.hh>
 #include <reporter.hh>
 #include <filter.hh>
+#include <configuration.hh>
 #include <utils.hh>
 
 #include <string>
+#include <vector>
 #include <unordered_map>
+#include <sys/stat.h>
 
 #include "../../src/reporter.cc"
 #include "mocks/mock-collector.hh"
@@ -33,6 +36,126 @@ public:
 	std::unordered_map<unsigned int, unsigned long> m_lineToAddr;
 };
 
+// Lines 1-4 of a "main" file and a "shared library", with accumulated hits
+class FakeParser : public IFileParser
+{
+public:
+	FakeParser(bool withSolib) :
+		m_withSolib(withSolib)
+	{
+		m_mainFile = fmt("%s/test-source.c", crpcut::get_start_dir());
+		m_solibFile = fmt("%s/second-source.c", crpcut::get_start_dir());
+	}
+
+	bool addFile(const std::string &filename, struct phdr_data_entry *phdr_data)
+	{
+		return true;
+	}
+
+	bool setMainFileRelocation(unsigned long relocation)
+	{
+		return true;
+	}
+
+	void registerLineListener(ILineListener &listener)
+	{
+		m_lineListeners.push_back(&listener);
+	}
+
+	void registerFileListener(IFileListener &listener)
+	{
+		m_fileListeners.push_back(&listener);
+	}
+
+	bool parse()
+	{
+		for (unsigned int i = 0; i < m_fileListeners.size(); i++)
+			m_fileListeners[i]->onFile(File(m_mainFile));
+
+		for (unsigned int i = 0; i < m_lineListeners.size(); i++) {
+			for (unsigned int line = 1; line <= 4; line++) {
+				m_lineListeners[i]->onLine(m_mainFile, line, mainAddress(line));
+				if (m_withSolib)
+					m_lineListeners[i]->onLine(m_solibFile, line, solibAddress(line));
+			}
+		}
+
+		return true;
+	}
+
+	uint64_t getChecksum()
+	{
+		return 0x1234;
+	}
+
+	std::string getParserType()
+	{
+		return "fake";
+	}
+
+	enum PossibleHits maxPossibleHits()
+	{
+		return HITS_UNLIMITED;
+	}
+
+	unsigned int matchParser(const std::string &filename, uint8_t *data, size_t dataSize)
+	{
+		return match_none;
+	}
+
+	void setupParser(IFilter *filter)
+	{
+	}
+
+	uint64_t mainAddress(unsigned int line)
+	{
+		return 0x1000 + line;
+	}
+
+	uint64_t solibAddress(unsigned int line)
+	{
+		return 0x2000 + line;
+	}
+
+	std::string m_mainFile;
+	std::string m_solibFile;
+
+private:
+	bool m_withSolib;
+	std::vector<ILineListener *> m_lineListeners;
+	std::vector<IFileListener *> m_fileListeners;
+};
+
+// Setup target-directory, where the coverage database is kept
+static std::string setupDatabaseDirectory(const char *name)
+{
+	std::string outDir = std::string(crpcut::get_start_dir()) + "/" + name;
+	char filename[1024];
+
+	sprintf(filename, "%s/test-binary", crpcut::get_start_dir());
+	system(fmt("rm -rf %s", outDir.c_str()).c_str());
+
+	const char *argv[] = {NULL, outDir.c_str(), filename};
+	IConfiguration &conf = IConfiguration::getInstance();
+	if (!conf.parse(3, argv))
+		return "";
+
+	mkdir(outDir.c_str(), 0755);
+	mkdir((outDir + "/test-binary").c_str(), 0755);
+
+	return outDir + "/test-binary/coverage.db";
+}
+
+static size_t databaseEntries(const std::string &dbFile)
+{
+	struct stat st;
+
+	if (stat(dbFile.c_str(), &st) < 0)
+		return 0;
+
+	return (st.st_size - sizeof(struct marshalHeaderStruct)) / (4 * sizeof(uint64_t));
+}
+
 TEST(reporter)
 {
 	ElfListener elfListener;
@@ -143,9 +266,200 @@ TEST(reporter)
 	ASSERT_FALSE(res);
 	hdr->db_version--;
 
+	// Truncated header
+	res = reporter.unMarshal(data, sizeof(struct marshalHeaderStruct) - 1);
+	ASSERT_FALSE(res);
+
 	hdr->magic++;
 	res = reporter.unMarshal(data, sz);
 	ASSERT_FALSE(res);
 
 	free(data);
+
+	// Hits by breakpoint ID
+	collector.m_listener->onBreakpoint(3, elfListener.m_lineToAddr[8]);
+	collector.m_listener->onBreakpointHit(3, elfListener.m_lineToAddr[8], 1);
+	lc = reporter.getLineExecutionCount(elfListener.m_file.c_str(), 8);
+	ASSERT_TRUE(lc.m_hits == 1U);
+
+	// Unknown IDs, or IDs of other addresses, are looked up by address
+	collector.m_listener->onBreakpointHit(3, elfListener.m_lineToAddr[9], 1);
+	collector.m_listener->onBreakpointHit(100, elfListener.m_lineToAddr[11], 1);
+	lc = reporter.getLineExecutionCount(elfListener.m_file.c_str(), 9);
+	ASSERT_TRUE(lc.m_hits == 1U);
+	lc = reporter.getLineExecutionCount(elfListener.m_file.c_str(), 11);
+	ASSERT_TRUE(lc.m_hits == 1U);
+
+	// The snapshot (for the writers) changes on takeSnapshot() only
+	IReporter &snapshot = reporter.getSnapshot();
+	lc = snapshot.getLineExecutionCount(elfListener.m_file.c_str(), 11);
+	ASSERT_TRUE(lc.m_hits == 0U);
+
+	reporter.takeSnapshot();
+	lc = snapshot.getLineExecutionCount(elfListener.m_file.c_str(), 11);
+	ASSERT_TRUE(lc.m_hits == 1U);
+	res = snapshot.lineIsCode(elfListener.m_file.c_str(), 19);
+	ASSERT_TRUE(res == true);
+	res = snapshot.lineIsCode(elfListener.m_file.c_str(), 13);
+	ASSERT_TRUE(res == false);
+	summary = snapshot.getExecutionSummary();
+	ASSERT_TRUE(summary.m_executedLines == reporter.getExecutionSummary().m_executedLines);
+}
+
+TEST(reporterDatabaseJournal)
+{
+	std::string dbFile = setupDatabaseDirectory("kcov-reporter-journal");
+	ASSERT_TRUE(dbFile != "");
+
+	FakeParser parser(false);
+	MockCollector collector;
+
+	REQUIRE_CALL(collector, registerListener(_))
+		.TIMES(2)
+		.LR_SIDE_EFFECT(collector.mockRegisterListener(_1))
+		;
+
+	Reporter *reporter = new Reporter(parser, collector, IFilter::create());
+	ASSERT_TRUE(parser.parse());
+
+	// The first write is a snapshot
+	collector.m_listener->onAddressHit(parser.mainAddress(1), 3);
+	reporter->writeCoverageDatabase();
+	ASSERT_TRUE(databaseEntries(dbFile) == 1U);
+
+	// Then deltas are appended, for changed addresses only
+	collector.m_listener->onAddressHit(parser.mainAddress(1), 2);
+	collector.m_listener->onAddressHit(parser.mainAddress(2), 1);
+	reporter->writeCoverageDatabase();
+	ASSERT_TRUE(databaseEntries(dbFile) == 3U);
+
+	reporter->writeCoverageDatabase();
+	ASSERT_TRUE(databaseEntries(dbFile) == 3U);
+
+	collector.m_listener->onAddressHit(parser.mainAddress(2), 4);
+	delete reporter;
+	ASSERT_TRUE(databaseEntries(dbFile) == 4U);
+
+	// Reloaded, the snapshot and the deltas are summed
+	FakeParser parser2(false);
+
+	reporter = new Reporter(parser2, collector, IFilter::create());
+	ASSERT_TRUE(parser2.parse());
+
+	IReporter::LineExecutionCount lc = reporter->getLineExecutionCount(parser2.m_mainFile, 1);
+	ASSERT_TRUE(lc.m_hits == 5U);
+	lc = reporter->getLineExecutionCount(parser2.m_mainFile, 2);
+	ASSERT_TRUE(lc.m_hits == 5U);
+	lc = reporter->getLineExecutionCount(parser2.m_mainFile, 3);
+	ASSERT_TRUE(lc.m_hits == 0U);
+
+	// Rewritten as a snapshot again in the new run
+	reporter->writeCoverageDatabase();
+	ASSERT_TRUE(databaseEntries(dbFile) == 2U);
+
+	delete reporter;
+}
+
+TEST(reporterDatabaseCompaction, DEADLINE_REALTIME_MS(20000))
+{
+	std::string dbFile = setupDatabaseDirectory("kcov-reporter-compaction");
+	ASSERT_TRUE(dbFile != "");
+
+	FakeParser parser(false);
+	MockCollector collector;
+
+	REQUIRE_CALL(collector, registerListener(_))
+		.TIMES(2)
+		.LR_SIDE_EFFECT(collector.mockRegisterListener(_1))
+		;
+
+	Reporter *reporter = new Reporter(parser, collector, IFilter::create());
+	ASSERT_TRUE(parser.parse());
+
+	collector.m_listener->onAddressHit(parser.mainAddress(1), 1);
+	collector.m_listener->onAddressHit(parser.mainAddress(2), 1);
+	reporter->writeCoverageDatabase();
+	ASSERT_TRUE(databaseEntries(dbFile) == 2U);
+
+	// One journal entry per write, until it's larger than the snapshot
+	size_t last = databaseEntries(dbFile);
+	unsigned int compactions = 0;
+	unsigned int i;
+
+	for (i = 0; i < DB_COMPACT_MIN_ENTRIES + 10; i++) {
+		collector.m_listener->onAddressHit(parser.mainAddress(1), 1);
+		reporter->writeCoverageDatabase();
+
+		size_t cur = databaseEntries(dbFile);
+
+		if (cur < last) {
+			// Compacted to the two addresses with hits
+			ASSERT_TRUE(cur == 2U);
+			ASSERT_TRUE(last > DB_COMPACT_MIN_ENTRIES);
+			compactions++;
+		} else {
+			ASSERT_TRUE(cur == last + 1);
+		}
+		last = cur;
+	}
+	ASSERT_TRUE(compactions == 1U);
+
+	delete reporter;
+
+	// No hits lost by the compaction
+	FakeParser parser2(false);
+
+	reporter = new Reporter(parser2, collector, IFilter::create());
+	ASSERT_TRUE(parser2.parse());
+
+	IReporter::LineExecutionCount lc = reporter->getLineExecutionCount(parser2.m_mainFile, 1);
+	ASSERT_TRUE(lc.m_hits == i + 1);
+	lc = reporter->getLineExecutionCount(parser2.m_mainFile, 2);
+	ASSERT_TRUE(lc.m_hits == 1U);
+
+	delete reporter;
+}
+
+TEST(reporterDatabasePendingHits)
+{
+	std::string dbFile = setupDatabaseDirectory("kcov-reporter-pending");
+	ASSERT_TRUE(dbFile != "");
+
+	MockCollector collector;
+
+	REQUIRE_CALL(collector, registerListener(_))
+		.TIMES(3)
+		.LR_SIDE_EFFECT(collector.mockRegisterListener(_1))
+		;
+
+	FakeParser parser(true);
+	Reporter *reporter = new Reporter(parser, collector, IFilter::create());
+	ASSERT_TRUE(parser.parse());
+
+	collector.m_listener->onAddressHit(parser.mainAddress(1), 1);
+	collector.m_listener->onAddressHit(parser.solibAddress(3), 2);
+	delete reporter;
+
+	// The shared library isn't loaded in this run, but keep its hits
+	FakeParser parser2(false);
+
+	reporter = new Reporter(parser2, collector, IFilter::create());
+	ASSERT_TRUE(parser2.parse());
+
+	collector.m_listener->onAddressHit(parser2.mainAddress(1), 1);
+	reporter->writeCoverageDatabase();
+	ASSERT_TRUE(databaseEntries(dbFile) == 2U);
+	delete reporter;
+
+	FakeParser parser3(true);
+
+	reporter = new Reporter(parser3, collector, IFilter::create());
+	ASSERT_TRUE(parser3.parse());
+
+	IReporter::LineExecutionCount lc = reporter->getLineExecutionCount(parser3.m_solibFile, 3);
+	ASSERT_TRUE(lc.m_hits == 2U);
+	lc = reporter->getLineExecutionCount(parser3.m_mainFile, 1);
+	ASSERT_TRUE(lc.m_hits == 2U);
+
+	delete reporter;
 }
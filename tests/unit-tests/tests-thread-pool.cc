@@ -0,0 +1,132 @@
+#include "test.hh"
+
+#include <thread-pool.hh>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace kcov;
+
+class CountingTask : public IThreadPool::ITask
+{
+public:
+	CountingTask(std::atomic<unsigned int> &count) :
+		m_count(count), m_runs(0)
+	{
+	}
+
+	void run()
+	{
+		m_runs++;
+		m_count++;
+	}
+
+	std::atomic<unsigned int> &m_count;
+	unsigned int m_runs;
+};
+
+// Runs a batch of its own from within the pool
+class NestingTask : public IThreadPool::ITask
+{
+public:
+	NestingTask(std::atomic<unsigned int> &count, unsigned int nTasks) :
+		m_count(count), m_nTasks(nTasks), m_done(false)
+	{
+	}
+
+	void run()
+	{
+		std::vector<CountingTask> tasks(m_nTasks, CountingTask(m_count));
+		std::vector<IThreadPool::ITask *> ptrs;
+
+		for (unsigned int i = 0; i < tasks.size(); i++)
+			ptrs.push_back(&tasks[i]);
+
+		IThreadPool::getInstance().run(ptrs);
+
+		// All nested tasks must be done when run() returns
+		m_done = true;
+		for (unsigned int i = 0; i < tasks.size(); i++) {
+			if (tasks[i].m_runs != 1)
+				m_done = false;
+		}
+	}
+
+	std::atomic<unsigned int> &m_count;
+	unsigned int m_nTasks;
+	bool m_done;
+};
+
+static void runBatch(std::atomic<unsigned int> *count, unsigned int nTasks, bool *ok)
+{
+	std::vector<NestingTask> tasks(nTasks, NestingTask(*count, 5));
+	std::vector<IThreadPool::ITask *> ptrs;
+
+	for (unsigned int i = 0; i < tasks.size(); i++)
+		ptrs.push_back(&tasks[i]);
+
+	IThreadPool::getInstance().run(ptrs);
+
+	*ok = true;
+	for (unsigned int i = 0; i < tasks.size(); i++) {
+		if (!tasks[i].m_done)
+			*ok = false;
+	}
+}
+
+TESTSUITE(thread_pool)
+{
+	TEST(allTasksRun)
+	{
+		std::atomic<unsigned int> count(0);
+		std::vector<CountingTask> tasks(100, CountingTask(count));
+		std::vector<IThreadPool::ITask *> ptrs;
+
+		ASSERT_TRUE(IThreadPool::getInstance().getThreadCount() >= 1U);
+
+		for (unsigned int i = 0; i < tasks.size(); i++)
+			ptrs.push_back(&tasks[i]);
+
+		IThreadPool::getInstance().run(ptrs);
+		ASSERT_TRUE(count == 100U);
+		for (unsigned int i = 0; i < tasks.size(); i++)
+			ASSERT_TRUE(tasks[i].m_runs == 1U);
+
+		// Empty and single-task batches
+		ptrs.clear();
+		IThreadPool::getInstance().run(ptrs);
+		ptrs.push_back(&tasks[0]);
+		IThreadPool::getInstance().run(ptrs);
+		ASSERT_TRUE(count == 101U);
+	}
+
+	TEST(nestedBatches, DEADLINE_REALTIME_MS(20000))
+	{
+		std::atomic<unsigned int> count(0);
+		bool ok = false;
+
+		// 20 tasks, each running 5 more from within the pool
+		runBatch(&count, 20, &ok);
+		ASSERT_TRUE(ok);
+		ASSERT_TRUE(count == 100U);
+	}
+
+	TEST(concurrentBatches, DEADLINE_REALTIME_MS(20000))
+	{
+		std::atomic<unsigned int> count(0);
+		std::vector<std::thread> threads;
+		bool ok[4] = {false, false, false, false};
+
+		// Several callers, e.g., writers and the parser, sharing the pool
+		for (unsigned int i = 0; i < 4; i++)
+			threads.push_back(std::thread(runBatch, &count, 10, &ok[i]));
+
+		for (unsigned int i = 0; i < threads.size(); i++)
+			threads[i].join();
+
+		for (unsigned int i = 0; i < 4; i++)
+			ASSERT_TRUE(ok[i]);
+		ASSERT_TRUE(count == 4 * 10 * 5U);
+	}
+}